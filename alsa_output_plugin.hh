@@ -6,6 +6,7 @@ extern "C" {
 #include <pthread.h>
 }
 
+#include "convert_kernels.hh"
 #include "plugin.hh"
 
 class alsa_output_plugin:
@@ -25,6 +26,8 @@ public:
 	void connect(unsigned int port, float* buffer);
 	void disconnect(unsigned int port);
 
+	bool is_audio_input(unsigned int port);
+
 	void run(unsigned int sample_count);
 
 private:
@@ -39,7 +42,15 @@ public:
 
 	snd_pcm_t* _playback_handle;
 
-	short* _frames[2];
+	/* What the device agreed to; may differ from the engine's rate */
+	unsigned long _rate;
+
+	/* Number of frames in _frames waiting to be written */
+	unsigned int _nr_frames;
+
+	int16_t* _frames[2];
+
+	dither_state _dither;
 };
 
 alsa_output_plugin::alsa_output_plugin(const char* device)
@@ -51,9 +62,12 @@ alsa_output_plugin::alsa_output_plugin(const char* device)
 		exit(EXIT_FAILURE);
 	}
 
-	_frames[0] = new short[buffer_size];
-	_frames[1] = new short[buffer_size];
+	_frames[0] = new int16_t[buffer_size];
+	_frames[1] = new int16_t[buffer_size];
+
+	init_dither(&_dither, 0);
 
+	_nr_ports = 2;
 	_ports = new float*[2];
 
 	pthread_cond_init(&_write_cond, NULL);
@@ -102,17 +116,39 @@ alsa_output_plugin::init(const char* device)
 	if (err < 0)
 		return err;
 
+	/* We'd rather resample ourselves than let the plug layer do it */
+	err = snd_pcm_hw_params_set_rate_resample(_playback_handle,
+		hw_params, 0);
+	if (err < 0)
+		return err;
+
 	unsigned int exact_rate = sample_rate;
 	err = snd_pcm_hw_params_set_rate_near(_playback_handle,
 		hw_params, &exact_rate, 0);
 	if (err < 0)
 		return err;
 
+	_rate = exact_rate;
+
 	err = snd_pcm_hw_params_set_channels(_playback_handle,
 		hw_params, 2);
 	if (err < 0)
 		return err;
 
+	/* One period per block, double buffered, so that the latency
+	 * follows the engine's block size */
+	snd_pcm_uframes_t period_size = buffer_size;
+	err = snd_pcm_hw_params_set_period_size_near(_playback_handle,
+		hw_params, &period_size, 0);
+	if (err < 0)
+		return err;
+
+	snd_pcm_uframes_t device_buffer_size = 2 * period_size;
+	err = snd_pcm_hw_params_set_buffer_size_near(_playback_handle,
+		hw_params, &device_buffer_size);
+	if (err < 0)
+		return err;
+
 	err = snd_pcm_hw_params(_playback_handle, hw_params);
 	if (err < 0)
 		return err;
@@ -167,10 +203,16 @@ alsa_output_plugin::disconnect(unsigned int port)
 	plugin::disconnect(port);
 }
 
+bool
+alsa_output_plugin::is_audio_input(unsigned int port)
+{
+	return port < 2;
+}
+
 void
 alsa_output_plugin::run(unsigned int n)
 {
-	assert(n == buffer_size);
+	assert(n <= buffer_size);
 
 	/* Wait until the previous buffer has been flushed */
 	pthread_mutex_lock(&_write_mutex);
@@ -180,15 +222,14 @@ alsa_output_plugin::run(unsigned int n)
 	}
 	pthread_mutex_unlock(&_write_mutex);
 
-	/* Copy the new buffer */
-	for (unsigned int i = 0; i < n; ++i) {
-		_frames[0][i] = 32 * 1024 * _ports[0][i];
-		_frames[1][i] = 32 * 1024 * _ports[1][i];
-	}
+	/* Copy the new buffer; clip rather than wrap around */
+	float_to_s16(_frames[0], _ports[0], n, 1, &_dither);
+	float_to_s16(_frames[1], _ports[1], n, 1, &_dither);
 
 	/* Wake up the writer thread */
 	pthread_mutex_lock(&_write_mutex);
 	assert(!_write_ready);
+	_nr_frames = n;
 	_write_ready = true;
 	pthread_cond_broadcast(&_write_cond);
 	pthread_mutex_unlock(&_write_mutex);
@@ -208,13 +249,13 @@ alsa_output_plugin::write_thread(void* arg)
 		}
 
 		bool write_exit = p->_write_exit;
+		unsigned int n = p->_nr_frames;
 		pthread_mutex_unlock(&p->_write_mutex);
 
 		if (write_exit)
 			break;
 
 		unsigned int i = 0;
-		unsigned int n = buffer_size; /* XXX */
 		while (n > 0) {
 			void* bufs[] = {
 				(void*) (p->_frames[0] + i),
@@ -0,0 +1,172 @@
+#ifndef AUTOMATION_HH
+#define AUTOMATION_HH
+
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <math.h>
+}
+
+#include "plugin.hh"
+
+/* A breakpoint envelope that drives one control port of a plugin.
+ *
+ * Like sequencers, lanes are added to the graph and advanced by run()
+ * once per block. Each block the lane writes its value at the start of
+ * the block to the port, for plugins that read their controls once per
+ * run(), and renders a per-sample ramp that plugins which know about
+ * ramps find in _ramps[port]. The envelope itself is only evaluated
+ * every _granularity samples, and the ramp is interpolated linearly in
+ * between, so even steps come out without zipper noise and exponential
+ * segments cost one pow() per control period. */
+class automation_lane {
+public:
+	/* The shape of the segment that ends at a point */
+	enum curve {
+		CURVE_STEP,
+		CURVE_LINEAR,
+		CURVE_EXPONENTIAL,
+	};
+
+	struct point {
+		unsigned long time;
+		float value;
+		curve shape;
+	};
+
+	typedef std::vector<point> point_vector;
+
+public:
+	automation_lane(plugin* p, unsigned int port,
+		unsigned int granularity = 32);
+	~automation_lane();
+
+public:
+	void add(unsigned long time, float value, curve shape = CURVE_LINEAR);
+	float value_at(unsigned long time);
+
+	void run(unsigned int sample_count);
+
+public:
+	plugin* _plugin;
+	unsigned int _port;
+	unsigned int _granularity;
+
+private:
+	point_vector _points;
+
+	/* First point after the time value_at() was last asked about */
+	unsigned int _next;
+
+	unsigned long _time;
+	float _value;
+
+	float* _ramp;
+};
+
+automation_lane::automation_lane(plugin* p, unsigned int port,
+	unsigned int granularity):
+	_plugin(p),
+	_port(port),
+	_granularity(granularity),
+	_next(0),
+	_time(0)
+{
+	assert(port < p->_nr_ports);
+	assert(!p->is_audio_input(port) && !p->is_audio_output(port));
+	assert(granularity > 0);
+
+	_value = p->_ports[port][0];
+	_ramp = new float[buffer_size];
+}
+
+automation_lane::~automation_lane()
+{
+	delete[] _ramp;
+}
+
+/* Points are kept sorted by time; must not be called while the lane is
+ * in a graph */
+void
+automation_lane::add(unsigned long time, float value, curve shape)
+{
+	point p;
+	p.time = time;
+	p.value = value;
+	p.shape = shape;
+
+	point_vector::iterator i = _points.end();
+	while (i != _points.begin() && (i - 1)->time > time)
+		--i;
+
+	_points.insert(i, p);
+
+	_next = 0;
+	if (_time == 0)
+		_value = value_at(0);
+}
+
+/* Times must not go backwards between calls */
+float
+automation_lane::value_at(unsigned long time)
+{
+	unsigned int n = _points.size();
+	if (n == 0)
+		return _value;
+
+	while (_next < n && _points[_next].time <= time)
+		++_next;
+
+	if (_next == 0)
+		return _points[0].value;
+	if (_next == n)
+		return _points[n - 1].value;
+
+	const point& a = _points[_next - 1];
+	const point& b = _points[_next];
+	float x = (float) (time - a.time) / (b.time - a.time);
+
+	switch (b.shape) {
+	case CURVE_STEP:
+		return a.value;
+	case CURVE_EXPONENTIAL:
+		/* Only between values of the same sign */
+		if (a.value * b.value > 0)
+			return a.value * powf(b.value / a.value, x);
+		break;
+	case CURVE_LINEAR:
+		break;
+	}
+
+	return a.value + (b.value - a.value) * x;
+}
+
+void
+automation_lane::run(unsigned int sample_count)
+{
+	float v0 = _value;
+
+	for (unsigned int i = 0; i < sample_count; i += _granularity) {
+		unsigned int m = sample_count - i;
+		if (m > _granularity)
+			m = _granularity;
+
+		float v1 = value_at(_time + i + m);
+		float step = (v1 - v0) / m;
+
+		for (unsigned int j = 0; j < m; ++j)
+			_ramp[i + j] = v0 + step * j;
+
+		v0 = v1;
+	}
+
+	_plugin->_ports[_port][0] = _ramp[0];
+	_plugin->_ramps[_port] = _ramp;
+	_plugin->_ramp_periods[_port] = _granularity;
+
+	_value = v0;
+	_time += sample_count;
+}
+
+#endif
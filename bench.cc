@@ -0,0 +1,660 @@
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+/* Set for each configuration; see main.cc */
+static unsigned long sample_rate = 44100;
+static unsigned long buffer_size = 16384;
+
+static const unsigned long min_buffer_size = 32;
+static const unsigned long max_buffer_size = 16384;
+
+static const unsigned long min_sample_rate = 8000;
+static const unsigned long max_sample_rate = 192000;
+
+static float* silence_buffer;
+static bool silence_flag = true;
+
+#include "convert_kernels.hh"
+#include "graph.hh"
+#include "lowpass_plugin.hh"
+#include "meter_kernels.hh"
+#include "mix_kernels.hh"
+#include "mixer_plugin.hh"
+#include "note_cache.hh"
+#include "organ_plugin.hh"
+#include "parallel_executor.hh"
+#include "plugin.hh"
+#include "poly_plugin.hh"
+#include "resampler.hh"
+#include "sine_plugin.hh"
+#include "sine_voice_plugin.hh"
+
+/* Benchmarks the engine on synthetic graphs of N sine voices -> mixer ->
+ * low-pass filter, which need no LADSPA libraries or sound card.
+ *
+ * For every combination of voice count, block size and thread count it
+ * prints one CSV line per node type (timed on its own, outside the
+ * graph) and one for the whole graph. The graph's scheduling overhead
+ * is what a serial block costs on top of running its nodes. The voices
+ * are also played as chords on a poly_plugin, with and without a note
+ * cache; the cache's hit rate goes to stderr.
+ *
+ * With -k it instead times every version of the sample conversion and
+ * mixing (and metering) kernels that the CPU supports against the scalar ones, and
+ * the resampler's quality presets at a few common rate pairs. */
+
+typedef std::vector<unsigned long> value_vector;
+
+/* Wall-clock time to spend on each measurement, in seconds */
+static double min_time = 0.2;
+
+static double
+now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static void
+parse_list(const char* s, value_vector& values)
+{
+	values.clear();
+
+	while (*s) {
+		char* end;
+		unsigned long v = strtoul(s, &end, 0);
+		if (end == s || v == 0) {
+			fprintf(stderr, "invalid list: %s\n", s);
+			exit(EXIT_FAILURE);
+		}
+
+		values.push_back(v);
+
+		s = end;
+		if (*s == ',')
+			++s;
+	}
+}
+
+/* Runs a plugin on its own, outside any graph, for min_time seconds.
+ * Returns the time per block in nanoseconds. */
+static double
+time_plugin(plugin* p)
+{
+	for (unsigned int i = 0; i < 16; ++i)
+		p->run(buffer_size);
+
+	unsigned long nr_blocks = 0;
+	double start = now();
+	double elapsed;
+
+	do {
+		for (unsigned int i = 0; i < 16; ++i)
+			p->run(buffer_size);
+
+		nr_blocks += 16;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	return 1e9 * elapsed / nr_blocks;
+}
+
+static void
+print_line(const char* name, unsigned long voices, unsigned long threads,
+	double ns_per_block, bool have_overhead, double overhead)
+{
+	printf("%s,%lu,%lu,%lu,%.1f,%.3f,", name, voices, buffer_size,
+		threads, 1e9 / ns_per_block, ns_per_block / buffer_size);
+
+	if (have_overhead)
+		printf("%.1f", overhead);
+
+	printf("\n");
+}
+
+/* A poly_plugin with twice as many sine voices as are played at once,
+ * playing chords of "voices" notes. Each chord is held for 16384 frames
+ * and then released as the next one starts, and the same four chords
+ * come round again and again, so with a cache all but the first few
+ * are played back from it. Returns the time per block in nanoseconds. */
+static double
+bench_poly(unsigned long voices, note_cache* cache)
+{
+	std::vector<float> out(buffer_size);
+
+	poly_plugin::plugin_vector pool;
+	for (unsigned int i = 0; i < 2 * voices; ++i) {
+		plugin* v = new sine_voice_plugin();
+		v->_ports[5][0] = 0.01;	/* Release */
+		pool.push_back(v);
+	}
+
+	poly_plugin poly(pool, 1, 3, 2, 0, poly_plugin::STEAL_OLDEST);
+	poly.setup_ports();
+	poly.connect(0, &out[0]);
+	if (cache)
+		poly.set_cache(cache);
+
+	unsigned long hold = max_buffer_size / buffer_size;
+	unsigned long nr_blocks = 0;
+	unsigned int chord = 0;
+	double start = now();
+	double elapsed = 0;
+
+	do {
+		poly._events.clear();
+
+		for (unsigned int j = 0; nr_blocks % hold == 0 && j < voices;
+			++j)
+		{
+			event e = event();
+			e.channel = j / 96;
+			e.velocity = 100;
+
+			if (nr_blocks) {
+				e.type = EVENT_NOTE_OFF;
+				e.note = 16 + (5 * j + 2 * ((chord + 3) % 4)) % 96;
+				poly._events.push_back(e);
+			}
+
+			e.type = EVENT_NOTE_ON;
+			e.note = 16 + (5 * j + 2 * chord) % 96;
+			e.value = 440 * pow(2, (e.note - 69) / 12.);
+			e.duration = hold * buffer_size;
+			poly._events.push_back(e);
+		}
+
+		if (nr_blocks % hold == 0)
+			chord = (chord + 1) % 4;
+
+		poly.run(buffer_size);
+
+		if (++nr_blocks % 16 == 0)
+			elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	return 1e9 * elapsed / nr_blocks;
+}
+
+/* The cost of each kind of node on its own, for one configuration.
+ * Returns the total for all the nodes of the graph, per block. */
+static double
+bench_nodes(unsigned long voices)
+{
+	std::vector<float> in(buffer_size, 0.1);
+	std::vector<float> out(buffer_size);
+	bool not_silent = false;
+
+	sine_plugin sine(440);
+	sine.setup_ports();
+	sine.connect(0, &out[0]);
+
+	double sine_ns = time_plugin(&sine);
+	print_line("sine", 1, 1, sine_ns, false, 0);
+
+	mixer_plugin mixer(voices);
+	mixer.setup_ports();
+	mixer.connect(0, &out[0]);
+	for (unsigned int i = 0; i < voices; ++i) {
+		mixer.connect(1 + i, &in[0]);
+		mixer._silent[1 + i] = &not_silent;
+	}
+
+	double mixer_ns = time_plugin(&mixer);
+	print_line("mixer", voices, 1, mixer_ns, false, 0);
+
+	lowpass_plugin lowpass(2000);
+	lowpass.setup_ports();
+	lowpass.connect(0, &in[0]);
+	lowpass.connect(1, &out[0]);
+
+	double lowpass_ns = time_plugin(&lowpass);
+	print_line("lowpass", 1, 1, lowpass_ns, false, 0);
+
+	/* Not part of the graph; for comparison with voices * sine */
+	organ_plugin organ(voices);
+	organ.setup_ports();
+	organ.connect(0, &out[0]);
+
+	for (unsigned int i = 0; i < voices; ++i) {
+		event e = event();
+		e.type = EVENT_NOTE_ON;
+		e.value = 110 + 10 * i;
+		e.note = i;
+		e.velocity = 100;
+		organ._events.push_back(e);
+	}
+
+	organ.run(buffer_size);
+	organ._events.clear();
+
+	print_line("organ", voices, 1, time_plugin(&organ), false, 0);
+
+	/* Nor are these */
+	print_line("poly", voices, 1, bench_poly(voices, 0), false, 0);
+
+	note_cache cache(voices << 20);
+	print_line("poly_cached", voices, 1, bench_poly(voices, &cache),
+		false, 0);
+
+	unsigned long lookups = cache._nr_hits + cache._nr_misses;
+	fprintf(stderr, "note cache, %lu voices, %lu frames: %.1f%% hits "
+		"(%lu of %lu notes)\n", voices, buffer_size,
+		lookups ? 100. * cache._nr_hits / lookups : 0.,
+		cache._nr_hits, lookups);
+
+	return voices * sine_ns + mixer_ns + lowpass_ns;
+}
+
+/* One version of each kernel, as picked by init_*_kernels() */
+struct kernel_set {
+	const char* name;
+	const char* feature;
+	convert_s16_kernel s16;
+	convert_s32_kernel s32;
+	interleave_kernel interleave;
+	deinterleave_kernel deinterleave;
+	mix_kernel add;
+	meter_levels_kernel levels;
+	meter_true_peak_kernel true_peak;
+};
+
+static const kernel_set kernel_sets[] = {
+	{ "scalar", 0, &convert_s16_scalar, &convert_s32_scalar,
+		&interleave_scalar, &deinterleave_scalar, &mix_add_scalar,
+		&meter_levels_scalar, &meter_true_peak_scalar },
+#ifdef CONVERT_KERNELS_X86
+	{ "sse2", "sse2", &convert_s16_sse2, &convert_s32_sse2,
+		&interleave_sse2, &deinterleave_sse2, &mix_add_sse2,
+		&meter_levels_sse2, &meter_true_peak_sse2 },
+	{ "avx2", "avx2", &convert_s16_avx2, &convert_s32_avx2,
+		&interleave_avx2, &deinterleave_avx2, &mix_add_avx2,
+		&meter_levels_avx2, &meter_true_peak_avx2 },
+#endif
+};
+
+#ifdef CONVERT_KERNELS_X86
+/* __builtin_cpu_supports() only takes literals */
+static bool
+cpu_supports(const char* feature)
+{
+	if (!strcmp(feature, "sse2"))
+		return __builtin_cpu_supports("sse2");
+	if (!strcmp(feature, "avx2"))
+		return __builtin_cpu_supports("avx2");
+
+	return false;
+}
+#endif
+
+enum kernel_type {
+	KERNEL_S16,
+	KERNEL_S16_DITHER,
+	KERNEL_S24,
+	KERNEL_INTERLEAVE,
+	KERNEL_DEINTERLEAVE,
+	KERNEL_MIX_ADD,
+	KERNEL_LEVELS,
+	KERNEL_TRUE_PEAK,
+	NR_KERNELS,
+};
+
+static const char* kernel_names[] = {
+	"s16", "s16_dither", "s24", "interleave2", "deinterleave2", "mix_add",
+	"levels", "true_peak",
+};
+
+/* Only the cost matters, not the response */
+static float meter_taps[4 * 12];
+
+static void
+run_kernel(const kernel_set* k, kernel_type type, unsigned int n,
+	float** planar, float* interleaved, int32_t* s32, dither_state* d)
+{
+	float peak, sum;
+
+	switch (type) {
+	case KERNEL_S16:
+		k->s16((int16_t*) s32, planar[0], n, 32768.f, 0);
+		break;
+	case KERNEL_S16_DITHER:
+		k->s16((int16_t*) s32, planar[0], n, 32768.f, d);
+		break;
+	case KERNEL_S24:
+		k->s32(s32, planar[0], n, 8388608.f,
+			-8388608.f, 8388607.f, 0);
+		break;
+	case KERNEL_INTERLEAVE:
+		k->interleave(interleaved, planar, 2, n);
+		break;
+	case KERNEL_DEINTERLEAVE:
+		k->deinterleave(planar, interleaved, 2, n);
+		break;
+	case KERNEL_MIX_ADD:
+		k->add(planar[0], planar[1], 0.5, n);
+		break;
+	case KERNEL_LEVELS:
+		k->levels(planar[0], n, &peak, &sum);
+		break;
+	case KERNEL_TRUE_PEAK:
+		/* 4 phases of 12 taps, as in meter_plugin; the first 11
+		 * samples stand in for the previous block's */
+		k->true_peak(planar[0] + 11, n - 11, meter_taps, 12, 4);
+		break;
+	default:
+		assert(false);
+	}
+}
+
+/* Prints the time per sample of every kernel version for one block
+ * size; a sample is one frame of one channel */
+static void
+bench_kernels()
+{
+	std::vector<float> left(buffer_size);
+	std::vector<float> right(buffer_size);
+	std::vector<float> interleaved(2 * buffer_size);
+	std::vector<int32_t> s32(buffer_size);
+
+	for (unsigned int i = 0; i < buffer_size; ++i) {
+		left[i] = sinf(i * 0.01);
+		right[i] = cosf(i * 0.01);
+	}
+
+	float* planar[] = { &left[0], &right[0] };
+
+	dither_state d;
+	init_dither(&d, 0);
+
+	for (unsigned int i = 0; i < 4 * 12; ++i)
+		meter_taps[i] = 1. / 12;
+
+	for (unsigned int i = 0;
+		i < sizeof(kernel_sets) / sizeof(*kernel_sets); ++i)
+	{
+		const kernel_set* k = &kernel_sets[i];
+
+#ifdef CONVERT_KERNELS_X86
+		if (k->feature && !cpu_supports(k->feature))
+			continue;
+#endif
+
+		for (unsigned int j = 0; j < NR_KERNELS; ++j) {
+			kernel_type type = (kernel_type) j;
+
+			unsigned long nr_blocks = 0;
+			double start = now();
+			double elapsed;
+
+			do {
+				for (unsigned int l = 0; l < 16; ++l) {
+					run_kernel(k, type, buffer_size, planar,
+						&interleaved[0], &s32[0], &d);
+				}
+
+				nr_blocks += 16;
+				elapsed = now() - start;
+			} while (elapsed < min_time);
+
+			/* The (de)interleavers move two channels at once */
+			unsigned long samples = nr_blocks * buffer_size;
+			if (type == KERNEL_INTERLEAVE
+				|| type == KERNEL_DEINTERLEAVE)
+			{
+				samples *= 2;
+			}
+
+			printf("%s,%s,%lu,%.4f\n", kernel_names[j], k->name,
+				buffer_size, 1e9 * elapsed / samples);
+		}
+	}
+}
+
+/* Prints the time per input sample of each resampler preset; the
+ * version column is the quality and the rate pair */
+static void
+bench_resampler()
+{
+	static const unsigned long rates[][2] = {
+		{ 44100, 48000 },
+		{ 48000, 44100 },
+		{ 44100, 88200 },
+		{ 88200, 44100 },
+	};
+
+	std::vector<float> in(buffer_size);
+	for (unsigned int i = 0; i < buffer_size; ++i)
+		in[i] = sinf(i * 0.01);
+
+	const float* inputs[] = { &in[0] };
+
+	for (unsigned int q = 0; q <= resampler::QUALITY_BEST; ++q) {
+		for (unsigned int i = 0; i < sizeof(rates) / sizeof(*rates);
+			++i)
+		{
+			resampler r(1, rates[i][0], rates[i][1],
+				(resampler::quality) q, buffer_size);
+			std::vector<float> out(r.max_output(buffer_size));
+			float* outputs[] = { &out[0] };
+
+			unsigned long nr_blocks = 0;
+			double start = now();
+			double elapsed;
+
+			do {
+				for (unsigned int l = 0; l < 16; ++l)
+					r.run(inputs, buffer_size, outputs);
+
+				nr_blocks += 16;
+				elapsed = now() - start;
+			} while (elapsed < min_time);
+
+			printf("resample,%s-%lu-%lu,%lu,%.4f\n",
+				resampler::quality_name((resampler::quality) q),
+				rates[i][0], rates[i][1], buffer_size,
+				1e9 * elapsed / (nr_blocks * buffer_size));
+		}
+	}
+}
+
+/* Returns the time per block in nanoseconds */
+static double
+bench_graph(unsigned long voices, unsigned long threads)
+{
+	graph* g = new graph();
+
+	parallel_executor* executor = 0;
+	if (threads > 1) {
+		executor = new parallel_executor(threads);
+		g->set_executor(executor);
+	}
+
+	std::vector<plugin*> sines;
+	for (unsigned int i = 0; i < voices; ++i)
+		sines.push_back(new sine_plugin(110 + 10 * i));
+
+	plugin* mixer = new mixer_plugin(voices);
+	plugin* lowpass = new lowpass_plugin(2000);
+
+	g->begin_edit();
+
+	for (unsigned int i = 0; i < voices; ++i)
+		g->add(sines[i]);
+	g->add(mixer);
+	g->add(lowpass);
+
+	for (unsigned int i = 0; i < voices; ++i)
+		g->connect(sines[i], 0, mixer, 1 + i);
+	g->connect(mixer, 0, lowpass, 0);
+
+	g->end_edit();
+
+	g->activate();
+
+	for (unsigned int i = 0; i < 16; ++i)
+		g->run(buffer_size);
+
+	unsigned long nr_blocks = 0;
+	double start = now();
+	double elapsed;
+
+	do {
+		for (unsigned int i = 0; i < 16; ++i)
+			g->run(buffer_size);
+
+		nr_blocks += 16;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+
+	g->deactivate();
+
+	g->set_executor(0);
+	delete executor;
+
+	g->begin_edit();
+
+	g->disconnect(mixer, 0, lowpass, 0);
+	for (unsigned int i = 0; i < voices; ++i)
+		g->disconnect(sines[i], 0, mixer, 1 + i);
+
+	g->remove(lowpass);
+	g->remove(mixer);
+	for (unsigned int i = 0; i < voices; ++i)
+		g->remove(sines[i]);
+
+	g->end_edit();
+
+	delete g;
+
+	delete lowpass;
+	delete mixer;
+	for (unsigned int i = 0; i < voices; ++i)
+		delete sines[i];
+
+	return 1e9 * elapsed / nr_blocks;
+}
+
+int
+main(int argc, char* argv[])
+{
+	value_vector voices;
+	value_vector block_sizes;
+	value_vector threads;
+	bool kernels = false;
+
+	parse_list("1,16,64,256", voices);
+	parse_list("64,256,1024,4096", block_sizes);
+	parse_list("1,2,4", threads);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:j:kr:t:v:")) != -1) {
+		switch (opt) {
+		case 'b':
+			parse_list(optarg, block_sizes);
+			break;
+		case 'j':
+			parse_list(optarg, threads);
+			break;
+		case 'k':
+			kernels = true;
+			break;
+		case 'r':
+			sample_rate = strtoul(optarg, NULL, 0);
+			if (sample_rate < min_sample_rate
+				|| sample_rate > max_sample_rate)
+			{
+				fprintf(stderr, "sample rate must be between "
+					"%lu and %lu Hz\n",
+					min_sample_rate, max_sample_rate);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'v':
+			parse_list(optarg, voices);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b frames,...] "
+				"[-j threads,...] [-k] [-r rate] [-t seconds] "
+				"[-v voices,...]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (unsigned int i = 0; i < block_sizes.size(); ++i) {
+		if (block_sizes[i] < min_buffer_size
+			|| block_sizes[i] > max_buffer_size)
+		{
+			fprintf(stderr, "block size must be between "
+				"%lu and %lu frames\n",
+				min_buffer_size, max_buffer_size);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	silence_buffer = new float[max_buffer_size]();
+
+	init_mix_kernels();
+	init_convert_kernels();
+	init_meter_kernels();
+	fprintf(stderr, "%s mixing, %s conversion, %s metering\n",
+		mix_kernel_name, convert_kernel_name, meter_kernel_name);
+
+	if (kernels) {
+		printf("kernel,version,block,ns_per_sample\n");
+
+		for (unsigned int i = 0; i < block_sizes.size(); ++i) {
+			buffer_size = block_sizes[i];
+			bench_kernels();
+			bench_resampler();
+		}
+
+		delete[] silence_buffer;
+		return EXIT_SUCCESS;
+	}
+
+	printf("name,voices,block,threads,blocks_per_s,ns_per_sample,"
+		"overhead_ns_per_block\n");
+
+	for (unsigned int i = 0; i < block_sizes.size(); ++i) {
+		buffer_size = block_sizes[i];
+
+		for (unsigned int j = 0; j < voices.size(); ++j) {
+			double work = bench_nodes(voices[j]);
+
+			for (unsigned int k = 0; k < threads.size(); ++k) {
+				double t = bench_graph(voices[j], threads[k]);
+
+				/* Only meaningful when nothing runs in parallel.
+				 * The nodes are timed separately, with warmer
+				 * caches than in the graph or colder ones, so
+				 * small graphs can come out below zero, which
+				 * is just noise. */
+				double overhead = t - work;
+				if (overhead < 0)
+					overhead = 0;
+
+				print_line("graph", voices[j], threads[k], t,
+					threads[k] == 1, overhead);
+			}
+
+			fflush(stdout);
+		}
+	}
+
+	delete[] silence_buffer;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+#ifndef BUFFER_POOL_HH
+#define BUFFER_POOL_HH
+
+#include <vector>
+
+/* The audio buffers that the graph hands out to output ports. Which
+ * port gets which buffer is decided by graph::allocate_buffers().
+ *
+ * Each buffer has a flag that is true while it is known to hold nothing
+ * but zeros; see plugin::process(). */
+class buffer_pool {
+public:
+	typedef std::vector<float*> buffer_vector;
+	typedef std::vector<bool*> flag_vector;
+
+public:
+	buffer_pool();
+	~buffer_pool();
+
+public:
+	float* get(unsigned int i);
+	bool* silent(unsigned int i);
+	void resize(unsigned int n);
+
+	unsigned int size() const;
+	unsigned long bytes() const;
+
+private:
+	buffer_vector _buffers;
+	flag_vector _silent;
+};
+
+buffer_pool::buffer_pool()
+{
+}
+
+buffer_pool::~buffer_pool()
+{
+	resize(0);
+}
+
+float*
+buffer_pool::get(unsigned int i)
+{
+	if (i >= _buffers.size())
+		resize(i + 1);
+
+	return _buffers[i];
+}
+
+bool*
+buffer_pool::silent(unsigned int i)
+{
+	if (i >= _buffers.size())
+		resize(i + 1);
+
+	return _silent[i];
+}
+
+void
+buffer_pool::resize(unsigned int n)
+{
+	while (_buffers.size() > n) {
+		delete[] _buffers.back();
+		_buffers.pop_back();
+
+		delete _silent.back();
+		_silent.pop_back();
+	}
+
+	while (_buffers.size() < n) {
+		_buffers.push_back(new float[buffer_size]());
+		_silent.push_back(new bool(true));
+	}
+}
+
+unsigned int
+buffer_pool::size() const
+{
+	return _buffers.size();
+}
+
+unsigned long
+buffer_pool::bytes() const
+{
+	return _buffers.size() * buffer_size * sizeof(float);
+}
+
+#endif
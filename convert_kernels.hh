@@ -0,0 +1,472 @@
+#ifndef CONVERT_KERNELS_HH
+#define CONVERT_KERNELS_HH
+
+extern "C" {
+#include <math.h>
+#include <stdint.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_KERNELS_X86 1
+#endif
+
+#ifdef CONVERT_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/* Sample format conversion and (de)interleaving for the output stages.
+ *
+ * The float to integer conversions scale, optionally add TPDF dither,
+ * saturate and round to nearest. The dither comes from eight xorshift
+ * generators that are used round-robin, sample i drawing from generator
+ * i % 8; together with doing the same float operations in the same
+ * order, this keeps every version of a kernel bit-for-bit identical. */
+
+struct dither_state {
+	uint32_t s[8];
+};
+
+static void
+init_dither(dither_state* d, uint32_t seed)
+{
+	for (unsigned int i = 0; i < 8; ++i) {
+		/* Anything but zero */
+		d->s[i] = 2654435761U * (seed + i + 1);
+		if (!d->s[i])
+			d->s[i] = 1;
+	}
+}
+
+/* out[i] = round(clamp(scale * in[i] + dither, lo, hi)) */
+typedef void (*convert_s32_kernel)(int32_t* out, const float* in,
+	unsigned int n, float scale, float lo, float hi, dither_state* d);
+typedef void (*convert_s16_kernel)(int16_t* out, const float* in,
+	unsigned int n, float scale, dither_state* d);
+
+typedef void (*interleave_kernel)(float* out, const float* const* in,
+	unsigned int channels, unsigned int n);
+typedef void (*deinterleave_kernel)(float* const* out, const float* in,
+	unsigned int channels, unsigned int n);
+
+static inline uint32_t
+xorshift32(uint32_t x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+/* Triangular noise of +/- 1 LSB */
+static inline float
+dither_scalar(dither_state* d, unsigned int lane)
+{
+	uint32_t a = xorshift32(d->s[lane]);
+	uint32_t b = xorshift32(a);
+	d->s[lane] = b;
+
+	return (float) (int32_t) a * (1.f / 4294967296.f)
+		+ (float) (int32_t) b * (1.f / 4294967296.f);
+}
+
+static void
+convert_s32_scalar(int32_t* out, const float* in, unsigned int n,
+	float scale, float lo, float hi, dither_state* d)
+{
+	for (unsigned int i = 0; i < n; ++i) {
+		float x = scale * in[i];
+		if (d)
+			x = x + dither_scalar(d, i % 8);
+
+		x = x < lo ? lo : x;
+		x = x > hi ? hi : x;
+		out[i] = lrintf(x);
+	}
+}
+
+static void
+convert_s16_scalar(int16_t* out, const float* in, unsigned int n,
+	float scale, dither_state* d)
+{
+	for (unsigned int i = 0; i < n; ++i) {
+		float x = scale * in[i];
+		if (d)
+			x = x + dither_scalar(d, i % 8);
+
+		x = x < -32768.f ? -32768.f : x;
+		x = x > 32767.f ? 32767.f : x;
+		out[i] = lrintf(x);
+	}
+}
+
+static void
+interleave_scalar(float* out, const float* const* in,
+	unsigned int channels, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; ++i) {
+		for (unsigned int c = 0; c < channels; ++c)
+			out[channels * i + c] = in[c][i];
+	}
+}
+
+static void
+deinterleave_scalar(float* const* out, const float* in,
+	unsigned int channels, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; ++i) {
+		for (unsigned int c = 0; c < channels; ++c)
+			out[c][i] = in[channels * i + c];
+	}
+}
+
+#ifdef CONVERT_KERNELS_X86
+__attribute__((target("sse2"))) static inline __m128
+dither_sse2(__m128i* s)
+{
+	__m128i a = *s;
+	a = _mm_xor_si128(a, _mm_slli_epi32(a, 13));
+	a = _mm_xor_si128(a, _mm_srli_epi32(a, 17));
+	a = _mm_xor_si128(a, _mm_slli_epi32(a, 5));
+
+	__m128i b = a;
+	b = _mm_xor_si128(b, _mm_slli_epi32(b, 13));
+	b = _mm_xor_si128(b, _mm_srli_epi32(b, 17));
+	b = _mm_xor_si128(b, _mm_slli_epi32(b, 5));
+	*s = b;
+
+	__m128 k = _mm_set1_ps(1.f / 4294967296.f);
+	return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(a), k),
+		_mm_mul_ps(_mm_cvtepi32_ps(b), k));
+}
+
+/* Scale, dither and clamp four samples drawing from generators s */
+__attribute__((target("sse2"))) static inline __m128i
+convert_sse2(const float* in, __m128 scale, __m128 lo, __m128 hi,
+	__m128i* s)
+{
+	__m128 x = _mm_mul_ps(scale, _mm_loadu_ps(in));
+	if (s)
+		x = _mm_add_ps(x, dither_sse2(s));
+
+	x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+	return _mm_cvtps_epi32(x);
+}
+
+__attribute__((target("sse2"))) static void
+convert_s32_sse2(int32_t* out, const float* in, unsigned int n,
+	float scale, float lo, float hi, dither_state* d)
+{
+	__m128 vscale = _mm_set1_ps(scale);
+	__m128 vlo = _mm_set1_ps(lo);
+	__m128 vhi = _mm_set1_ps(hi);
+
+	__m128i s[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+	if (d) {
+		s[0] = _mm_loadu_si128((const __m128i*) &d->s[0]);
+		s[1] = _mm_loadu_si128((const __m128i*) &d->s[4]);
+	}
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = convert_sse2(in + i, vscale, vlo, vhi,
+			d ? &s[0] : 0);
+		__m128i b = convert_sse2(in + i + 4, vscale, vlo, vhi,
+			d ? &s[1] : 0);
+		_mm_storeu_si128((__m128i*) (out + i), a);
+		_mm_storeu_si128((__m128i*) (out + i + 4), b);
+	}
+
+	if (d) {
+		_mm_storeu_si128((__m128i*) &d->s[0], s[0]);
+		_mm_storeu_si128((__m128i*) &d->s[4], s[1]);
+	}
+
+	convert_s32_scalar(out + i, in + i, n - i, scale, lo, hi, d);
+}
+
+__attribute__((target("sse2"))) static void
+convert_s16_sse2(int16_t* out, const float* in, unsigned int n,
+	float scale, dither_state* d)
+{
+	__m128 vscale = _mm_set1_ps(scale);
+	__m128 vlo = _mm_set1_ps(-32768.f);
+	__m128 vhi = _mm_set1_ps(32767.f);
+
+	__m128i s[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+	if (d) {
+		s[0] = _mm_loadu_si128((const __m128i*) &d->s[0]);
+		s[1] = _mm_loadu_si128((const __m128i*) &d->s[4]);
+	}
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = convert_sse2(in + i, vscale, vlo, vhi,
+			d ? &s[0] : 0);
+		__m128i b = convert_sse2(in + i + 4, vscale, vlo, vhi,
+			d ? &s[1] : 0);
+		_mm_storeu_si128((__m128i*) (out + i), _mm_packs_epi32(a, b));
+	}
+
+	if (d) {
+		_mm_storeu_si128((__m128i*) &d->s[0], s[0]);
+		_mm_storeu_si128((__m128i*) &d->s[4], s[1]);
+	}
+
+	convert_s16_scalar(out + i, in + i, n - i, scale, d);
+}
+
+__attribute__((target("sse2"))) static void
+interleave_sse2(float* out, const float* const* in,
+	unsigned int channels, unsigned int n)
+{
+	if (channels != 2) {
+		interleave_scalar(out, in, channels, n);
+		return;
+	}
+
+	const float* l = in[0];
+	const float* r = in[1];
+
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_loadu_ps(l + i);
+		__m128 b = _mm_loadu_ps(r + i);
+		_mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(a, b));
+		_mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(a, b));
+	}
+
+	for (; i < n; ++i) {
+		out[2 * i + 0] = l[i];
+		out[2 * i + 1] = r[i];
+	}
+}
+
+__attribute__((target("sse2"))) static void
+deinterleave_sse2(float* const* out, const float* in,
+	unsigned int channels, unsigned int n)
+{
+	if (channels != 2) {
+		deinterleave_scalar(out, in, channels, n);
+		return;
+	}
+
+	float* l = out[0];
+	float* r = out[1];
+
+	unsigned int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 a = _mm_loadu_ps(in + 2 * i);
+		__m128 b = _mm_loadu_ps(in + 2 * i + 4);
+		_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, 0x88));
+		_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, 0xdd));
+	}
+
+	for (; i < n; ++i) {
+		l[i] = in[2 * i + 0];
+		r[i] = in[2 * i + 1];
+	}
+}
+
+__attribute__((target("avx2"))) static inline __m256
+dither_avx2(__m256i* s)
+{
+	__m256i a = *s;
+	a = _mm256_xor_si256(a, _mm256_slli_epi32(a, 13));
+	a = _mm256_xor_si256(a, _mm256_srli_epi32(a, 17));
+	a = _mm256_xor_si256(a, _mm256_slli_epi32(a, 5));
+
+	__m256i b = a;
+	b = _mm256_xor_si256(b, _mm256_slli_epi32(b, 13));
+	b = _mm256_xor_si256(b, _mm256_srli_epi32(b, 17));
+	b = _mm256_xor_si256(b, _mm256_slli_epi32(b, 5));
+	*s = b;
+
+	__m256 k = _mm256_set1_ps(1.f / 4294967296.f);
+	return _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(a), k),
+		_mm256_mul_ps(_mm256_cvtepi32_ps(b), k));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+convert_avx2(const float* in, __m256 scale, __m256 lo, __m256 hi,
+	__m256i* s)
+{
+	__m256 x = _mm256_mul_ps(scale, _mm256_loadu_ps(in));
+	if (s)
+		x = _mm256_add_ps(x, dither_avx2(s));
+
+	x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+	return _mm256_cvtps_epi32(x);
+}
+
+__attribute__((target("avx2"))) static void
+convert_s32_avx2(int32_t* out, const float* in, unsigned int n,
+	float scale, float lo, float hi, dither_state* d)
+{
+	__m256 vscale = _mm256_set1_ps(scale);
+	__m256 vlo = _mm256_set1_ps(lo);
+	__m256 vhi = _mm256_set1_ps(hi);
+
+	__m256i s = _mm256_setzero_si256();
+	if (d)
+		s = _mm256_loadu_si256((const __m256i*) d->s);
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = convert_avx2(in + i, vscale, vlo, vhi,
+			d ? &s : 0);
+		_mm256_storeu_si256((__m256i*) (out + i), a);
+	}
+
+	if (d)
+		_mm256_storeu_si256((__m256i*) d->s, s);
+
+	convert_s32_scalar(out + i, in + i, n - i, scale, lo, hi, d);
+}
+
+__attribute__((target("avx2"))) static void
+convert_s16_avx2(int16_t* out, const float* in, unsigned int n,
+	float scale, dither_state* d)
+{
+	__m256 vscale = _mm256_set1_ps(scale);
+	__m256 vlo = _mm256_set1_ps(-32768.f);
+	__m256 vhi = _mm256_set1_ps(32767.f);
+
+	__m256i s = _mm256_setzero_si256();
+	if (d)
+		s = _mm256_loadu_si256((const __m256i*) d->s);
+
+	unsigned int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i a = convert_avx2(in + i, vscale, vlo, vhi,
+			d ? &s : 0);
+		__m256i b = convert_avx2(in + i + 8, vscale, vlo, vhi,
+			d ? &s : 0);
+
+		/* packs works within 128-bit lanes; put them back in order */
+		__m256i c = _mm256_permute4x64_epi64(
+			_mm256_packs_epi32(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i*) (out + i), c);
+	}
+
+	if (d)
+		_mm256_storeu_si256((__m256i*) d->s, s);
+
+	convert_s16_scalar(out + i, in + i, n - i, scale, d);
+}
+
+__attribute__((target("avx2"))) static void
+interleave_avx2(float* out, const float* const* in,
+	unsigned int channels, unsigned int n)
+{
+	if (channels != 2) {
+		interleave_scalar(out, in, channels, n);
+		return;
+	}
+
+	const float* l = in[0];
+	const float* r = in[1];
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 a = _mm256_loadu_ps(l + i);
+		__m256 b = _mm256_loadu_ps(r + i);
+		__m256 lo = _mm256_unpacklo_ps(a, b);
+		__m256 hi = _mm256_unpackhi_ps(a, b);
+		_mm256_storeu_ps(out + 2 * i,
+			_mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(out + 2 * i + 8,
+			_mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+
+	for (; i < n; ++i) {
+		out[2 * i + 0] = l[i];
+		out[2 * i + 1] = r[i];
+	}
+}
+
+__attribute__((target("avx2"))) static void
+deinterleave_avx2(float* const* out, const float* in,
+	unsigned int channels, unsigned int n)
+{
+	if (channels != 2) {
+		deinterleave_scalar(out, in, channels, n);
+		return;
+	}
+
+	float* l = out[0];
+	float* r = out[1];
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 a = _mm256_loadu_ps(in + 2 * i);
+		__m256 b = _mm256_loadu_ps(in + 2 * i + 8);
+		__m256 lo = _mm256_permute2f128_ps(a, b, 0x20);
+		__m256 hi = _mm256_permute2f128_ps(a, b, 0x31);
+		_mm256_storeu_ps(l + i, _mm256_shuffle_ps(lo, hi, 0x88));
+		_mm256_storeu_ps(r + i, _mm256_shuffle_ps(lo, hi, 0xdd));
+	}
+
+	for (; i < n; ++i) {
+		l[i] = in[2 * i + 0];
+		r[i] = in[2 * i + 1];
+	}
+}
+#endif
+
+static convert_s32_kernel convert_s32 = &convert_s32_scalar;
+static convert_s16_kernel convert_s16 = &convert_s16_scalar;
+static interleave_kernel interleave = &interleave_scalar;
+static deinterleave_kernel deinterleave = &deinterleave_scalar;
+static const char* convert_kernel_name = "scalar";
+
+/* Pick the kernels for the CPU we're running on; safe to call more than
+ * once, but not while somebody may be using them */
+static void
+init_convert_kernels()
+{
+#ifdef CONVERT_KERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		convert_s32 = &convert_s32_avx2;
+		convert_s16 = &convert_s16_avx2;
+		interleave = &interleave_avx2;
+		deinterleave = &deinterleave_avx2;
+		convert_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		convert_s32 = &convert_s32_sse2;
+		convert_s16 = &convert_s16_sse2;
+		interleave = &interleave_sse2;
+		deinterleave = &deinterleave_sse2;
+		convert_kernel_name = "sse2";
+	}
+#endif
+}
+
+/* Full scale is +/- 1.0; pass d = 0 for no dither */
+static inline void
+float_to_s16(int16_t* out, const float* in, unsigned int n,
+	float gain, dither_state* d)
+{
+	convert_s16(out, in, n, 32768.f * gain, d);
+}
+
+/* 24 bits in the low bits of 32, as in SND_PCM_FORMAT_S24 */
+static inline void
+float_to_s24(int32_t* out, const float* in, unsigned int n,
+	float gain, dither_state* d)
+{
+	convert_s32(out, in, n, 8388608.f * gain,
+		-8388608.f, 8388607.f, d);
+}
+
+/* 2^31 - 1 isn't a float; 2^31 - 128 is the largest one below it */
+static inline void
+float_to_s32(int32_t* out, const float* in, unsigned int n,
+	float gain, dither_state* d)
+{
+	convert_s32(out, in, n, 2147483648.f * gain,
+		-2147483648.f, 2147483520.f, d);
+}
+
+#endif
@@ -0,0 +1,539 @@
+#ifndef CONVOLVER_PLUGIN_HH
+#define CONVOLVER_PLUGIN_HH
+
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sndfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+}
+
+#include "denormals.hh"
+#include "fft.hh"
+#include "plugin.hh"
+
+/* Convolution reverb with an impulse response loaded from a sound file.
+ * Port 0 is the (mono) input, 1 and 2 the left and right outputs, which
+ * use the first and second channel of the impulse response. 3 and 4 are
+ * the dry and wet levels.
+ *
+ * The impulse response is cut into partitions that grow towards the
+ * tail (non-uniform partitioned convolution). Each partition size is a
+ * "level" that does uniformly partitioned overlap-save convolution with
+ * an FFT twice its size. Level 0 uses the block size and is computed in
+ * run(), so the head of the response adds no latency. Every level after
+ * it has partitions 4 times as large and starts at twice its partition
+ * size into the response: by the time a partition's worth of input has
+ * come in, its output isn't needed for another partition's worth, and
+ * the level is computed on its own thread in the meantime. run() only
+ * waits for it if it hasn't made that deadline. */
+class convolver_plugin:
+	public plugin
+{
+public:
+	convolver_plugin(const char* filename);
+	~convolver_plugin();
+
+public:
+	void activate();
+	void deactivate();
+
+	bool is_audio_input(unsigned int port);
+	bool is_audio_output(unsigned int port);
+
+	unsigned int latency();
+
+	void run(unsigned int sample_count);
+
+private:
+	struct level {
+		convolver_plugin* convolver;
+
+		/* Partition size, and where in the response the level starts */
+		unsigned int size;
+		unsigned int offset;
+		unsigned int nr_partitions;
+
+		/* Blocks per partition */
+		unsigned int nr_blocks;
+
+		fft* f;
+		unsigned int nr_bins;
+
+		/* The partitions' spectra, nr_partitions * nr_bins per channel */
+		float* ir_re[2];
+		float* ir_im[2];
+
+		/* Spectra of the last nr_partitions input partitions; the
+		 * newest is at fdl_pos */
+		float* fdl_re;
+		float* fdl_im;
+		unsigned int fdl_pos;
+
+		float* acc_re;
+		float* acc_im;
+		float* frame;
+
+		/* The previous partition of input and the one being filled */
+		float* input;
+
+		/* Levels after 0: double buffered so that the audio thread
+		 * can fill one while the level's thread works on the other */
+		float* job_input[2];
+		float* result[2][2];
+
+		pthread_t thread;
+		sem_t start;
+		sem_t done;
+		unsigned long nr_done;
+		bool exit;
+	};
+
+	typedef std::vector<level*> level_vector;
+
+private:
+	void load(const char* filename);
+	void setup_levels();
+	void reset();
+
+	void convolve(level* l, const float* in, float* const* out);
+
+	static void* level_thread(void* arg);
+
+private:
+	unsigned int _nr_channels;
+	unsigned int _length;
+	std::vector<float> _ir[2];
+
+	level_vector _levels;
+
+	/* Blocks run() has processed since activate() */
+	unsigned long _block;
+
+	/* Samples since the input was last not silent */
+	unsigned long _quiet;
+
+	float* _wet[2];
+};
+
+convolver_plugin::convolver_plugin(const char* filename):
+	_block(0),
+	_quiet(0)
+{
+	if (buffer_size & (buffer_size - 1)) {
+		fprintf(stderr, "convolver: block size must be a power "
+			"of two\n");
+		exit(EXIT_FAILURE);
+	}
+
+	load(filename);
+	setup_levels();
+
+	_nr_ports = 5;
+	_ports = new float*[5];
+
+	_ports[0] = silence_buffer;
+
+	/* Bound by the graph */
+	_ports[1] = 0;
+	_ports[2] = 0;
+
+	_ports[3] = new float[1];	/* Dry */
+	_ports[3][0] = 1;
+	_ports[4] = new float[1];	/* Wet */
+	_ports[4][0] = 1;
+
+	_wet[0] = new float[buffer_size];
+	_wet[1] = new float[buffer_size];
+}
+
+convolver_plugin::~convolver_plugin()
+{
+	for (unsigned int i = 0; i < _levels.size(); ++i) {
+		level* l = _levels[i];
+
+		delete l->f;
+		for (unsigned int c = 0; c < 2; ++c) {
+			delete[] l->ir_re[c];
+			delete[] l->ir_im[c];
+			delete[] l->job_input[c];
+			delete[] l->result[c][0];
+			delete[] l->result[c][1];
+		}
+
+		delete[] l->fdl_re;
+		delete[] l->fdl_im;
+		delete[] l->acc_re;
+		delete[] l->acc_im;
+		delete[] l->frame;
+		delete[] l->input;
+
+		delete l;
+	}
+
+	delete[] _wet[0];
+	delete[] _wet[1];
+
+	delete[] _ports[3];
+	delete[] _ports[4];
+	delete[] _ports;
+}
+
+void
+convolver_plugin::load(const char* filename)
+{
+	SF_INFO info;
+	memset(&info, 0, sizeof(info));
+
+	SNDFILE* file = sf_open(filename, SFM_READ, &info);
+	if (!file) {
+		fprintf(stderr, "%s: %s\n", filename, sf_strerror(NULL));
+		exit(EXIT_FAILURE);
+	}
+
+	if ((unsigned long) info.samplerate != sample_rate) {
+		printf("warning: %s is %d Hz, not %lu Hz\n",
+			filename, info.samplerate, sample_rate);
+	}
+
+	_nr_channels = info.channels > 1 ? 2 : 1;
+	_length = info.frames;
+	if (_length == 0) {
+		fprintf(stderr, "%s: empty impulse response\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<float> frames(_length * info.channels);
+	if (sf_readf_float(file, &frames[0], _length) != (sf_count_t) _length)
+		exit(1);
+
+	sf_close(file);
+
+	/* A mono response is used for both outputs */
+	for (unsigned int c = 0; c < 2; ++c) {
+		unsigned int channel = c < _nr_channels ? c : 0;
+
+		_ir[c].resize(_length);
+		for (unsigned int i = 0; i < _length; ++i)
+			_ir[c][i] = frames[i * info.channels + channel];
+	}
+}
+
+void
+convolver_plugin::setup_levels()
+{
+	static const unsigned int growth = 4;
+	static const unsigned int max_size = 65536;
+
+	unsigned int size = buffer_size;
+	unsigned int offset = 0;
+
+	while (offset < _length) {
+		unsigned int next_size = size * growth;
+		if (next_size > max_size)
+			next_size = size > max_size ? size : max_size;
+
+		/* The next level starts at twice its partition size; the last
+		 * one takes whatever is left */
+		unsigned int end = next_size > size ? 2 * next_size : _length;
+		if (end > _length)
+			end = _length;
+
+		level* l = new level();
+		l->convolver = this;
+		l->size = size;
+		l->offset = offset;
+		l->nr_partitions = (end - offset + size - 1) / size;
+		l->nr_blocks = size / buffer_size;
+
+		l->f = new fft(2 * size);
+		l->nr_bins = size + 1;
+
+		unsigned int n = l->nr_partitions * l->nr_bins;
+		std::vector<float> frame(2 * size);
+
+		for (unsigned int c = 0; c < 2; ++c) {
+			l->ir_re[c] = new float[n];
+			l->ir_im[c] = new float[n];
+
+			for (unsigned int j = 0; j < l->nr_partitions; ++j) {
+				unsigned int start = offset + j * size;
+
+				for (unsigned int i = 0; i < size; ++i) {
+					frame[i] = start + i < _length
+						? _ir[c][start + i] : 0;
+				}
+
+				for (unsigned int i = size; i < 2 * size; ++i)
+					frame[i] = 0;
+
+				l->f->forward(&frame[0],
+					l->ir_re[c] + j * l->nr_bins,
+					l->ir_im[c] + j * l->nr_bins);
+			}
+
+			l->job_input[c] = new float[2 * size];
+			l->result[c][0] = new float[size];
+			l->result[c][1] = new float[size];
+		}
+
+		l->fdl_re = new float[n];
+		l->fdl_im = new float[n];
+		l->acc_re = new float[l->nr_bins];
+		l->acc_im = new float[l->nr_bins];
+		l->frame = new float[2 * size];
+		l->input = new float[2 * size];
+
+		_levels.push_back(l);
+
+		offset += l->nr_partitions * size;
+		size = next_size;
+	}
+
+	printf("convolver: %u samples, %u channel(s), partitions:",
+		_length, _nr_channels);
+	for (unsigned int i = 0; i < _levels.size(); ++i)
+		printf(" %ux%u", _levels[i]->nr_partitions, _levels[i]->size);
+	printf("\n");
+}
+
+void
+convolver_plugin::reset()
+{
+	_block = 0;
+	_quiet = 0;
+
+	for (unsigned int i = 0; i < _levels.size(); ++i) {
+		level* l = _levels[i];
+		unsigned int n = l->nr_partitions * l->nr_bins;
+
+		memset(l->fdl_re, 0, n * sizeof(float));
+		memset(l->fdl_im, 0, n * sizeof(float));
+		memset(l->input, 0, 2 * l->size * sizeof(float));
+		for (unsigned int c = 0; c < 2; ++c) {
+			memset(l->result[c][0], 0, l->size * sizeof(float));
+			memset(l->result[c][1], 0, l->size * sizeof(float));
+		}
+
+		l->fdl_pos = 0;
+		l->nr_done = 0;
+		l->exit = false;
+	}
+}
+
+void
+convolver_plugin::activate()
+{
+	reset();
+
+	for (unsigned int i = 1; i < _levels.size(); ++i) {
+		level* l = _levels[i];
+
+		if (sem_init(&l->start, 0, 0) == -1)
+			exit(1);
+		if (sem_init(&l->done, 0, 0) == -1)
+			exit(1);
+
+		if (pthread_create(&l->thread, NULL, &level_thread, (void*) l))
+			exit(1);
+	}
+}
+
+void
+convolver_plugin::deactivate()
+{
+	for (unsigned int i = 1; i < _levels.size(); ++i) {
+		level* l = _levels[i];
+
+		__atomic_store_n(&l->exit, true, __ATOMIC_SEQ_CST);
+		sem_post(&l->start);
+
+		pthread_join(l->thread, NULL);
+		sem_destroy(&l->start);
+		sem_destroy(&l->done);
+	}
+}
+
+bool
+convolver_plugin::is_audio_input(unsigned int port)
+{
+	return port == 0;
+}
+
+bool
+convolver_plugin::is_audio_output(unsigned int port)
+{
+	return port == 1 || port == 2;
+}
+
+/* The head is convolved a block at a time in run() */
+unsigned int
+convolver_plugin::latency()
+{
+	return 0;
+}
+
+/* One step of overlap-save: "in" is the last two partitions of input;
+ * writes a partition of output per channel */
+void
+convolver_plugin::convolve(level* l, const float* in, float* const* out)
+{
+	unsigned int nr_bins = l->nr_bins;
+	unsigned int nr_partitions = l->nr_partitions;
+
+	l->fdl_pos = (l->fdl_pos + nr_partitions - 1) % nr_partitions;
+	l->f->forward(in, l->fdl_re + l->fdl_pos * nr_bins,
+		l->fdl_im + l->fdl_pos * nr_bins);
+
+	for (unsigned int c = 0; c < _nr_channels; ++c) {
+		float* acc_re = l->acc_re;
+		float* acc_im = l->acc_im;
+
+		memset(acc_re, 0, nr_bins * sizeof(float));
+		memset(acc_im, 0, nr_bins * sizeof(float));
+
+		/* Partition j of the response meets the input from j
+		 * partitions ago */
+		for (unsigned int j = 0; j < nr_partitions; ++j) {
+			unsigned int k = (l->fdl_pos + j) % nr_partitions;
+			const float* xr = l->fdl_re + k * nr_bins;
+			const float* xi = l->fdl_im + k * nr_bins;
+			const float* hr = l->ir_re[c] + j * nr_bins;
+			const float* hi = l->ir_im[c] + j * nr_bins;
+
+			for (unsigned int i = 0; i < nr_bins; ++i) {
+				acc_re[i] += xr[i] * hr[i] - xi[i] * hi[i];
+				acc_im[i] += xr[i] * hi[i] + xi[i] * hr[i];
+			}
+		}
+
+		l->f->inverse(acc_re, acc_im, l->frame);
+
+		/* The first half has wrapped around */
+		memcpy(out[c], l->frame + l->size, l->size * sizeof(float));
+	}
+
+	/* A mono response sounds the same on both sides */
+	if (_nr_channels == 1)
+		memcpy(out[1], out[0], l->size * sizeof(float));
+}
+
+void*
+convolver_plugin::level_thread(void* arg)
+{
+	level* l = (level*) arg;
+
+	denormal_guard guard;
+
+	for (unsigned long k = 0; ; ++k) {
+		while (sem_wait(&l->start) == -1)
+			assert(errno == EINTR);
+
+		if (__atomic_load_n(&l->exit, __ATOMIC_SEQ_CST))
+			break;
+
+		float* out[2] = { l->result[0][k % 2], l->result[1][k % 2] };
+		l->convolver->convolve(l, l->job_input[k % 2], out);
+
+		__atomic_store_n(&l->nr_done, k + 1, __ATOMIC_RELEASE);
+		sem_post(&l->done);
+	}
+
+	return NULL;
+}
+
+void
+convolver_plugin::run(unsigned int sample_count)
+{
+	assert(sample_count == buffer_size);
+
+	const float* in = _ports[0];
+	unsigned long t = _block;
+
+	/* Level 0: a partition per block */
+	level* l0 = _levels[0];
+	memcpy(l0->input, l0->input + buffer_size,
+		buffer_size * sizeof(float));
+	memcpy(l0->input + buffer_size, in, buffer_size * sizeof(float));
+	convolve(l0, l0->input, _wet);
+
+	for (unsigned int i = 1; i < _levels.size(); ++i) {
+		level* l = _levels[i];
+		unsigned int m = l->nr_blocks;
+		unsigned long k = t / m;
+		unsigned int pos = (t % m) * buffer_size;
+
+		/* Partition k of the input started at k * size, and the level
+		 * starts at 2 * size into the response */
+		if (k >= 2) {
+			if (pos == 0) {
+				while (__atomic_load_n(&l->nr_done,
+					__ATOMIC_ACQUIRE) <= k - 2)
+				{
+					while (sem_wait(&l->done) == -1)
+						assert(errno == EINTR);
+				}
+			}
+
+			for (unsigned int c = 0; c < 2; ++c) {
+				const float* r = l->result[c][k % 2] + pos;
+
+				for (unsigned int j = 0; j < sample_count; ++j)
+					_wet[c][j] += r[j];
+			}
+		}
+
+		memcpy(l->input + l->size + pos, in,
+			buffer_size * sizeof(float));
+
+		/* A partition of input is complete: hand it to the thread,
+		 * which will have it ready by the time it is needed */
+		if (pos + buffer_size == l->size) {
+			memcpy(l->job_input[k % 2], l->input,
+				2 * l->size * sizeof(float));
+			memcpy(l->input, l->input + l->size,
+				l->size * sizeof(float));
+
+			sem_post(&l->start);
+		}
+	}
+
+	const float* dry_ramp = _ramps[3];
+	const float* wet_ramp = _ramps[4];
+	float dry = _ports[3][0];
+	float wet = _ports[4][0];
+
+	for (unsigned int c = 0; c < 2; ++c) {
+		float* out = _ports[1 + c];
+
+		if (dry_ramp || wet_ramp) {
+			for (unsigned int j = 0; j < sample_count; ++j) {
+				out[j] = (dry_ramp ? dry_ramp[j] : dry) * in[j]
+					+ (wet_ramp ? wet_ramp[j] : wet) * _wet[c][j];
+			}
+
+			continue;
+		}
+
+		for (unsigned int j = 0; j < sample_count; ++j)
+			out[j] = dry * in[j] + wet * _wet[c][j];
+	}
+
+	/* May be skipped once the last input has rung out */
+	if (*_silent[0])
+		_quiet += sample_count;
+	else
+		_quiet = 0;
+
+	_bypass = _quiet > _length + buffer_size;
+
+	_block = t + 1;
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef DENORMALS_HH
+#define DENORMALS_HH
+
+extern "C" {
+#include <stdint.h>
+#include <string.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DENORMALS_X86 1
+#endif
+
+#ifdef DENORMALS_X86
+#include <xmmintrin.h>
+#endif
+
+/* Feedback filters and envelopes that decay towards zero end up in
+ * subnormal floats, which on most CPUs take a slow path through
+ * microcode for every operation. Every thread that runs plugins sets the
+ * FPU to flush them to zero (FTZ, results) and to read them as zero
+ * (DAZ, operands), which costs at most a bit of precision far below
+ * silence_threshold. */
+
+/* Whether DSP threads flush subnormals; turned off to find out where
+ * they come from */
+static bool flush_denormals = true;
+
+/* Whether every plugin's outputs are searched for subnormals after it
+ * runs; see plugin::find_denormals() */
+static bool check_denormals = false;
+
+/* Flushes subnormals on the calling thread for as long as it lives, and
+ * puts back what the thread had before */
+class denormal_guard {
+public:
+	denormal_guard();
+	~denormal_guard();
+
+private:
+	bool _set;
+	unsigned long _saved;
+};
+
+denormal_guard::denormal_guard():
+	_set(false),
+	_saved(0)
+{
+	if (!flush_denormals)
+		return;
+
+#if defined(DENORMALS_X86)
+	/* FTZ is bit 15 and DAZ bit 6 of MXCSR */
+	_saved = _mm_getcsr();
+	_mm_setcsr(_saved | 0x8040);
+	_set = true;
+#elif defined(__aarch64__)
+	/* FZ, bit 24 of FPCR, does both */
+	uint64_t fpcr;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r" (fpcr));
+	_saved = fpcr;
+	fpcr |= 1UL << 24;
+	__asm__ __volatile__("msr fpcr, %0" : : "r" (fpcr));
+	_set = true;
+#endif
+}
+
+denormal_guard::~denormal_guard()
+{
+	if (!_set)
+		return;
+
+#if defined(DENORMALS_X86)
+	_mm_setcsr(_saved);
+#elif defined(__aarch64__)
+	uint64_t fpcr = _saved;
+	__asm__ __volatile__("msr fpcr, %0" : : "r" (fpcr));
+#endif
+}
+
+/* The number of subnormal samples in x[0..n), looking at the bits so
+ * that DAZ can't hide them */
+static unsigned int
+count_denormals(const float* x, unsigned int n)
+{
+	unsigned int count = 0;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		uint32_t bits;
+		memcpy(&bits, &x[i], sizeof(bits));
+
+		count += (bits & 0x7f800000) == 0 && (bits & 0x007fffff) != 0;
+	}
+
+	return count;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef EVENT_HH
+#define EVENT_HH
+
+#include <vector>
+
+extern "C" {
+#include <stdint.h>
+}
+
+enum event_type {
+	EVENT_GATE,
+	EVENT_FREQUENCY,
+	EVENT_VELOCITY,
+
+	/* Unassigned notes, for instruments that allocate their own
+	 * voices; see sequencer::all_notes */
+	EVENT_NOTE_ON,
+	EVENT_NOTE_OFF,
+};
+
+/* A control change that a sequencer schedules for the current block */
+struct event {
+	/* In samples, from the start of the block */
+	unsigned int offset;
+
+	/* Which of the sequencer's voices it belongs to */
+	unsigned int voice;
+
+	enum event_type type;
+	float value;
+
+	/* For EVENT_NOTE_ON/EVENT_NOTE_OFF */
+	uint8_t channel;
+	uint8_t note;
+	uint8_t velocity;
+
+	/* For EVENT_NOTE_ON: samples until the note off, if the sequencer
+	 * knows; 0 otherwise */
+	unsigned long duration;
+
+	/* The control port the sequencer voice was connected to, if any;
+	 * consumers that don't care about the type just store the value
+	 * here when they get to the offset. */
+	float* port;
+};
+
+typedef std::vector<event> event_vector;
+
+/* Enough for any reasonable MIDI file at the largest block size; a
+ * queue that still overflows this grows, which allocates on the audio
+ * thread. */
+static const unsigned int event_queue_reserve = 1024;
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef FFT_HH
+#define FFT_HH
+
+extern "C" {
+#include <assert.h>
+#include <math.h>
+}
+
+/* Real FFT of a power-of-two size n, done as a complex FFT of size n/2.
+ * Spectra have n/2 + 1 bins, kept as separate real and imaginary arrays.
+ * The inverse is scaled by 1/n, so inverse(forward(x)) == x.
+ *
+ * Holds its own scratch space, so one object must not be used by two
+ * threads at once. */
+class fft {
+public:
+	explicit fft(unsigned int n);
+	~fft();
+
+public:
+	void forward(const float* in, float* re, float* im);
+	void inverse(const float* re, const float* im, float* out);
+
+private:
+	void transform(float* re, float* im);
+
+public:
+	unsigned int _n;
+
+private:
+	/* Size of the complex transform */
+	unsigned int _m;
+
+	unsigned int* _reverse;
+
+	/* e^(-2 pi i k / m), for the complex transform */
+	float* _cos;
+	float* _sin;
+
+	/* e^(-2 pi i k / n), for splitting/joining the real spectrum */
+	float* _split_cos;
+	float* _split_sin;
+
+	float* _re;
+	float* _im;
+};
+
+fft::fft(unsigned int n):
+	_n(n),
+	_m(n / 2)
+{
+	assert(n >= 4 && (n & (n - 1)) == 0);
+
+	_reverse = new unsigned int[_m];
+
+	unsigned int bits = 0;
+	while ((1U << bits) < _m)
+		++bits;
+
+	for (unsigned int i = 0; i < _m; ++i) {
+		unsigned int r = 0;
+		for (unsigned int b = 0; b < bits; ++b) {
+			if (i & (1U << b))
+				r |= 1U << (bits - 1 - b);
+		}
+
+		_reverse[i] = r;
+	}
+
+	_cos = new float[_m / 2];
+	_sin = new float[_m / 2];
+	for (unsigned int k = 0; k < _m / 2; ++k) {
+		_cos[k] = cos(2 * M_PI * k / _m);
+		_sin[k] = -sin(2 * M_PI * k / _m);
+	}
+
+	_split_cos = new float[_m + 1];
+	_split_sin = new float[_m + 1];
+	for (unsigned int k = 0; k <= _m; ++k) {
+		_split_cos[k] = cos(2 * M_PI * k / n);
+		_split_sin[k] = -sin(2 * M_PI * k / n);
+	}
+
+	_re = new float[_m];
+	_im = new float[_m];
+}
+
+fft::~fft()
+{
+	delete[] _reverse;
+	delete[] _cos;
+	delete[] _sin;
+	delete[] _split_cos;
+	delete[] _split_sin;
+	delete[] _re;
+	delete[] _im;
+}
+
+/* In-place radix-2 decimation in time; the input must already be in
+ * bit-reversed order */
+void
+fft::transform(float* re, float* im)
+{
+	for (unsigned int len = 2; len <= _m; len *= 2) {
+		unsigned int half = len / 2;
+		unsigned int step = _m / len;
+
+		for (unsigned int i = 0; i < _m; i += len) {
+			for (unsigned int j = 0; j < half; ++j) {
+				float wr = _cos[j * step];
+				float wi = _sin[j * step];
+
+				unsigned int a = i + j;
+				unsigned int b = a + half;
+
+				float vr = re[b] * wr - im[b] * wi;
+				float vi = re[b] * wi + im[b] * wr;
+
+				re[b] = re[a] - vr;
+				im[b] = im[a] - vi;
+				re[a] += vr;
+				im[a] += vi;
+			}
+		}
+	}
+}
+
+void
+fft::forward(const float* in, float* re, float* im)
+{
+	/* Even samples in the real part, odd ones in the imaginary part */
+	for (unsigned int i = 0; i < _m; ++i) {
+		unsigned int r = _reverse[i];
+		_re[r] = in[2 * i];
+		_im[r] = in[2 * i + 1];
+	}
+
+	transform(_re, _im);
+
+	/* X[k] = E[k] + W^k O[k], where E and O are the spectra of the even
+	 * and odd samples: E[k] = (Z[k] + Z*[m - k]) / 2 and
+	 * O[k] = (Z[k] - Z*[m - k]) / 2i */
+	for (unsigned int k = 0; k <= _m; ++k) {
+		unsigned int a = k % _m;
+		unsigned int b = (_m - k) % _m;
+
+		float er = 0.5 * (_re[a] + _re[b]);
+		float ei = 0.5 * (_im[a] - _im[b]);
+		float or_ = 0.5 * (_im[a] + _im[b]);
+		float oi = -0.5 * (_re[a] - _re[b]);
+
+		float wr = _split_cos[k];
+		float wi = _split_sin[k];
+
+		re[k] = er + or_ * wr - oi * wi;
+		im[k] = ei + or_ * wi + oi * wr;
+	}
+}
+
+void
+fft::inverse(const float* re, const float* im, float* out)
+{
+	/* Undo the split: E[k] = (X[k] + X*[m - k]) / 2,
+	 * O[k] = (X[k] - X*[m - k]) / 2 W^-k, Z[k] = E[k] + i O[k].
+	 * The complex inverse is done as a forward transform of the
+	 * conjugate. */
+	for (unsigned int k = 0; k < _m; ++k) {
+		unsigned int b = _m - k;
+
+		float er = 0.5 * (re[k] + re[b]);
+		float ei = 0.5 * (im[k] - im[b]);
+		float dr = 0.5 * (re[k] - re[b]);
+		float di = 0.5 * (im[k] + im[b]);
+
+		float wr = _split_cos[k];
+		float wi = -_split_sin[k];
+
+		float or_ = dr * wr - di * wi;
+		float oi = dr * wi + di * wr;
+
+		unsigned int r = _reverse[k];
+		_re[r] = er - oi;
+		_im[r] = -(ei + or_);
+	}
+
+	transform(_re, _im);
+
+	float scale = 1. / _m;
+	for (unsigned int i = 0; i < _m; ++i) {
+		out[2 * i] = scale * _re[i];
+		out[2 * i + 1] = -scale * _im[i];
+	}
+}
+
+#endif
@@ -1,16 +1,65 @@
 #ifndef GRAPH_HH
 #define GRAPH_HH
 
+#include <algorithm>
+#include <list>
+#include <map>
 #include <set>
+#include <vector>
 
+extern "C" {
+#include <stdio.h>
+}
+
+#include "automation.hh"
+#include "buffer_pool.hh"
+#include "denormals.hh"
 #include "edge.hh"
+#include "parallel_executor.hh"
 #include "plugin.hh"
+#include "schedule.hh"
 #include "sequencer.hh"
 
+/* All the editing functions are meant to be called from a single control
+ * thread, possibly while another thread is calling run(). Edits never
+ * touch anything run() looks at; instead they compile a new schedule and
+ * publish it with an atomic pointer swap, which run() picks up at the
+ * start of its next block. Old schedules and removed plugins are freed
+ * (from the control thread) once run() has finished the block that might
+ * still have been using them. */
 class graph {
 public:
 	typedef std::set<plugin*> plugin_set;
 	typedef std::set<sequencer*> sequencer_set;
+	typedef std::set<automation_lane*> lane_set;
+
+	struct connection {
+		plugin* a;
+		unsigned int a_port;
+		plugin* b;
+		unsigned int b_port;
+	};
+
+	/* Something that run() may still be using; see reclaim() */
+	struct retired {
+		unsigned long epoch;
+		schedule* s;
+		plugin* p;
+		bool deactivate;
+		bool destroy;
+	};
+
+	typedef std::vector<connection> connection_vector;
+	typedef std::list<retired> retired_list;
+	typedef std::map<plugin*, unsigned int> index_map;
+	typedef std::map<std::pair<plugin*, unsigned int>, unsigned int>
+		buffer_map;
+
+	/* Plugins that add into a bus, and the summing plugin and input
+	 * port they feed; and the buffer of each summing plugin's bus */
+	typedef std::map<plugin*, std::pair<plugin*, unsigned int> >
+		adder_map;
+	typedef std::map<plugin*, unsigned int> bus_map;
 
 public:
 	graph();
@@ -19,10 +68,14 @@ public:
 public:
 	void add(plugin* p);
 	void remove(plugin* p);
+	void dispose(plugin* p);
 
 	void add(sequencer* s);
 	void remove(sequencer* s);
 
+	void add(automation_lane* l);
+	void remove(automation_lane* l);
+
 	void activate();
 	void deactivate();
 
@@ -31,33 +84,128 @@ public:
 	void disconnect(plugin* a, unsigned int a_port,
 		plugin* b, unsigned int b_port);
 
+	void begin_edit();
+	void end_edit();
+
+	void reclaim();
+
 private:
-	void run_recursively(plugin* plugin, unsigned int sample_count);
+	bool has_lanes(plugin* p);
+
+	bool schedule_recursively(schedule* s,
+		plugin* p, plugin_set& visited, plugin_set& path);
+	void find_adders(adder_map& adders);
+	void allocate_buffers(schedule* s, index_map& index,
+		buffer_map& buffers, adder_map& adders, bus_map& buses);
+	void compile();
+	void publish(schedule* s);
+	void retire(schedule* s, plugin* p, bool destroy);
 
 public:
+	void set_executor(parallel_executor* e);
+#ifdef NODE_PROFILING
+	void set_profiler(node_profiler* p);
+#endif
+
+	void print_buffer_stats();
+	void print_denormal_stats();
+
+	unsigned int latency();
+
+	bool sequencers_done();
+
 	void run(unsigned int sample_count);
 
 private:
 	bool _activated;
+	parallel_executor* _executor;
+#ifdef NODE_PROFILING
+	node_profiler* _profiler;
+#endif
+
+	connection_vector _connections;
+
+	/* Nesting depth of begin_edit()/end_edit() */
+	unsigned int _edit_depth;
+	bool _edited;
+
+	/* The schedule run() will use for its next block */
+	schedule* _current;
+	unsigned long _generation;
+
+	/* Only touched by run() */
+	unsigned long _bound_generation;
+
+	/* Number of blocks run() has completed */
+	unsigned long _epoch;
+
+	retired_list _retired;
+
+	buffer_pool _pool;
+	unsigned int _nr_output_ports;
+	unsigned int _nr_buffers;
+
+	/* Output ports that share a buffer with one of their node's
+	 * inputs, and that are a bus shared with other nodes */
+	unsigned int _nr_in_place;
+	unsigned int _nr_adding;
+
+	/* See schedule::_scratch */
+	float* _scratch;
 
 public:
 	plugin_set _plugins;
+	sequencer_set _sequencers;
+	lane_set _lanes;
 };
 
 graph::graph():
-	_activated(false)
+	_activated(false),
+	_executor(0),
+#ifdef NODE_PROFILING
+	_profiler(0),
+#endif
+	_edit_depth(0),
+	_edited(false),
+	_current(new schedule()),
+	_generation(0),
+	_bound_generation(~0UL),
+	_epoch(0),
+	_nr_output_ports(0),
+	_nr_buffers(0),
+	_nr_in_place(0),
+	_nr_adding(0),
+	_scratch(new float[buffer_size])
 {
+	_current->_generation = _generation;
 }
 
 graph::~graph()
 {
 	assert(_plugins.size() == 0);
+	assert(!_activated);
+
+	reclaim();
+	assert(_retired.empty());
+
+	delete _current;
+	delete[] _scratch;
 }
 
 void
 graph::add(plugin* p)
 {
+	if (_activated)
+		p->activate();
+
+	p->setup_ports();
+#ifdef NODE_PROFILING
+	if (_profiler)
+		_profiler->add(p);
+#endif
+
 	_plugins.insert(p);
+	compile();
 }
 
 void
@@ -66,8 +214,78 @@ graph::remove(plugin* p)
 	/* Catch missing ->disconnect()s [XXX: Should this be in ~plugin?] */
 	assert(p->_deps.size() == 0);
 	assert(p->_rev_deps.size() == 0);
+	assert(!has_lanes(p));
 
 	_plugins.erase(p);
+	compile();
+
+	retire(0, p, false);
+}
+
+/* Like remove(), but also delete the plugin once run() can no longer be
+ * using it. This is the only safe way to get rid of a plugin while the
+ * graph is running. */
+void
+graph::dispose(plugin* p)
+{
+	assert(p->_deps.size() == 0);
+	assert(p->_rev_deps.size() == 0);
+	assert(!has_lanes(p));
+
+	_plugins.erase(p);
+	compile();
+
+	retire(0, p, true);
+}
+
+/* Sequencers are advanced by run() once per block. The plugins that
+ * listen to a sequencer have to be removed before it is, and it must
+ * not be deleted while run() may still be using it. */
+void
+graph::add(sequencer* s)
+{
+	_sequencers.insert(s);
+	compile();
+}
+
+void
+graph::remove(sequencer* s)
+{
+	_sequencers.erase(s);
+	compile();
+}
+
+/* Automation lanes are advanced along with the sequencers, before any
+ * plugin runs. The same rules apply: the lane's plugin has to be in the
+ * graph for as long as the lane is, and a removed lane must not be
+ * deleted while run() may still be using it. */
+void
+graph::add(automation_lane* l)
+{
+	assert(_plugins.find(l->_plugin) != _plugins.end());
+
+	_lanes.insert(l);
+	compile();
+}
+
+void
+graph::remove(automation_lane* l)
+{
+	_lanes.erase(l);
+	compile();
+}
+
+bool
+graph::has_lanes(plugin* p)
+{
+	for (lane_set::iterator i = _lanes.begin(), end = _lanes.end();
+		i != end; ++i)
+	{
+		if ((*i)->_plugin == p)
+			return true;
+	}
+
+	return false;
 }
 
 void
@@ -85,6 +303,7 @@ graph::activate()
 	_activated = true;
 }
 
+/* run() must not be called (and must not be running) from here on */
 void
 graph::deactivate()
 {
@@ -98,6 +317,8 @@ graph::deactivate()
 	}
 
 	_activated = false;
+
+	reclaim();
 }
 
 /* "a" is the output plugin, "b" is the input plugin.
@@ -132,7 +353,14 @@ graph::connect(plugin* a, unsigned int a_port,
 			i->second->inc();
 	}
 
-	b->connect(b_port, a->_ports[a_port]);
+	connection c;
+	c.a = a;
+	c.a_port = a_port;
+	c.b = b;
+	c.b_port = b_port;
+	_connections.push_back(c);
+
+	compile();
 }
 
 void
@@ -164,40 +392,616 @@ graph::disconnect(plugin* a, unsigned int a_port,
 		}
 	}
 
-	b->disconnect(b_port);
+	for (connection_vector::iterator i = _connections.begin(),
+		end = _connections.end(); i != end; ++i)
+	{
+		if (i->a == a && i->a_port == a_port
+			&& i->b == b && i->b_port == b_port)
+		{
+			_connections.erase(i);
+			break;
+		}
+	}
+
+	compile();
+}
+
+/* Group several edits so that run() only ever sees the end result, e.g.
+ * when inserting an effect between two plugins. */
+void
+graph::begin_edit()
+{
+	++_edit_depth;
 }
 
 void
-graph::run_recursively(plugin* p, unsigned int sample_count)
+graph::end_edit()
+{
+	assert(_edit_depth > 0);
+
+	if (--_edit_depth == 0 && _edited)
+		compile();
+}
+
+/* Post-order DFS over the dependencies, so that every plugin comes
+ * after everything it depends on and appears exactly once. "path" is
+ * the plugins we are in the middle of; coming back to one of them means
+ * there is a cycle, and false is returned. */
+bool
+graph::schedule_recursively(schedule* s, plugin* p, plugin_set& visited,
+	plugin_set& path)
 {
 	assert(_plugins.find(p) != _plugins.end());
 
+	if (path.find(p) != path.end())
+		return false;
+	if (!visited.insert(p).second)
+		return true;
+
+	path.insert(p);
+
 	for (plugin::plugin_map::iterator i = p->_deps.begin(),
 		end = p->_deps.end(); i != end; ++i)
 	{
 		plugin* dep = i->first;
-		run_recursively(dep, sample_count);
+		if (!schedule_recursively(s, dep, visited, path))
+			return false;
 	}
 
-	p->run(sample_count);
+	path.erase(p);
+
+	schedule::node n;
+	n.p = p;
+	n.first_binding = 0;
+	n.nr_bindings = 0;
+	n.nr_deps = p->_deps.size();
+	n.first_successor = 0;
+	n.nr_successors = 0;
+	n.first_source = 0;
+	n.nr_sources = 0;
+	n.adding_gain = 0;
+	n.clear_bus = false;
+	s->_nodes.push_back(n);
+
+	return true;
 }
 
+/* The plugins that can add their output straight into the bus of the
+ * summing plugin they feed, rather than have a buffer of their own that
+ * it then reads back. Several plugins write each bus in turn, so this
+ * is only done when the nodes run one at a time, and not while looking
+ * for subnormals, which needs each node's output on its own. */
 void
-graph::run(unsigned int sample_count)
+graph::find_adders(adder_map& adders)
+{
+	if (_executor || check_denormals)
+		return;
+
+	std::map<plugin*, unsigned int> nr_readers;
+	for (connection_vector::iterator i = _connections.begin(),
+		end = _connections.end(); i != end; ++i)
+	{
+		++nr_readers[i->a];
+	}
+
+	for (connection_vector::iterator i = _connections.begin(),
+		end = _connections.end(); i != end; ++i)
+	{
+		plugin* a = i->a;
+		plugin* b = i->b;
+
+		/* Nothing else may need the output on its own */
+		if (!a->can_run_adding() || a->_audio_outputs.size() != 1
+			|| nr_readers[a] != 1)
+		{
+			continue;
+		}
+
+		if (b->bus_port() == -1 || !b->adding_gain(i->b_port))
+			continue;
+
+		adders[a] = std::make_pair(b, i->b_port);
+	}
+}
+
+/* Give every audio output port a buffer from the pool. A buffer can be
+ * handed out again once everything that used it (the previous writer
+ * and all of its readers) is guaranteed to have run before the new
+ * writer. Requiring that to hold in the dependency order rather than
+ * just in schedule order keeps the assignment valid for the parallel
+ * executor as well.
+ *
+ * Since a new schedule only takes over at a block boundary, it is free
+ * to reuse the buffers of the one it replaces.
+ *
+ * The adders of a summing plugin all get the same buffer, its bus,
+ * which lives until the summing plugin has read it. */
+void
+graph::allocate_buffers(schedule* s, index_map& index, buffer_map& buffers,
+	adder_map& adders, bus_map& buses)
+{
+	unsigned int n = s->_nodes.size();
+
+	/* ancestors[i][j] is true if node j always runs before node i */
+	std::vector<std::vector<bool> > ancestors(n,
+		std::vector<bool>(n, false));
+	for (unsigned int i = 0; i < n; ++i) {
+		plugin* p = s->_nodes[i].p;
+
+		for (plugin::plugin_map::iterator j = p->_rev_deps.begin(),
+			end = p->_rev_deps.end(); j != end; ++j)
+		{
+			std::vector<bool>& a = ancestors[index[j->first]];
+
+			a[i] = true;
+			for (unsigned int k = 0; k < i; ++k) {
+				if (ancestors[i][k])
+					a[k] = true;
+			}
+		}
+	}
+
+	/* The nodes that touch each pool buffer in its current lifetime */
+	std::vector<std::vector<unsigned int> > users;
+
+	_nr_output_ports = 0;
+	_nr_in_place = 0;
+	_nr_adding = 0;
+	for (unsigned int i = 0; i < n; ++i) {
+		plugin* p = s->_nodes[i].p;
+		adder_map::iterator adder = adders.find(p);
+
+		/* The buffers this node reads from that it could write over
+		 * as well, because every other user is done with them. Not
+		 * while looking for subnormals, which compares the inputs
+		 * with the outputs. */
+		std::vector<unsigned int> in_place;
+		if (p->can_run_in_place() && !check_denormals
+			&& adder == adders.end())
+		{
+			for (connection_vector::iterator j = _connections.begin(),
+				end = _connections.end(); j != end; ++j)
+			{
+				if (j->b != p || !p->is_audio_input(j->b_port))
+					continue;
+
+				unsigned int b = buffers[std::make_pair(j->a,
+					j->a_port)];
+
+				bool dead = true;
+				for (unsigned int k = 0; k < users[b].size(); ++k) {
+					unsigned int u = users[b][k];
+					if (u != i && !ancestors[i][u]) {
+						dead = false;
+						break;
+					}
+				}
+
+				if (dead && std::find(in_place.begin(),
+					in_place.end(), b) == in_place.end())
+				{
+					in_place.push_back(b);
+				}
+			}
+		}
+
+		for (unsigned int port = 0; port < p->_nr_ports; ++port) {
+			if (!p->is_audio_output(port))
+				continue;
+
+			++_nr_output_ports;
+
+			if (adder != adders.end()) {
+				++_nr_adding;
+
+				bus_map::iterator bus
+					= buses.find(adder->second.first);
+				if (bus != buses.end()) {
+					users[bus->second].push_back(i);
+					buffers[std::make_pair(p, port)]
+						= bus->second;
+					continue;
+				}
+
+				/* The first to write the bus in the block */
+				s->_nodes[i].clear_bus = true;
+			}
+
+			unsigned int b;
+			if (!in_place.empty()) {
+				/* Each one only for a single output */
+				b = in_place.back();
+				in_place.pop_back();
+				++_nr_in_place;
+			} else {
+				for (b = 0; b < users.size(); ++b) {
+					bool dead = true;
+					for (unsigned int j = 0; j < users[b].size();
+						++j)
+					{
+						if (!ancestors[i][users[b][j]]) {
+							dead = false;
+							break;
+						}
+					}
+
+					if (dead)
+						break;
+				}
+			}
+
+			if (b == users.size())
+				users.push_back(std::vector<unsigned int>());
+
+			users[b].clear();
+			users[b].push_back(i);
+			for (connection_vector::iterator j = _connections.begin(),
+				end = _connections.end(); j != end; ++j)
+			{
+				if (j->a == p && j->a_port == port)
+					users[b].push_back(index[j->b]);
+			}
+
+			buffers[std::make_pair(p, port)] = b;
+
+			if (adder != adders.end())
+				buses[adder->second.first] = b;
+		}
+	}
+
+	_nr_buffers = users.size();
+
+	/* Buffers beyond what we need may still be in use by run() */
+	if (!_activated)
+		_pool.resize(_nr_buffers);
+}
+
+void
+graph::compile()
 {
-	unsigned int n = 0;
+	if (_edit_depth > 0) {
+		_edited = true;
+		return;
+	}
+
+	_edited = false;
+
+	schedule* s = new schedule();
+
+	plugin_set visited;
+	plugin_set path;
+	bool cycle = false;
 	for (plugin_set::iterator i = _plugins.begin(), end = _plugins.end();
-		i != end; ++i)
+		i != end && !cycle; ++i)
 	{
 		plugin* p = *i;
 
-		if (p->_rev_deps.empty()) {
-			run_recursively(p, sample_count);
-			++n;
+		if (p->_rev_deps.empty())
+			cycle = !schedule_recursively(s, p, visited, path);
+	}
+
+	/* Anything not reachable from a sink is part of a cycle too. run()
+	 * carries on with the last schedule that made sense. */
+	if (cycle || s->_nodes.size() != _plugins.size()) {
+		fprintf(stderr, "graph: the connections form a cycle, "
+			"not using them\n");
+		delete s;
+		return;
+	}
+
+	index_map index;
+	for (unsigned int i = 0; i < s->_nodes.size(); ++i)
+		index[s->_nodes[i].p] = i;
+
+	adder_map adders;
+	find_adders(adders);
+
+	buffer_map buffers;
+	bus_map buses;
+	allocate_buffers(s, index, buffers, adders, buses);
+
+	for (schedule::node_vector::iterator i = s->_nodes.begin(),
+		end = s->_nodes.end(); i != end; ++i)
+	{
+		schedule::node& n = *i;
+
+		/* Bind every audio port, so that ports that were disconnected
+		 * go back to silence when the schedule is bound */
+		n.first_binding = s->_bindings.size();
+		for (unsigned int port = 0; port < n.p->_nr_ports; ++port) {
+			schedule::binding b;
+			b.port = port;
+
+			if (n.p->is_audio_output(port)) {
+				unsigned int k = buffers[std::make_pair(n.p, port)];
+
+				b.buffer = _pool.get(k);
+				b.silent = _pool.silent(k);
+			} else if (n.p->is_audio_input(port)) {
+				b.buffer = silence_buffer;
+				b.silent = &silence_flag;
+
+				for (connection_vector::iterator j
+					= _connections.begin(),
+					jend = _connections.end(); j != jend; ++j)
+				{
+					if (j->b != n.p || j->b_port != port)
+						continue;
+
+					/* Comes in through the bus instead */
+					if (adders.find(j->a) != adders.end())
+						continue;
+
+					assert(j->a->is_audio_output(j->a_port));
+					unsigned int k = buffers[std::make_pair(j->a,
+						j->a_port)];
+
+					b.buffer = _pool.get(k);
+					b.silent = _pool.silent(k);
+				}
+
+				bus_map::iterator bus = buses.find(n.p);
+				if (bus != buses.end()
+					&& (int) port == n.p->bus_port())
+				{
+					b.buffer = _pool.get(bus->second);
+					b.silent = _pool.silent(bus->second);
+				}
+			} else {
+				continue;
+			}
+
+			s->_bindings.push_back(b);
 		}
+		n.nr_bindings = s->_bindings.size() - n.first_binding;
+
+		adder_map::iterator adder = adders.find(n.p);
+		if (adder != adders.end()) {
+			n.adding_gain = adder->second.first->adding_gain(
+				adder->second.second);
+		}
+
+		n.first_successor = s->_successors.size();
+		for (plugin::plugin_map::iterator j = n.p->_rev_deps.begin(),
+			jend = n.p->_rev_deps.end(); j != jend; ++j)
+		{
+			s->_successors.push_back(index[j->first]);
+		}
+		n.nr_successors = s->_successors.size()
+			- n.first_successor;
+
+		n.first_source = s->_sources.size();
+		for (plugin::sequencer_map::iterator j = n.p->_seqs.begin(),
+			jend = n.p->_seqs.end(); j != jend; ++j)
+		{
+			assert(_sequencers.find(j->first) != _sequencers.end());
+			s->_sources.push_back(&j->first->events(j->second));
+		}
+		n.nr_sources = s->_sources.size() - n.first_source;
 	}
 
-	assert(n > 0);
+	s->_sequencers.assign(_sequencers.begin(), _sequencers.end());
+	s->_lanes.assign(_lanes.begin(), _lanes.end());
+
+	s->_serial = !adders.empty();
+	s->_scratch = _scratch;
+#ifdef NODE_PROFILING
+	s->_profiler = _profiler;
+#endif
+
+	if (_executor)
+		_executor->prepare(*s);
+
+	publish(s);
+}
+
+void
+graph::publish(schedule* s)
+{
+	s->_generation = ++_generation;
+
+	schedule* old = __atomic_exchange_n(&_current, s, __ATOMIC_SEQ_CST);
+	retire(old, 0, false);
+}
+
+/* Note the epoch after the publish that made "s"/"p" unreachable. Any
+ * block that might still be using them started before the publish, so
+ * it is over once _epoch has moved past the value we read here. */
+void
+graph::retire(schedule* s, plugin* p, bool destroy)
+{
+	retired r;
+	r.epoch = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+	r.s = s;
+	r.p = p;
+	r.deactivate = _activated && p;
+	r.destroy = destroy;
+	_retired.push_back(r);
+
+	reclaim();
+}
+
+/* Free whatever run() is done with. Called after every edit, but the
+ * control thread may also call it periodically. */
+void
+graph::reclaim()
+{
+	unsigned long epoch = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST);
+
+	for (retired_list::iterator i = _retired.begin(), end = _retired.end();
+		i != end; )
+	{
+		if (_activated && i->epoch >= epoch) {
+			++i;
+			continue;
+		}
+
+		delete i->s;
+
+		if (i->p && i->deactivate)
+			i->p->deactivate();
+		if (i->p && i->destroy)
+			delete i->p;
+
+		i = _retired.erase(i);
+	}
+}
+
+/* Must not be called while run() is in progress */
+void
+graph::set_executor(parallel_executor* e)
+{
+	_executor = e;
+	compile();
+}
+
+#ifdef NODE_PROFILING
+/* Must not be called while run() is in progress. The profiler needs a
+ * set of counters for every thread of the executor. */
+void
+graph::set_profiler(node_profiler* p)
+{
+	_profiler = p;
+
+	if (p) {
+		for (plugin_set::iterator i = _plugins.begin(),
+			end = _plugins.end(); i != end; ++i)
+		{
+			p->add(*i);
+		}
+	}
+
+	compile();
+}
+#endif
+
+void
+graph::print_buffer_stats()
+{
+	unsigned long unpooled = _nr_output_ports
+		* buffer_size * sizeof(float);
+	unsigned long pooled = _nr_buffers
+		* buffer_size * sizeof(float);
+
+	printf("buffers: %u output ports share %u buffers (%u in place, "
+		"%u adding into buses), %lu of %lu bytes saved\n",
+		_nr_output_ports, _nr_buffers, _nr_in_place, _nr_adding,
+		unpooled - pooled, unpooled);
+}
+
+/* Which nodes put out subnormals, with check_denormals */
+void
+graph::print_denormal_stats()
+{
+	bool found = false;
+
+	for (unsigned int i = 0; i < _current->_nodes.size(); ++i) {
+		plugin* p = _current->_nodes[i].p;
+		if (!p->_nr_denormals)
+			continue;
+
+		printf("denormals: node %u (%s): %lu samples, made in %lu "
+			"blocks\n", i, p->name(), p->_nr_denormals,
+			p->_denormal_blocks);
+		found = true;
+	}
+
+	if (!found)
+		printf("denormals: none\n");
+}
+
+/* The largest latency along any path through the graph */
+unsigned int
+graph::latency()
+{
+	schedule* s = _current;
+
+	std::map<plugin*, unsigned int> path;
+	unsigned int max = 0;
+
+	/* Dependencies come first in the schedule */
+	for (schedule::node_vector::iterator i = s->_nodes.begin(),
+		end = s->_nodes.end(); i != end; ++i)
+	{
+		plugin* p = i->p;
+		unsigned int deps = 0;
+
+		for (plugin::plugin_map::iterator j = p->_deps.begin(),
+			jend = p->_deps.end(); j != jend; ++j)
+		{
+			unsigned int l = path[j->first];
+			if (l > deps)
+				deps = l;
+		}
+
+		unsigned int l = deps + p->latency();
+		path[p] = l;
+		if (l > max)
+			max = l;
+	}
+
+	return max;
+}
+
+bool
+graph::sequencers_done()
+{
+	for (sequencer_set::iterator i = _sequencers.begin(),
+		end = _sequencers.end(); i != end; ++i)
+	{
+		sequencer* s = *i;
+
+		if (!s->done())
+			return false;
+	}
+
+	return true;
+}
+
+/* The audio thread. Takes no locks and never allocates or frees. */
+void
+graph::run(unsigned int sample_count)
+{
+	denormal_guard guard;
+
+#ifdef NODE_PROFILING
+	uint64_t start = node_profiler::now();
+#endif
+
+	schedule* s = __atomic_load_n(&_current, __ATOMIC_SEQ_CST);
+
+	/* First block with a new schedule: move the ports over to it */
+	if (s->_generation != _bound_generation) {
+		s->bind();
+		_bound_generation = s->_generation;
+	}
+
+	assert(!s->_nodes.empty());
+
+	s->transport(sample_count);
+
+	if (_executor && !s->_serial) {
+		_executor->run(*s, sample_count);
+	} else {
+		const schedule::node* nodes = &s->_nodes[0];
+		for (unsigned int i = 0, n = s->_nodes.size(); i < n; ++i) {
+#ifdef NODE_PROFILING
+			profile_process(s->_profiler, 0, nodes[i].p,
+				sample_count);
+#else
+			nodes[i].p->process(sample_count);
+#endif
+		}
+	}
+
+#ifdef NODE_PROFILING
+	if (s->_profiler) {
+		s->_profiler->record_block(node_profiler::now() - start,
+			sample_count);
+	}
+#endif
+
+	__atomic_add_fetch(&_epoch, 1, __ATOMIC_SEQ_CST);
 }
 
 #endif
@@ -0,0 +1,589 @@
+#ifndef LADSPA_INDEX_HH
+#define LADSPA_INDEX_HH
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ladspa.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+}
+
+#include "ladspa_library.hh"
+
+/* Every LADSPA plugin on the search path, with its label, UniqueID,
+ * properties and ports, kept in a file so that finding a plugin doesn't
+ * mean loading every library there is.
+ *
+ * The file is a header followed by flat arrays of records, then a hash
+ * table of the plugins by label and the strings, and is used straight
+ * from an mmap. scan() compares each library's mtime and size with what
+ * the file says and only dlopen()s the ones that are new or have
+ * changed; if anything did, it writes a new file (to a temporary name
+ * that is then renamed over the old one, so that a reader never sees
+ * half of it). */
+class ladspa_index {
+public:
+	struct library_record {
+		uint32_t path;
+		uint32_t nr_plugins;
+		int64_t mtime;
+		int64_t mtime_nsec;
+		int64_t size;
+		uint32_t first_plugin;
+		uint32_t pad;
+	};
+
+	struct plugin_record {
+		uint32_t library;
+		uint32_t label;
+		uint32_t name;
+		uint32_t unique_id;
+		int32_t properties;
+		uint32_t first_port;
+		uint32_t nr_ports;
+
+		/* The next plugin in the same hash bucket, or -1 */
+		int32_t next;
+	};
+
+	struct port_record {
+		int32_t descriptor;
+		int32_t hints;
+		float lower;
+		float upper;
+		uint32_t name;
+	};
+
+public:
+	ladspa_index(const char* filename);
+	~ladspa_index();
+
+public:
+	void scan(const char* search_path);
+
+	const plugin_record* find(const char* label);
+
+	const char* string(uint32_t offset);
+	const char* library_path(const plugin_record* p);
+	const port_record* ports(const plugin_record* p);
+
+	void print_stats();
+
+public:
+	std::string _filename;
+
+	/* Of the last scan() */
+	unsigned int _nr_scanned;
+	unsigned int _nr_reused;
+
+private:
+	struct header {
+		char magic[8];
+		uint32_t version;
+		uint32_t nr_libraries;
+		uint32_t nr_plugins;
+		uint32_t nr_ports;
+		uint32_t nr_buckets;
+		uint32_t strings_size;
+	};
+
+	/* What goes into the next file */
+	struct builder {
+		std::vector<library_record> libraries;
+		std::vector<plugin_record> plugins;
+		std::vector<port_record> ports;
+		std::vector<char> strings;
+	};
+
+	static const uint32_t version = 1;
+
+private:
+	bool map();
+	bool check();
+	void unmap();
+	const library_record* find_library(const char* path);
+
+	void scan_directory(const char* dir, builder& b,
+		std::map<std::string, struct stat>& seen);
+	void copy_library(const library_record* l, builder& b);
+	void load_library(const char* path, const struct stat& st,
+		builder& b);
+
+	static uint32_t add_string(builder& b, const char* s);
+	void write(builder& b);
+
+private:
+	void* _map;
+	size_t _map_size;
+
+	const header* _header;
+	const library_record* _libraries;
+	const plugin_record* _plugins;
+	const port_record* _ports;
+	const int32_t* _buckets;
+	const char* _strings;
+};
+
+ladspa_index::ladspa_index(const char* filename):
+	_filename(filename),
+	_nr_scanned(0),
+	_nr_reused(0),
+	_map(0),
+	_map_size(0),
+	_header(0)
+{
+	map();
+}
+
+ladspa_index::~ladspa_index()
+{
+	unmap();
+}
+
+/* Returns false, leaving the index empty, if there is no file or it
+ * doesn't look right */
+bool
+ladspa_index::map()
+{
+	int fd = open(_filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(header)) {
+		close(fd);
+		return false;
+	}
+
+	void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (m == MAP_FAILED)
+		return false;
+
+	const header* h = (const header*) m;
+	size_t size = sizeof(header)
+		+ h->nr_libraries * sizeof(library_record)
+		+ h->nr_plugins * sizeof(plugin_record)
+		+ h->nr_ports * sizeof(port_record)
+		+ h->nr_buckets * sizeof(int32_t)
+		+ h->strings_size;
+
+	if (memcmp(h->magic, "LADSPAIX", 8) || h->version != version
+		|| size != (size_t) st.st_size
+		|| (h->nr_buckets & (h->nr_buckets - 1))
+		|| !h->strings_size || ((const char*) m)[size - 1])
+	{
+		fprintf(stderr, "%s: ignoring bad index\n", _filename.c_str());
+		munmap(m, st.st_size);
+		return false;
+	}
+
+	_map = m;
+	_map_size = st.st_size;
+
+	const char* p = (const char*) m + sizeof(header);
+	_header = h;
+	_libraries = (const library_record*) p;
+	p += h->nr_libraries * sizeof(library_record);
+	_plugins = (const plugin_record*) p;
+	p += h->nr_plugins * sizeof(plugin_record);
+	_ports = (const port_record*) p;
+	p += h->nr_ports * sizeof(port_record);
+	_buckets = (const int32_t*) p;
+	p += h->nr_buckets * sizeof(int32_t);
+	_strings = p;
+
+	if (!check()) {
+		fprintf(stderr, "%s: ignoring bad index\n", _filename.c_str());
+		unmap();
+		return false;
+	}
+
+	return true;
+}
+
+/* Whether every index and string offset in the file is in range, so
+ * that nothing read from it can point outside the map. The hash chains
+ * only go forwards, which is how write() builds them, so they end. */
+bool
+ladspa_index::check()
+{
+	const header* h = _header;
+
+	for (uint32_t i = 0; i < h->nr_libraries; ++i) {
+		const library_record* l = &_libraries[i];
+
+		if (l->path >= h->strings_size
+			|| (uint64_t) l->first_plugin + l->nr_plugins
+				> h->nr_plugins)
+		{
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < h->nr_plugins; ++i) {
+		const plugin_record* p = &_plugins[i];
+
+		if (p->library >= h->nr_libraries
+			|| p->label >= h->strings_size
+			|| p->name >= h->strings_size
+			|| (uint64_t) p->first_port + p->nr_ports > h->nr_ports
+			|| (p->next != -1 && (p->next <= (int64_t) i
+				|| (uint32_t) p->next >= h->nr_plugins)))
+		{
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < h->nr_ports; ++i) {
+		if (_ports[i].name >= h->strings_size)
+			return false;
+	}
+
+	for (uint32_t i = 0; i < h->nr_buckets; ++i) {
+		int32_t b = _buckets[i];
+
+		if (b != -1 && (b < 0 || (uint32_t) b >= h->nr_plugins))
+			return false;
+	}
+
+	return true;
+}
+
+void
+ladspa_index::unmap()
+{
+	if (_map)
+		munmap(_map, _map_size);
+
+	_map = 0;
+	_map_size = 0;
+	_header = 0;
+}
+
+const char*
+ladspa_index::string(uint32_t offset)
+{
+	assert(_header && offset < _header->strings_size);
+	return _strings + offset;
+}
+
+const char*
+ladspa_index::library_path(const plugin_record* p)
+{
+	return string(_libraries[p->library].path);
+}
+
+const ladspa_index::port_record*
+ladspa_index::ports(const plugin_record* p)
+{
+	return _ports + p->first_port;
+}
+
+/* The first plugin with the label, in search path order */
+const ladspa_index::plugin_record*
+ladspa_index::find(const char* label)
+{
+	if (!_header || !_header->nr_buckets)
+		return 0;
+
+	uint32_t mask = _header->nr_buckets - 1;
+	for (int32_t i = _buckets[ladspa_library::hash(label) & mask];
+		i != -1; i = _plugins[i].next)
+	{
+		const plugin_record* p = &_plugins[i];
+		if (!strcmp(string(p->label), label))
+			return p;
+	}
+
+	return 0;
+}
+
+const ladspa_index::library_record*
+ladspa_index::find_library(const char* path)
+{
+	if (!_header)
+		return 0;
+
+	/* Only while scanning, and there are few libraries */
+	for (uint32_t i = 0; i < _header->nr_libraries; ++i) {
+		if (!strcmp(string(_libraries[i].path), path))
+			return &_libraries[i];
+	}
+
+	return 0;
+}
+
+uint32_t
+ladspa_index::add_string(builder& b, const char* s)
+{
+	uint32_t offset = b.strings.size();
+	b.strings.insert(b.strings.end(), s, s + strlen(s) + 1);
+	return offset;
+}
+
+/* Take the library's plugins over from the current file */
+void
+ladspa_index::copy_library(const library_record* l, builder& b)
+{
+	library_record nl = *l;
+	nl.path = add_string(b, string(l->path));
+	nl.first_plugin = b.plugins.size();
+
+	for (uint32_t i = 0; i < l->nr_plugins; ++i) {
+		const plugin_record* p = &_plugins[l->first_plugin + i];
+
+		plugin_record np = *p;
+		np.library = b.libraries.size();
+		np.label = add_string(b, string(p->label));
+		np.name = add_string(b, string(p->name));
+		np.first_port = b.ports.size();
+
+		for (uint32_t j = 0; j < p->nr_ports; ++j) {
+			port_record port = _ports[p->first_port + j];
+			port.name = add_string(b, string(port.name));
+			b.ports.push_back(port);
+		}
+
+		b.plugins.push_back(np);
+	}
+
+	b.libraries.push_back(nl);
+}
+
+/* A file that turns out not to be a LADSPA library is recorded with no
+ * plugins, so that it isn't tried again until it changes */
+void
+ladspa_index::load_library(const char* path, const struct stat& st,
+	builder& b)
+{
+	library_record l;
+	memset(&l, 0, sizeof(l));
+	l.path = add_string(b, path);
+	l.mtime = st.st_mtim.tv_sec;
+	l.mtime_nsec = st.st_mtim.tv_nsec;
+	l.size = st.st_size;
+	l.first_plugin = b.plugins.size();
+
+	ladspa_library* lib = ladspa_library::try_open(path);
+	if (!lib) {
+		b.libraries.push_back(l);
+		return;
+	}
+
+	l.nr_plugins = lib->_descriptors.size();
+
+	for (unsigned int i = 0; i < lib->_descriptors.size(); ++i) {
+		const LADSPA_Descriptor* d = lib->_descriptors[i];
+
+		plugin_record p;
+		p.library = b.libraries.size();
+		p.label = add_string(b, d->Label);
+		p.name = add_string(b, d->Name ? d->Name : "");
+		p.unique_id = d->UniqueID;
+		p.properties = d->Properties;
+		p.first_port = b.ports.size();
+		p.nr_ports = d->PortCount;
+		p.next = -1;
+
+		for (unsigned int j = 0; j < d->PortCount; ++j) {
+			const LADSPA_PortRangeHint* hint = &d->PortRangeHints[j];
+
+			port_record port;
+			port.descriptor = d->PortDescriptors[j];
+			port.hints = hint->HintDescriptor;
+			port.lower = hint->LowerBound;
+			port.upper = hint->UpperBound;
+			port.name = add_string(b,
+				d->PortNames && d->PortNames[j]
+					? d->PortNames[j] : "");
+			b.ports.push_back(port);
+		}
+
+		b.plugins.push_back(p);
+	}
+
+	b.libraries.push_back(l);
+
+	lib->close();
+}
+
+void
+ladspa_index::scan_directory(const char* dir, builder& b,
+	std::map<std::string, struct stat>& seen)
+{
+	DIR* d = opendir(dir);
+	if (!d)
+		return;
+
+	/* Sorted, so that the order doesn't depend on the file system */
+	std::vector<std::string> names;
+	while (struct dirent* e = readdir(d)) {
+		size_t len = strlen(e->d_name);
+		if (len > 3 && !strcmp(e->d_name + len - 3, ".so"))
+			names.push_back(e->d_name);
+	}
+
+	closedir(d);
+	std::sort(names.begin(), names.end());
+
+	for (unsigned int i = 0; i < names.size(); ++i) {
+		char resolved[PATH_MAX];
+		std::string path = std::string(dir) + "/" + names[i];
+		if (!realpath(path.c_str(), resolved))
+			continue;
+
+		/* The same library through a symlink or a repeated
+		 * directory */
+		struct stat st;
+		if (stat(resolved, &st) == -1 || !seen.insert(
+			std::make_pair(std::string(resolved), st)).second)
+		{
+			continue;
+		}
+
+		const library_record* l = find_library(resolved);
+		if (l && l->mtime == st.st_mtim.tv_sec
+			&& l->mtime_nsec == st.st_mtim.tv_nsec
+			&& l->size == st.st_size)
+		{
+			copy_library(l, b);
+			++_nr_reused;
+			continue;
+		}
+
+		load_library(resolved, st, b);
+		++_nr_scanned;
+	}
+}
+
+/* search_path is colon-separated, like LADSPA_PATH */
+void
+ladspa_index::scan(const char* search_path)
+{
+	builder b;
+	std::map<std::string, struct stat> seen;
+
+	_nr_scanned = 0;
+	_nr_reused = 0;
+
+	std::string path = search_path;
+	for (size_t start = 0; start <= path.size(); ) {
+		size_t end = path.find(':', start);
+		if (end == std::string::npos)
+			end = path.size();
+
+		if (end > start)
+			scan_directory(path.substr(start, end - start).c_str(),
+				b, seen);
+
+		start = end + 1;
+	}
+
+	/* Nothing new, changed or gone */
+	if (_nr_scanned == 0 && _header
+		&& _nr_reused == _header->nr_libraries)
+	{
+		return;
+	}
+
+	write(b);
+}
+
+void
+ladspa_index::write(builder& b)
+{
+	uint32_t nr_buckets = 1;
+	while (nr_buckets < 2 * b.plugins.size())
+		nr_buckets *= 2;
+
+	/* Backwards, so that the first plugin with a label comes first in
+	 * its chain */
+	std::vector<int32_t> buckets(nr_buckets, -1);
+	for (uint32_t i = b.plugins.size(); i-- > 0; ) {
+		plugin_record& p = b.plugins[i];
+		int32_t* bucket = &buckets[ladspa_library::hash(
+			&b.strings[p.label]) & (nr_buckets - 1)];
+
+		p.next = *bucket;
+		*bucket = i;
+	}
+
+	/* Never empty, so that every offset is inside it */
+	add_string(b, "");
+
+	header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "LADSPAIX", 8);
+	h.version = version;
+	h.nr_libraries = b.libraries.size();
+	h.nr_plugins = b.plugins.size();
+	h.nr_ports = b.ports.size();
+	h.nr_buckets = nr_buckets;
+	h.strings_size = b.strings.size();
+
+	std::string tmp = _filename + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (!fp) {
+		perror(tmp.c_str());
+		return;
+	}
+
+	bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+	if (!b.libraries.empty())
+		ok = ok && fwrite(&b.libraries[0], sizeof(library_record),
+			b.libraries.size(), fp) == b.libraries.size();
+	if (!b.plugins.empty())
+		ok = ok && fwrite(&b.plugins[0], sizeof(plugin_record),
+			b.plugins.size(), fp) == b.plugins.size();
+	if (!b.ports.empty())
+		ok = ok && fwrite(&b.ports[0], sizeof(port_record),
+			b.ports.size(), fp) == b.ports.size();
+	ok = ok && fwrite(&buckets[0], sizeof(int32_t), nr_buckets, fp)
+		== nr_buckets;
+	ok = ok && fwrite(&b.strings[0], 1, b.strings.size(), fp)
+		== b.strings.size();
+
+	if (fclose(fp) != 0 || !ok) {
+		perror(tmp.c_str());
+		unlink(tmp.c_str());
+		return;
+	}
+
+	if (rename(tmp.c_str(), _filename.c_str()) == -1) {
+		perror(_filename.c_str());
+		unlink(tmp.c_str());
+		return;
+	}
+
+	unmap();
+	map();
+}
+
+void
+ladspa_index::print_stats()
+{
+	printf("ladspa index: %u libraries, %u plugins (%u libraries "
+		"scanned, %u up to date)\n",
+		_header ? _header->nr_libraries : 0,
+		_header ? _header->nr_plugins : 0,
+		_nr_scanned, _nr_reused);
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef LADSPA_LIBRARY_HH
+#define LADSPA_LIBRARY_HH
+
+#include <map>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <dlfcn.h>
+#include <ladspa.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+}
+
+/* A LADSPA shared object, opened once for the whole process however
+ * many plugins are instantiated from it, and closed when the last of
+ * them goes away.
+ *
+ * The descriptors are read once when the library is opened and indexed
+ * by label and by UniqueID in hash tables, so that looking one up
+ * doesn't walk the library's whole list every time. Descriptors stay
+ * valid for as long as the library is open. */
+class ladspa_library {
+public:
+	static ladspa_library* open(const char* path);
+	static ladspa_library* try_open(const char* path);
+	void close();
+
+	const LADSPA_Descriptor* find(const char* label);
+	const LADSPA_Descriptor* find(unsigned long id);
+
+	static uint32_t hash(const char* label);
+
+public:
+	/* As resolved by realpath(), so that two names for the same file
+	 * share an entry */
+	std::string _path;
+
+	std::vector<const LADSPA_Descriptor*> _descriptors;
+
+private:
+	ladspa_library(const std::string& path, void* dl,
+		LADSPA_Descriptor_Function df);
+	~ladspa_library();
+
+	void index(unsigned int i);
+
+private:
+	typedef std::map<std::string, ladspa_library*> library_map;
+
+	static library_map _libraries;
+	static pthread_mutex_t _lock;
+
+	void* _dl;
+	unsigned int _refs;
+
+	/* Chains of descriptor indices, and where each one continues */
+	std::vector<int> _label_buckets;
+	std::vector<int> _label_next;
+	std::vector<int> _id_buckets;
+	std::vector<int> _id_next;
+};
+
+ladspa_library::library_map ladspa_library::_libraries;
+pthread_mutex_t ladspa_library::_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ladspa_library::ladspa_library(const std::string& path, void* dl,
+	LADSPA_Descriptor_Function df):
+	_path(path),
+	_dl(dl),
+	_refs(0)
+{
+	for (unsigned int i = 0; ; ++i) {
+		const LADSPA_Descriptor* d = df(i);
+		if (!d)
+			break;
+
+		_descriptors.push_back(d);
+	}
+
+	unsigned int nr_buckets = 1;
+	while (nr_buckets < 2 * _descriptors.size())
+		nr_buckets *= 2;
+
+	_label_buckets.assign(nr_buckets, -1);
+	_label_next.assign(_descriptors.size(), -1);
+	_id_buckets.assign(nr_buckets, -1);
+	_id_next.assign(_descriptors.size(), -1);
+
+	/* Backwards, so that the first of any duplicates ends up first in
+	 * its chain, as with a linear search */
+	for (unsigned int i = _descriptors.size(); i-- > 0; )
+		index(i);
+}
+
+ladspa_library::~ladspa_library()
+{
+	dlclose(_dl);
+}
+
+uint32_t
+ladspa_library::hash(const char* label)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261U;
+	for (const char* s = label; *s; ++s) {
+		h ^= (uint8_t) *s;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+void
+ladspa_library::index(unsigned int i)
+{
+	unsigned int mask = _label_buckets.size() - 1;
+	const LADSPA_Descriptor* d = _descriptors[i];
+
+	int* label_bucket = &_label_buckets[hash(d->Label) & mask];
+	_label_next[i] = *label_bucket;
+	*label_bucket = i;
+
+	int* id_bucket = &_id_buckets[d->UniqueID & mask];
+	_id_next[i] = *id_bucket;
+	*id_bucket = i;
+}
+
+/* Exits if the library can't be loaded */
+ladspa_library*
+ladspa_library::open(const char* path)
+{
+	ladspa_library* lib = try_open(path);
+	if (!lib)
+		exit(EXIT_FAILURE);
+
+	return lib;
+}
+
+/* Says why and returns 0 if the library can't be loaded */
+ladspa_library*
+ladspa_library::try_open(const char* path)
+{
+	char resolved[PATH_MAX];
+	std::string key = realpath(path, resolved) ? resolved : path;
+
+	pthread_mutex_lock(&_lock);
+
+	ladspa_library* lib = 0;
+
+	library_map::iterator i = _libraries.find(key);
+	if (i != _libraries.end()) {
+		lib = i->second;
+	} else {
+		void* dl = dlopen(key.c_str(), RTLD_NOW | RTLD_LOCAL);
+		void* sym = dl ? dlsym(dl, "ladspa_descriptor") : 0;
+
+		if (sym) {
+			lib = new ladspa_library(key, dl,
+				(LADSPA_Descriptor_Function) sym);
+			_libraries.insert(std::make_pair(key, lib));
+		} else if (dl) {
+			fprintf(stderr, "%s: not a LADSPA library\n",
+				key.c_str());
+			dlclose(dl);
+		} else {
+			fprintf(stderr, "%s\n", dlerror());
+		}
+	}
+
+	if (lib)
+		++lib->_refs;
+
+	pthread_mutex_unlock(&_lock);
+	return lib;
+}
+
+/* Once for every open(); no descriptor from the library may be used
+ * after the last one */
+void
+ladspa_library::close()
+{
+	pthread_mutex_lock(&_lock);
+
+	assert(_refs > 0);
+	if (--_refs == 0) {
+		_libraries.erase(_path);
+		delete this;
+	}
+
+	pthread_mutex_unlock(&_lock);
+}
+
+const LADSPA_Descriptor*
+ladspa_library::find(const char* label)
+{
+	unsigned int mask = _label_buckets.size() - 1;
+
+	for (int i = _label_buckets[hash(label) & mask]; i != -1;
+		i = _label_next[i])
+	{
+		if (!strcmp(_descriptors[i]->Label, label))
+			return _descriptors[i];
+	}
+
+	return 0;
+}
+
+const LADSPA_Descriptor*
+ladspa_library::find(unsigned long id)
+{
+	unsigned int mask = _id_buckets.size() - 1;
+
+	for (int i = _id_buckets[id & mask]; i != -1; i = _id_next[i]) {
+		if (_descriptors[i]->UniqueID == id)
+			return _descriptors[i];
+	}
+
+	return 0;
+}
+
+#endif
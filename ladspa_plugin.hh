@@ -1,11 +1,13 @@
 #ifndef LADSPA_PLUGIN_HH
 #define LADSPA_PLUGIN_HH
 
+#include <vector>
+
 extern "C" {
-#include <dlfcn.h>
 #include <ladspa.h>
 }
 
+#include "ladspa_library.hh"
 #include "plugin.hh"
 #include "sequencer.hh"
 
@@ -14,54 +16,97 @@ class ladspa_plugin:
 {
 public:
 	ladspa_plugin(const char* path, const char* label);
+	ladspa_plugin(const char* path, unsigned long id);
 	~ladspa_plugin();
 
+private:
+	void init(const LADSPA_Descriptor* descriptor);
+
 public:
 	void activate();
 	void deactivate();
 
+	const char* name();
+
 	void connect(unsigned int port, float* buffer);
 	void disconnect(unsigned int port);
 
+	bool is_audio_input(unsigned int port);
+	bool is_audio_output(unsigned int port);
+
+	bool busy();
+
+	bool can_run_in_place();
+	bool can_run_adding();
+
 	void run(unsigned int sample_count);
+	void run_adding(unsigned int sample_count, float gain);
+
+private:
+	typedef void (*run_function)(LADSPA_Handle, unsigned long);
+
+	void run_events(run_function f, unsigned int sample_count);
+	void run_split(run_function f, unsigned int offset, unsigned int n);
 
 public:
-	void* _dl;
+	ladspa_library* _library;
 	const LADSPA_Descriptor* _descriptor;
 	LADSPA_Handle _handle;
-};
 
-ladspa_plugin::ladspa_plugin(const char* path, const char* label)
-{
-	_dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
-	if (!_dl)
-		exit(1);
+	/* Last passed to set_run_adding_gain() */
+	LADSPA_Data _run_adding_gain;
 
-	void* sym = dlsym(_dl, "ladspa_descriptor");
-	if (!sym)
-		exit(1);
+	std::vector<unsigned int> _audio_ports;
 
-	LADSPA_Descriptor_Function df = (LADSPA_Descriptor_Function) sym;
+	/* The control inputs, and their values as of the last busy() */
+	std::vector<unsigned int> _control_inputs;
+	std::vector<LADSPA_Data> _controls;
+};
 
-	/* Look for the right ladspa_plugin */
-	for (unsigned int i = 0; ; ++i) {
-		const LADSPA_Descriptor *d = df(i);
-		if (!d)
-			break;
+ladspa_plugin::ladspa_plugin(const char* path, const char* label):
+	_library(ladspa_library::open(path))
+{
+	const LADSPA_Descriptor* d = _library->find(label);
+	if (!d) {
+		fprintf(stderr, "%s: no plugin labelled %s\n",
+			_library->_path.c_str(), label);
+		exit(EXIT_FAILURE);
+	}
 
-		if (!strcmp(d->Label, label)) {
-			_descriptor = d;
-			break;
-		}
+	init(d);
+}
+
+ladspa_plugin::ladspa_plugin(const char* path, unsigned long id):
+	_library(ladspa_library::open(path))
+{
+	const LADSPA_Descriptor* d = _library->find(id);
+	if (!d) {
+		fprintf(stderr, "%s: no plugin with ID %lu\n",
+			_library->_path.c_str(), id);
+		exit(EXIT_FAILURE);
 	}
 
-	if (!_descriptor)
-		exit(1);
+	init(d);
+}
+
+void
+ladspa_plugin::init(const LADSPA_Descriptor* descriptor)
+{
+	_descriptor = descriptor;
 
 	_handle = _descriptor->instantiate(_descriptor, sample_rate);
 	if (!_handle)
 		exit(1);
 
+	/* Nothing says whether a LADSPA plugin has a tail, so it is only
+	 * bypassed if whoever creates it knows that it doesn't */
+	_bypass = false;
+
+	_run_adding_gain = 1;
+	if (can_run_adding())
+		_descriptor->set_run_adding_gain(_handle, 1);
+
+	_nr_ports = _descriptor->PortCount;
 	_ports = new LADSPA_Data*[_descriptor->PortCount];
 
 	for (unsigned int i = 0; i < _descriptor->PortCount; ++i) {
@@ -74,13 +119,21 @@ ladspa_plugin::ladspa_plugin(const char* path, const char* label)
 			_ports[i] = new LADSPA_Data[1];
 			_ports[i][0] = 0.5 * hint->LowerBound
 					+ 0.5 * hint->UpperBound;
+
+			if (port & LADSPA_PORT_INPUT) {
+				_control_inputs.push_back(i);
+				_controls.push_back(_ports[i][0]);
+			}
 		}
 
 		if (port & LADSPA_PORT_AUDIO) {
+			_audio_ports.push_back(i);
+
 			if (port & LADSPA_PORT_INPUT)
 				_ports[i] = silence_buffer;
+			/* Bound by the graph */
 			if (port & LADSPA_PORT_OUTPUT)
-				_ports[i] = new LADSPA_Data[buffer_size];
+				_ports[i] = 0;
 		}
 
 		_descriptor->connect_port(_handle, i, _ports[i]);
@@ -89,28 +142,20 @@ ladspa_plugin::ladspa_plugin(const char* path, const char* label)
 
 ladspa_plugin::~ladspa_plugin()
 {
-	/* Delete audio buffers */
+	/* Delete control buffers; audio buffers belong to the graph */
 	for (unsigned int i = 0; i < _descriptor->PortCount; ++i) {
 		const LADSPA_PortDescriptor port
 			= _descriptor->PortDescriptors[i];
 
-		if (port & LADSPA_PORT_CONTROL) {
+		if (port & LADSPA_PORT_CONTROL)
 			delete[] _ports[i];
-			continue;
-		}
-
-		if (port & LADSPA_PORT_AUDIO) {
-			if (port & LADSPA_PORT_OUTPUT)
-				delete[] _ports[i];
-			continue;
-		}
 	}
 
 	delete[] _ports;
 
 	_descriptor->cleanup(_handle);
 
-	dlclose(_dl);
+	_library->close();
 }
 
 void
@@ -126,6 +171,12 @@ ladspa_plugin::deactivate()
 		_descriptor->deactivate(_handle);
 }
 
+const char*
+ladspa_plugin::name()
+{
+	return _descriptor->Label;
+}
+
 void
 ladspa_plugin::connect(unsigned int port_nr, LADSPA_Data* buffer)
 {
@@ -133,7 +184,6 @@ ladspa_plugin::connect(unsigned int port_nr, LADSPA_Data* buffer)
 		= _descriptor->PortDescriptors[port_nr];
 
 	assert(port & LADSPA_PORT_AUDIO);
-	assert(port & LADSPA_PORT_INPUT);
 
 	plugin::connect(port_nr, buffer);
 	_descriptor->connect_port(_handle, port_nr, _ports[port_nr]);
@@ -152,59 +202,161 @@ ladspa_plugin::disconnect(unsigned int port_nr)
 	_descriptor->connect_port(_handle, port_nr, _ports[port_nr]);
 }
 
+bool
+ladspa_plugin::is_audio_input(unsigned int port_nr)
+{
+	const LADSPA_PortDescriptor port
+		= _descriptor->PortDescriptors[port_nr];
+
+	return (port & LADSPA_PORT_AUDIO) && (port & LADSPA_PORT_INPUT);
+}
+
+bool
+ladspa_plugin::is_audio_output(unsigned int port_nr)
+{
+	const LADSPA_PortDescriptor port
+		= _descriptor->PortDescriptors[port_nr];
+
+	return (port & LADSPA_PORT_AUDIO) && (port & LADSPA_PORT_OUTPUT);
+}
+
+bool
+ladspa_plugin::can_run_in_place()
+{
+	return !LADSPA_IS_INPLACE_BROKEN(_descriptor->Properties);
+}
+
+/* A control input written since the last block may make a bypassed
+ * plugin start sounding again */
+bool
+ladspa_plugin::busy()
+{
+	bool changed = false;
+
+	for (unsigned int i = 0; i < _control_inputs.size(); ++i) {
+		LADSPA_Data value = _ports[_control_inputs[i]][0];
+
+		if (value != _controls[i]) {
+			_controls[i] = value;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+bool
+ladspa_plugin::can_run_adding()
+{
+	return _descriptor->run_adding && _descriptor->set_run_adding_gain;
+}
+
+/* Run part of the block; the audio ports have to be moved along */
+void
+ladspa_plugin::run_split(run_function f, unsigned int offset, unsigned int n)
+{
+	for (unsigned int i = 0; i < _audio_ports.size(); ++i) {
+		unsigned int port = _audio_ports[i];
+
+		_descriptor->connect_port(_handle, port, _ports[port] + offset);
+	}
+
+	f(_handle, n);
+}
+
 void
 ladspa_plugin::run(unsigned int sample_count)
 {
-	unsigned int sample_offset = 0;
-	while (sample_count) {
-		unsigned int n = sample_count;
+	run_events(_descriptor->run, sample_count);
+}
 
-		for (sequencer_map::iterator i = _seqs.begin(),
-			end = _seqs.end(); i != end; ++i)
-		{
-			sequencer* seq = i->first;
-			unsigned int voice = i->second;
+void
+ladspa_plugin::run_adding(unsigned int sample_count, float gain)
+{
+	if (gain != _run_adding_gain) {
+		_descriptor->set_run_adding_gain(_handle, gain);
+		_run_adding_gain = gain;
+	}
 
-			unsigned int d = seq->duration_remaining(voice);
-			if (d < n)
-				n = d;
-		}
+	run_events(_descriptor->run_adding, sample_count);
+}
+
+/* LADSPA control ports only hold one value per run(), so the block is
+ * split wherever an event changes one of them, and every control period
+ * of the automation lanes that drive them. */
+void
+ladspa_plugin::run_events(run_function f, unsigned int sample_count)
+{
+	unsigned int nr_events = _events.size();
 
-		/* Update buffers */
-		for (unsigned int i = 0; i < _descriptor->PortCount; ++i) {
-			const LADSPA_PortDescriptor port
-				= _descriptor->PortDescriptors[i];
+	/* The shortest control period of the lanes; a plugin that was never
+	 * set up by a graph has none */
+	unsigned int period = 0;
+	for (unsigned int i = 0; _ramps.size() == _nr_ports
+		&& i < _control_inputs.size(); ++i)
+	{
+		unsigned int port = _control_inputs[i];
 
-			if (!(port & LADSPA_PORT_AUDIO))
-				continue;
+		if (!_ramps[port])
+			continue;
+		if (!period || _ramp_periods[port] < period)
+			period = _ramp_periods[port];
+	}
 
-			_descriptor->connect_port(_handle, i, _ports[i] + sample_offset);
-		}
+	if (nr_events == 0 && period == 0) {
+		f(_handle, sample_count);
+		return;
+	}
 
-		_descriptor->run(_handle, n);
+	unsigned int offset = 0;
+	unsigned int e = 0;
+	bool split = false;
 
-		for (sequencer_map::iterator i = _seqs.begin(),
-			end = _seqs.end(); i != end; ++i)
+	while (offset < sample_count) {
+		/* The lanes first, so that an event for the same port wins */
+		for (unsigned int i = 0; period && i < _control_inputs.size();
+			++i)
 		{
-			sequencer* seq = i->first;
-			unsigned int voice = i->second;
+			unsigned int port = _control_inputs[i];
 
-			seq->advance(voice, n);
+			if (_ramps[port])
+				_ports[port][0] = _ramps[port][offset];
 		}
 
-		sample_count -= n;
-		sample_offset += n;
+		/* Apply everything that is due now */
+		while (e < nr_events && _events[e].offset <= offset) {
+			if (_events[e].port)
+				*_events[e].port = _events[e].value;
+			++e;
+		}
+
+		unsigned int end = sample_count;
+		if (e < nr_events)
+			end = _events[e].offset;
+		if (period && offset - offset % period + period < end)
+			end = offset - offset % period + period;
+
+		if (offset == 0) {
+			f(_handle, end);
+		} else {
+			run_split(f, offset, end - offset);
+			split = true;
+#ifdef NODE_PROFILING
+			++_nr_splits;
+#endif
+		}
+
+		offset = end;
 	}
 
-	/* Reset buffers */
-	for (unsigned int i = 0; i < _descriptor->PortCount; ++i) {
-		const LADSPA_PortDescriptor port
-			= _descriptor->PortDescriptors[i];
+	if (!split)
+		return;
 
-		if (!(port & LADSPA_PORT_AUDIO))
-			continue;
+	/* Reset buffers */
+	for (unsigned int i = 0; i < _audio_ports.size(); ++i) {
+		unsigned int port = _audio_ports[i];
 
-		_descriptor->connect_port(_handle, i, _ports[i]);
+		_descriptor->connect_port(_handle, port, _ports[port]);
 	}
 }
 
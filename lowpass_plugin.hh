@@ -0,0 +1,111 @@
+#ifndef LOWPASS_PLUGIN_HH
+#define LOWPASS_PLUGIN_HH
+
+extern "C" {
+#include <math.h>
+}
+
+#include "plugin.hh"
+
+/* One-pole low-pass filter; a cheap stand-in for an effect */
+class lowpass_plugin:
+	public plugin
+{
+public:
+	lowpass_plugin(float cutoff);
+	~lowpass_plugin();
+
+public:
+	bool is_audio_input(unsigned int port);
+	bool is_audio_output(unsigned int port);
+
+	bool can_run_in_place();
+
+	void run(unsigned int sample_count);
+
+private:
+	float _y;
+};
+
+lowpass_plugin::lowpass_plugin(float cutoff):
+	_y(0)
+{
+	_bypass = true;
+
+	_nr_ports = 3;
+	_ports = new float*[3];
+
+	_ports[0] = silence_buffer;
+
+	/* Bound by the graph */
+	_ports[1] = 0;
+
+	_ports[2] = new float[1];	/* Cutoff */
+	_ports[2][0] = cutoff;
+}
+
+lowpass_plugin::~lowpass_plugin()
+{
+	delete[] _ports[2];
+	delete[] _ports;
+}
+
+bool
+lowpass_plugin::is_audio_input(unsigned int port)
+{
+	return port == 0;
+}
+
+bool
+lowpass_plugin::is_audio_output(unsigned int port)
+{
+	return port == 1;
+}
+
+bool
+lowpass_plugin::can_run_in_place()
+{
+	/* Each sample is read before the same one is written */
+	return true;
+}
+
+void
+lowpass_plugin::run(unsigned int sample_count)
+{
+	const float* in = _ports[0];
+	float* out = _ports[1];
+	const float* cutoff = _ramps[2];
+	float y = _y;
+
+	/* Automated: recompute the coefficient every few samples */
+	if (cutoff) {
+		static const unsigned int step = 16;
+
+		for (unsigned int i = 0; i < sample_count; i += step) {
+			float a = 1 - expf(-2 * M_PI * cutoff[i] / sample_rate);
+
+			unsigned int end = i + step;
+			if (end > sample_count)
+				end = sample_count;
+
+			for (unsigned int j = i; j < end; ++j) {
+				y += a * (in[j] - y);
+				out[j] = y;
+			}
+		}
+
+		_y = y;
+		return;
+	}
+
+	float a = 1 - expf(-2 * M_PI * _ports[2][0] / sample_rate);
+
+	for (unsigned int i = 0; i < sample_count; ++i) {
+		y += a * (in[i] - y);
+		out[i] = y;
+	}
+
+	_y = y;
+}
+
+#endif
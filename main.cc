@@ -3,6 +3,7 @@
 
 extern "C" {
 #include <assert.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,20 +14,61 @@ extern "C" {
 #include <math.h>
 }
 
-static const unsigned long sample_rate = 44100;
-static const unsigned long buffer_size = 16384;
+/* Chosen at startup with -r and -b; fixed from then on */
+static unsigned long sample_rate = 44100;
+static unsigned long buffer_size = 16384;
 
-static LADSPA_Data silence_buffer[buffer_size];
+static const unsigned long min_buffer_size = 32;
+static const unsigned long max_buffer_size = 16384;
+
+static const unsigned long min_sample_rate = 8000;
+static const unsigned long max_sample_rate = 192000;
+
+/* For -p and -n */
+static const unsigned long max_voices = 256;
+
+/* For -c, in MiB */
+static const unsigned long max_cache_size = 4096;
+
+/* For -j */
+static const unsigned long max_threads = 64;
+
+static LADSPA_Data* silence_buffer;
+static bool silence_flag = true;
 
 #include "alsa_output_plugin.hh"
+#include "buffer_pool.hh"
+#include "convert_kernels.hh"
+#include "convolver_plugin.hh"
+#include "denormals.hh"
 #include "edge.hh"
+#include "event.hh"
+#include "fft.hh"
 #include "graph.hh"
+#include "ladspa_index.hh"
+#include "ladspa_library.hh"
 #include "ladspa_plugin.hh"
+#include "lowpass_plugin.hh"
+#include "meter_kernels.hh"
+#include "meter_plugin.hh"
 #include "midi_sequencer.hh"
+#include "mix_kernels.hh"
 #include "mixer_plugin.hh"
+#include "node_profiler.hh"
+#include "note_cache.hh"
+#include "offline_renderer.hh"
+#include "organ_plugin.hh"
+#include "parallel_executor.hh"
 #include "plugin.hh"
+#include "poly_plugin.hh"
+#include "resampler.hh"
+#include "resampler_plugin.hh"
+#include "sampler_plugin.hh"
+#include "schedule.hh"
 #include "sequencer.hh"
 #include "simple_sequencer.hh"
+#include "sine_plugin.hh"
+#include "sine_voice_plugin.hh"
 #include "wav_output_plugin.hh"
 
 #if 0
@@ -47,74 +89,487 @@ static struct note song[] = {
 
 static bool running;
 
+/* Where to look for LADSPA plugins by label, if anywhere (-x) */
+static ladspa_index* plugin_index;
+
+/* Falls back on the given library if the plugin isn't in the index */
+static plugin*
+make_ladspa(const char* path, const char* label)
+{
+	const ladspa_index::plugin_record* p
+		= plugin_index ? plugin_index->find(label) : 0;
+	if (p)
+		return new ladspa_plugin(plugin_index->library_path(p),
+			(unsigned long) p->unique_id);
+
+	return new ladspa_plugin(path, label);
+}
+
+/* Works for both the CMT organ and organ_plugin */
+static void
+setup_organ(plugin* organ)
+{
+	organ->_ports[1][0] = 0;	/* Gate */
+	organ->_ports[2][0] = 0.5;	/* Velocity */
+	organ->_ports[3][0] = 0;	/* Frequency */
+	organ->_ports[4][0] = 0.5;	/* Brass */
+	organ->_ports[5][0] = 0.5;	/* Reed */
+	organ->_ports[6][0] = 0.4;	/* Flute */
+	organ->_ports[7][0] = 0.3;	/* 16th Harmonic */
+	organ->_ports[8][0] = 0.3;	/* 8th Harmonic */
+	organ->_ports[9][0] = 0.3;	/* 5 1/3rd Harmonic */
+	organ->_ports[10][0] = 0.3;	/* 4th Harmonic */
+	organ->_ports[11][0] = 0.3;	/* 2 2/3rd Harmonic */
+	organ->_ports[12][0] = 0.3;	/* 2nd Harmonic */
+	organ->_ports[13][0] = 0.01;	/* Attack Lo*/
+	organ->_ports[14][0] = 0.8;	/* Decay Lo */
+	organ->_ports[15][0] = 1;	/* Sustain Lo */
+	organ->_ports[16][0] = 1;	/* Release Lo */
+	organ->_ports[17][0] = 0;	/* Attack Hi */
+	organ->_ports[18][0] = 1;	/* Decay Hi */
+	organ->_ports[19][0] = 1;	/* Sustain Hi */
+	organ->_ports[20][0] = 1;	/* Release Hi */
+}
+
+static plugin*
+make_organ()
+{
+	//plugin* organ = new plugin("/usr/lib64/ladspa/cmt.so", "organ");
+	plugin* organ = make_ladspa(
+		"/home/vegard/programming/cmt/plugins/cmt.so", "organ");
+
+	/* Only ever sounds after a gate, and its envelope is all the tail
+	 * it has */
+	organ->_bypass = true;
+
+	setup_organ(organ);
+	return organ;
+}
+
+/* A WAV file if there is a name, otherwise the sound card. The graph
+ * runs at sample_rate throughout, so a card that can't do that rate
+ * gets a resampler in front of it; nothing else in the graph is ever
+ * resampled. */
+static plugin*
+make_output(const char* output_file, resampler::quality quality)
+{
+	if (output_file)
+		return new wav_output_plugin(output_file);
+
+	alsa_output_plugin* alsa = new alsa_output_plugin("plughw:0,0");
+	if (alsa->_rate == sample_rate)
+		return alsa;
+
+	printf("resampling to %lu Hz (%s)\n", alsa->_rate,
+		resampler::quality_name(quality));
+	return new resampler_plugin(alsa, alsa->_rate, quality);
+}
+
+/* Each line of the map is "root low high file.wav", with MIDI note
+ * numbers; the file plays at its own pitch at the root note */
+static void
+load_samples(sampler_plugin* sampler, const char* filename)
+{
+	FILE* fp = fopen(filename, "r");
+	if (!fp) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+
+	char line[1024];
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned int root, low, high;
+		char file[1024];
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "%u %u %u %1023s", &root, &low, &high, file) != 4
+			|| root > 127 || low > high || high > 127)
+		{
+			fprintf(stderr, "%s: bad line: %s", filename, line);
+			exit(EXIT_FAILURE);
+		}
+
+		sampler->add_sample(file, root, low, high);
+	}
+
+	fclose(fp);
+}
+
+static float
+decibels(float amplitude)
+{
+	return amplitude > 0 ? 20 * log10f(amplitude) : -INFINITY;
+}
+
+/* Prints the levels over each second or so of output */
+static void*
+monitor_thread(void* arg)
+{
+	meter_plugin* meter = (meter_plugin*) arg;
+
+	meter_plugin::reading last;
+	meter->read(&last);
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		sleep(1);
+
+		meter_plugin::reading r;
+		meter->read(&r);
+
+		unsigned long frames = r.frames - last.frames;
+		if (!frames)
+			continue;
+
+		for (unsigned int i = 0; i < meter->_nr_channels; ++i) {
+			const meter_plugin::channel_levels& c = r.channels[i];
+			double energy = c.energy - last.channels[i].energy;
+
+			printf("%c: %6.1f dB RMS, max %6.1f dB peak, "
+				"%6.1f dB true peak, %lu clipped\n",
+				i ? 'R' : 'L', decibels(sqrt(energy / frames)),
+				decibels(c.max_peak), decibels(c.max_true_peak),
+				c.clips);
+		}
+
+		last = r;
+	}
+
+	return NULL;
+}
+
 static void handle_sigint(int signo)
 {
 	running = false;
 }
 
+#ifdef NODE_PROFILING
+/* Times every node with -P; dumped on SIGUSR1 and at the end */
+static node_profiler* profiler;
+
+static void handle_sigusr1(int signo)
+{
+	profiler->request_dump();
+}
+#endif
+
 int
 main(int argc, char* argv[])
 {
+	unsigned int nr_threads = 1;
+	unsigned int pool_size = 0;
+	unsigned int cache_size = 0;
+	unsigned int native_voices = 0;
+	bool metering = false;
+
+	/* Fill the -p pool with sine voices, which can be cached, instead
+	 * of CMT organs */
+	bool sine_voices = false;
+
+	poly_plugin::steal_policy policy = poly_plugin::STEAL_OLDEST;
+	resampler::quality quality = resampler::QUALITY_MEDIUM;
+
+	/* Render to this file as fast as possible instead of playing */
+#ifdef FILE_OUTPUT
+	const char* output_file = "output.wav";
+#else
+	const char* output_file = 0;
+#endif
+
+	/* Convolve with this impulse response instead of the plate reverb */
+	const char* ir_file = 0;
+
+	/* Play these samples instead of the organ */
+	const char* sample_map = 0;
+
+	/* Find LADSPA plugins on LADSPA_PATH through this index file */
+	const char* index_file = 0;
+
+#ifdef NODE_PROFILING
+	/* Write node timings to this file ("-" for stdout) */
+	const char* stats_file = 0;
+#endif
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:c:di:j:mn:o:p:P:q:r:s:S:vx:")) != -1) {
+		switch (opt) {
+		case 'b': {
+			char* end;
+			buffer_size = strtoul(optarg, &end, 0);
+			if (*end || buffer_size < min_buffer_size
+				|| buffer_size > max_buffer_size)
+			{
+				fprintf(stderr, "block size must be between "
+					"%lu and %lu frames\n",
+					min_buffer_size, max_buffer_size);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'c': {
+			char* end;
+			unsigned long n = strtoul(optarg, &end, 0);
+			if (*end || n < 1 || n > max_cache_size) {
+				fprintf(stderr, "note cache size must be between "
+					"1 and %lu MiB\n", max_cache_size);
+				exit(EXIT_FAILURE);
+			}
+
+			cache_size = n;
+			break;
+		}
+		case 'd':
+			/* Let them through, to see where they come from */
+			check_denormals = true;
+			flush_denormals = false;
+			break;
+		case 'i':
+			ir_file = optarg;
+			break;
+		case 'j': {
+			char* end;
+			unsigned long n = strtoul(optarg, &end, 0);
+			if (*end || n < 1 || n > max_threads) {
+				fprintf(stderr, "number of threads must be between "
+					"1 and %lu\n", max_threads);
+				exit(EXIT_FAILURE);
+			}
+
+			nr_threads = n;
+			break;
+		}
+		case 'm':
+			metering = true;
+			break;
+		case 'n': {
+			char* end;
+			unsigned long n = strtoul(optarg, &end, 0);
+			if (*end || n < 1 || n > max_voices) {
+				fprintf(stderr, "number of voices must be between "
+					"1 and %lu\n", max_voices);
+				exit(EXIT_FAILURE);
+			}
+
+			native_voices = n;
+			break;
+		}
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'p': {
+			char* end;
+			unsigned long n = strtoul(optarg, &end, 0);
+			if (*end || n < 1 || n > max_voices) {
+				fprintf(stderr, "voice pool size must be between "
+					"1 and %lu\n", max_voices);
+				exit(EXIT_FAILURE);
+			}
+
+			pool_size = n;
+			break;
+		}
+		case 'P':
+#ifdef NODE_PROFILING
+			stats_file = optarg;
+			break;
+#else
+			fprintf(stderr, "-P needs a build with "
+				"-DNODE_PROFILING\n");
+			exit(EXIT_FAILURE);
+#endif
+		case 'q':
+			if (!resampler::parse_quality(optarg, &quality)) {
+				fprintf(stderr, "unknown resampling quality: %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			sample_rate = strtoul(optarg, NULL, 0);
+			if (sample_rate < min_sample_rate
+				|| sample_rate > max_sample_rate)
+			{
+				fprintf(stderr, "sample rate must be between "
+					"%lu and %lu Hz\n",
+					min_sample_rate, max_sample_rate);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			if (!strcmp(optarg, "oldest")) {
+				policy = poly_plugin::STEAL_OLDEST;
+			} else if (!strcmp(optarg, "quietest")) {
+				policy = poly_plugin::STEAL_QUIETEST;
+			} else {
+				fprintf(stderr, "unknown stealing policy: %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'S':
+			sample_map = optarg;
+			break;
+		case 'v':
+			sine_voices = true;
+			break;
+		case 'x':
+			index_file = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b frames] [-d] [-i ir.wav] "
+				"[-j threads] [-m] [-n voices] [-o output.wav] "
+				"[-p voices [-s oldest|quietest] [-v] [-c MiB]] "
+				"[-P stats.csv] [-q fast|medium|best] [-r rate] "
+				"[-S samples.map] [-x index] [file.mid]\n",
+				argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	silence_buffer = new LADSPA_Data[buffer_size]();
+
+	init_mix_kernels();
+	init_convert_kernels();
+	init_meter_kernels();
+
+	printf("%lu Hz, %lu frames per block (%.1f ms), %s mixing, "
+		"%s conversion, %s metering\n",
+		sample_rate, buffer_size, 1000. * buffer_size / sample_rate,
+		mix_kernel_name, convert_kernel_name, meter_kernel_name);
+
 	signal(SIGINT, &handle_sigint);
 
-	midi_sequencer* seq = new midi_sequencer("KV331_3_RondoAllaTurca.mid");
+	if (index_file) {
+		const char* path = getenv("LADSPA_PATH");
+		if (!path)
+			path = "/usr/local/lib/ladspa:/usr/lib/ladspa:"
+				"/usr/lib64/ladspa";
+
+		plugin_index = new ladspa_index(index_file);
+		plugin_index->scan(path);
+		plugin_index->print_stats();
+	}
+
+	const char* midi_file = "KV331_3_RondoAllaTurca.mid";
+	if (optind < argc)
+		midi_file = argv[optind];
+
+	midi_sequencer* seq = new midi_sequencer(midi_file);
 	//midi_sequencer* seq = new midi_sequencer("toccata1.mid");
 	//midi_sequencer* seq = new midi_sequencer("entertainer.mid");
 	//midi_sequencer* seq = new midi_sequencer("a-breeze-from-alabama.mid");
 
-	unsigned int nr_voices = seq->_voices.size();
+	/* Either one organ for each voice the sequencer came up with, a
+	 * fixed pool of organs that notes get assigned to as they play, or
+	 * the built-in organ that renders all its voices at once */
+	unsigned int nr_voices = (pool_size || native_voices || sample_map)
+		? 1 : seq->_voices.size();
 
 	graph* g = new graph();
 
-#ifndef FILE_OUTPUT
-	plugin* output = new alsa_output_plugin("plughw:0,0");
-#else
-	plugin* output = new wav_output_plugin("output.wav");
+	/* The organ voices are independent, so they can render in parallel */
+	parallel_executor* executor = 0;
+	if (nr_threads > 1) {
+		executor = new parallel_executor(nr_threads);
+		g->set_executor(executor);
+	}
+
+#ifdef NODE_PROFILING
+	if (stats_file) {
+		if (!strcmp(stats_file, "-"))
+			stats_file = 0;
+
+		profiler = new node_profiler(nr_threads);
+		profiler->start_dumping(stats_file);
+		g->set_profiler(profiler);
+
+		signal(SIGUSR1, &handle_sigusr1);
+	}
 #endif
 
-	//plugin* organ = new plugin("/usr/lib64/ladspa/cmt.so", "organ");
-	plugin* organs[nr_voices];
+	plugin* output = make_output(output_file, quality);
 
-	for (unsigned int i = 0; i < nr_voices; ++i) {
-		plugin* organ = new ladspa_plugin(
-			"/home/vegard/programming/cmt/plugins/cmt.so", "organ");
-
-		organ->_ports[1][0] = 0;	/* Gate */
-		organ->_ports[2][0] = 0.5;	/* Velocity */
-		organ->_ports[3][0] = 0;	/* Frequency */
-		organ->_ports[4][0] = 0.5;	/* Brass */
-		organ->_ports[5][0] = 0.5;	/* Reed */
-		organ->_ports[6][0] = 0.4;	/* Flute */
-		organ->_ports[7][0] = 0.3;	/* 16th Harmonic */
-		organ->_ports[8][0] = 0.3;	/* 8th Harmonic */
-		organ->_ports[9][0] = 0.3;	/* 5 1/3rd Harmonic */
-		organ->_ports[10][0] = 0.3;	/* 4th Harmonic */
-		organ->_ports[11][0] = 0.3;	/* 2 2/3rd Harmonic */
-		organ->_ports[12][0] = 0.3;	/* 2nd Harmonic */
-		organ->_ports[13][0] = 0.01;	/* Attack Lo*/
-		organ->_ports[14][0] = 0.8;	/* Decay Lo */
-		organ->_ports[15][0] = 1;	/* Sustain Lo */
-		organ->_ports[16][0] = 1;	/* Release Lo */
-		organ->_ports[17][0] = 0;	/* Attack Hi */
-		organ->_ports[18][0] = 1;	/* Decay Hi */
-		organ->_ports[19][0] = 1;	/* Sustain Hi */
-		organ->_ports[20][0] = 1;	/* Release Hi */
-
-		seq->connect_gate(i, organ->_ports[1]);
-		seq->connect_frequency(i, organ->_ports[3]);
-		organ->_seqs[seq] = i;
-
-		organs[i] = organ;
+	plugin* organs[nr_voices];
+	note_cache* cache = 0;
+
+	if (sample_map) {
+		sampler_plugin* sampler = new sampler_plugin(
+			native_voices ? native_voices : 32);
+		load_samples(sampler, sample_map);
+		sampler->_seqs[seq] = sequencer::all_notes;
+
+		organs[0] = sampler;
+	} else if (native_voices) {
+		plugin* organ = new organ_plugin(native_voices);
+		setup_organ(organ);
+		organ->_seqs[seq] = sequencer::all_notes;
+
+		organs[0] = organ;
+	} else if (pool_size) {
+		poly_plugin::plugin_vector pool;
+		for (unsigned int i = 0; i < pool_size; ++i) {
+			if (sine_voices)
+				pool.push_back(new sine_voice_plugin());
+			else
+				pool.push_back(make_organ());
+		}
+
+		/* Gate, frequency, velocity, output */
+		poly_plugin* poly = new poly_plugin(pool, 1, 3, 2, 0, policy);
+		poly->_seqs[seq] = sequencer::all_notes;
+
+		/* Only a plugin can say that it plays every note the same;
+		 * the CMT organ's oscillators carry their phase over from one
+		 * note to the next, the sine voices' don't */
+		if (cache_size && !pool[0]->_deterministic) {
+			printf("note cache: the voices aren't deterministic, "
+				"so nothing will be cached\n");
+		} else if (cache_size) {
+			cache = new note_cache((unsigned long) cache_size << 20);
+			poly->set_cache(cache);
+		}
+
+		organs[0] = poly;
+	} else {
+		for (unsigned int i = 0; i < nr_voices; ++i) {
+			plugin* organ = make_organ();
+
+			seq->connect_gate(i, organ->_ports[1]);
+			seq->connect_frequency(i, organ->_ports[3]);
+			organ->_seqs[seq] = i;
+
+			organs[i] = organ;
+		}
 	}
 
-	plugin* reverb = new ladspa_plugin("/usr/lib64/ladspa/plate_1423.so", "plate");
+	plugin* reverb;
+	unsigned int reverb_in;
+	unsigned int reverb_out;
 
-	reverb->_ports[0][0] = 6.00;	/* Reverb time */
-	reverb->_ports[1][0] = 0.07;	/* Damping */
-	reverb->_ports[2][0] = 0.50;	/* Dry/wet */
+	if (ir_file) {
+		reverb = new convolver_plugin(ir_file);
+
+		reverb->_ports[3][0] = 0.70;	/* Dry */
+		reverb->_ports[4][0] = 0.30;	/* Wet */
+
+		reverb_in = 0;
+		reverb_out = 1;
+	} else {
+		reverb = make_ladspa("/usr/lib64/ladspa/plate_1423.so", "plate");
+
+		reverb->_ports[0][0] = 6.00;	/* Reverb time */
+		reverb->_ports[1][0] = 0.07;	/* Damping */
+		reverb->_ports[2][0] = 0.50;	/* Dry/wet */
+
+		reverb_in = 3;
+		reverb_out = 4;
+	}
 
 	plugin* mixer = new mixer_plugin(nr_voices);
 
+	g->add(seq);
+
 	for (unsigned int i = 0; i < nr_voices; ++i)
 		g->add(organs[i]);
 
@@ -125,27 +580,81 @@ main(int argc, char* argv[])
 	for (unsigned int i = 0; i < nr_voices; ++i)
 		g->connect(organs[i], 0, mixer, 1 + i);
 
-	g->connect(mixer, 0, reverb, 3);
-	g->connect(reverb, 4, output, 0);
-	g->connect(reverb, 5, output, 1);
+	g->connect(mixer, 0, reverb, reverb_in);
+	g->connect(reverb, reverb_out, output, 0);
+	g->connect(reverb, reverb_out + 1, output, 1);
+
+	/* Watch what goes to the output */
+	meter_plugin* meter = 0;
+	if (metering) {
+		meter = new meter_plugin(2);
+
+		g->add(meter);
+		g->connect(reverb, reverb_out, meter, 0);
+		g->connect(reverb, reverb_out + 1, meter, 1);
+	}
+
+	g->print_buffer_stats();
+	printf("latency: %u frames\n", g->latency());
 
 	printf("running...\n");
 
 	g->activate();
 
 	running = true;
-#ifdef FILE_OUTPUT
-	for (unsigned int i = 0; running && i < 378; ++i)
-#else
-	while (running)
+
+	pthread_t monitor;
+	if (meter && pthread_create(&monitor, NULL, &monitor_thread, meter))
+		exit(EXIT_FAILURE);
+
+	if (output_file) {
+		offline_renderer renderer(g, output);
+
+		renderer.run(&running);
+		renderer.print_stats();
+	} else {
+		while (running)
+			g->run(buffer_size);
+	}
+
+	if (meter) {
+		__atomic_store_n(&running, false, __ATOMIC_RELAXED);
+		pthread_join(monitor, NULL);
+	}
+
+	if (check_denormals)
+		g->print_denormal_stats();
+
+#ifdef NODE_PROFILING
+	if (profiler) {
+		/* A late SIGUSR1 would otherwise kill us */
+		signal(SIGUSR1, SIG_IGN);
+		g->set_profiler(0);
+
+		if (stats_file)
+			profiler->dump(stats_file);
+		else
+			profiler->dump(stdout);
+
+		delete profiler;
+	}
 #endif
-		g->run(buffer_size);
 
 	g->deactivate();
 
-	g->disconnect(mixer, 0, reverb, 3);
-	g->disconnect(reverb, 4, output, 0);
-	g->disconnect(reverb, 5, output, 1);
+	g->set_executor(0);
+	delete executor;
+
+	if (meter) {
+		g->disconnect(reverb, reverb_out, meter, 0);
+		g->disconnect(reverb, reverb_out + 1, meter, 1);
+		g->remove(meter);
+		delete meter;
+	}
+
+	g->disconnect(mixer, 0, reverb, reverb_in);
+	g->disconnect(reverb, reverb_out, output, 0);
+	g->disconnect(reverb, reverb_out + 1, output, 1);
 
 	for (unsigned int i = 0; i < nr_voices; ++i)
 		g->disconnect(organs[i], 0, mixer, 1 + i);
@@ -157,14 +666,20 @@ main(int argc, char* argv[])
 	for (unsigned int i = 0; i < nr_voices; ++i)
 		g->remove(organs[i]);
 
+	g->remove(seq);
+
 	delete seq;
 	delete reverb;
 
 	for (unsigned int i = 0; i < nr_voices; ++i)
 		delete organs[i];
 
+	delete cache;
 	delete output;
 	delete g;
 
+	delete plugin_index;
+	delete[] silence_buffer;
+
 	return EXIT_SUCCESS;
 }
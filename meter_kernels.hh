@@ -0,0 +1,259 @@
+#ifndef METER_KERNELS_HH
+#define METER_KERNELS_HH
+
+extern "C" {
+#include <math.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define METER_KERNELS_X86 1
+#endif
+
+#ifdef METER_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/* Level measurements for meter_plugin.
+ *
+ * The sums of squares are kept in eight partial sums, sample i going to
+ * sum i % 8, which are added up in a fixed order at the end; the
+ * interpolators add up their taps one at a time, multiply then add. So
+ * like the conversion kernels, every version of a kernel gives the
+ * same result to the bit. */
+
+/* The largest |in[i]|, and the sum of in[i]^2 */
+typedef void (*meter_levels_kernel)(const float* in, unsigned int n,
+	float* peak, float* sum);
+
+/* The largest |y| of a polyphase interpolator's outputs for n input
+ * samples, phase p being
+ *
+ *   y[i] = sum over k of taps[p * nr_taps + k] * in[i - k]
+ *
+ * so in[-(nr_taps - 1)] to in[-1] must be there too. */
+typedef float (*meter_true_peak_kernel)(const float* in, unsigned int n,
+	const float* taps, unsigned int nr_taps, unsigned int phases);
+
+/* Carries on from sample "start", with partial sums that a vector
+ * version has got so far */
+static void
+meter_levels_tail(const float* in, unsigned int start, unsigned int n,
+	float* peak, float sums[8])
+{
+	float p = *peak;
+
+	for (unsigned int i = start; i < n; ++i) {
+		float x = fabsf(in[i]);
+		p = x > p ? x : p;
+		sums[i % 8] = sums[i % 8] + in[i] * in[i];
+	}
+
+	*peak = p;
+}
+
+static inline float
+meter_reduce(const float sums[8])
+{
+	return ((sums[0] + sums[4]) + (sums[1] + sums[5]))
+		+ ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+}
+
+static void
+meter_levels_scalar(const float* in, unsigned int n, float* peak,
+	float* sum)
+{
+	float sums[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	*peak = 0;
+	meter_levels_tail(in, 0, n, peak, sums);
+	*sum = meter_reduce(sums);
+}
+
+static float
+meter_true_peak_tail(const float* in, unsigned int start, unsigned int n,
+	const float* taps, unsigned int nr_taps, unsigned int phases,
+	float peak)
+{
+	for (unsigned int p = 0; p < phases; ++p) {
+		const float* h = taps + p * nr_taps;
+
+		for (unsigned int i = start; i < n; ++i) {
+			const float* x = in + i;
+
+			float y = 0;
+			for (unsigned int k = 0; k < nr_taps; ++k)
+				y = y + h[k] * *(x - k);
+
+			y = fabsf(y);
+			peak = y > peak ? y : peak;
+		}
+	}
+
+	return peak;
+}
+
+static float
+meter_true_peak_scalar(const float* in, unsigned int n, const float* taps,
+	unsigned int nr_taps, unsigned int phases)
+{
+	return meter_true_peak_tail(in, 0, n, taps, nr_taps, phases, 0);
+}
+
+#ifdef METER_KERNELS_X86
+__attribute__((target("sse2"))) static inline __m128
+meter_abs_sse2(__m128 x)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.f), x);
+}
+
+__attribute__((target("sse2"))) static inline float
+meter_max_sse2(__m128 x)
+{
+	float v[4];
+	_mm_storeu_ps(v, x);
+
+	float a = v[0] > v[1] ? v[0] : v[1];
+	float b = v[2] > v[3] ? v[2] : v[3];
+	return a > b ? a : b;
+}
+
+__attribute__((target("sse2"))) static void
+meter_levels_sse2(const float* in, unsigned int n, float* peak, float* sum)
+{
+	__m128 p = _mm_setzero_ps();
+	__m128 s0 = _mm_setzero_ps();
+	__m128 s1 = _mm_setzero_ps();
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_loadu_ps(in + i);
+		__m128 b = _mm_loadu_ps(in + i + 4);
+
+		p = _mm_max_ps(p, _mm_max_ps(meter_abs_sse2(a),
+			meter_abs_sse2(b)));
+		s0 = _mm_add_ps(s0, _mm_mul_ps(a, a));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(b, b));
+	}
+
+	float sums[8];
+	_mm_storeu_ps(sums, s0);
+	_mm_storeu_ps(sums + 4, s1);
+
+	*peak = meter_max_sse2(p);
+	meter_levels_tail(in, i, n, peak, sums);
+	*sum = meter_reduce(sums);
+}
+
+__attribute__((target("sse2"))) static float
+meter_true_peak_sse2(const float* in, unsigned int n, const float* taps,
+	unsigned int nr_taps, unsigned int phases)
+{
+	__m128 peak = _mm_setzero_ps();
+
+	unsigned int m = n & ~3U;
+	for (unsigned int p = 0; p < phases; ++p) {
+		const float* h = taps + p * nr_taps;
+
+		for (unsigned int i = 0; i < m; i += 4) {
+			__m128 y = _mm_setzero_ps();
+			for (unsigned int k = 0; k < nr_taps; ++k) {
+				y = _mm_add_ps(y, _mm_mul_ps(_mm_set1_ps(h[k]),
+					_mm_loadu_ps(in + i - k)));
+			}
+
+			peak = _mm_max_ps(peak, meter_abs_sse2(y));
+		}
+	}
+
+	return meter_true_peak_tail(in, m, n, taps, nr_taps, phases,
+		meter_max_sse2(peak));
+}
+
+__attribute__((target("avx2"))) static inline __m256
+meter_abs_avx2(__m256 x)
+{
+	return _mm256_andnot_ps(_mm256_set1_ps(-0.f), x);
+}
+
+__attribute__((target("avx2"))) static inline float
+meter_max_avx2(__m256 x)
+{
+	__m128 m = _mm_max_ps(_mm256_castps256_ps128(x),
+		_mm256_extractf128_ps(x, 1));
+	return meter_max_sse2(m);
+}
+
+__attribute__((target("avx2"))) static void
+meter_levels_avx2(const float* in, unsigned int n, float* peak, float* sum)
+{
+	__m256 p = _mm256_setzero_ps();
+	__m256 s = _mm256_setzero_ps();
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 a = _mm256_loadu_ps(in + i);
+
+		p = _mm256_max_ps(p, meter_abs_avx2(a));
+		s = _mm256_add_ps(s, _mm256_mul_ps(a, a));
+	}
+
+	float sums[8];
+	_mm256_storeu_ps(sums, s);
+
+	*peak = meter_max_avx2(p);
+	meter_levels_tail(in, i, n, peak, sums);
+	*sum = meter_reduce(sums);
+}
+
+__attribute__((target("avx2"))) static float
+meter_true_peak_avx2(const float* in, unsigned int n, const float* taps,
+	unsigned int nr_taps, unsigned int phases)
+{
+	__m256 peak = _mm256_setzero_ps();
+
+	unsigned int m = n & ~7U;
+	for (unsigned int p = 0; p < phases; ++p) {
+		const float* h = taps + p * nr_taps;
+
+		for (unsigned int i = 0; i < m; i += 8) {
+			__m256 y = _mm256_setzero_ps();
+			for (unsigned int k = 0; k < nr_taps; ++k) {
+				y = _mm256_add_ps(y, _mm256_mul_ps(
+					_mm256_set1_ps(h[k]),
+					_mm256_loadu_ps(in + i - k)));
+			}
+
+			peak = _mm256_max_ps(peak, meter_abs_avx2(y));
+		}
+	}
+
+	return meter_true_peak_tail(in, m, n, taps, nr_taps, phases,
+		meter_max_avx2(peak));
+}
+#endif
+
+static meter_levels_kernel meter_levels = &meter_levels_scalar;
+static meter_true_peak_kernel meter_true_peak = &meter_true_peak_scalar;
+static const char* meter_kernel_name = "scalar";
+
+/* Pick the kernels for the CPU we're running on; safe to call more than
+ * once, but not while somebody may be using them */
+static void
+init_meter_kernels()
+{
+#ifdef METER_KERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		meter_levels = &meter_levels_avx2;
+		meter_true_peak = &meter_true_peak_avx2;
+		meter_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		meter_levels = &meter_levels_sse2;
+		meter_true_peak = &meter_true_peak_sse2;
+		meter_kernel_name = "sse2";
+	}
+#endif
+}
+
+#endif
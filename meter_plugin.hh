@@ -0,0 +1,292 @@
+#ifndef METER_PLUGIN_HH
+#define METER_PLUGIN_HH
+
+extern "C" {
+#include <assert.h>
+#include <math.h>
+#include <sched.h>
+#include <string.h>
+}
+
+#include "meter_kernels.hh"
+#include "plugin.hh"
+
+/* A sink that measures whatever is connected to its inputs, one port per
+ * channel: the peak, RMS and true peak (the peak of the signal
+ * oversampled four times, which catches the overs that fall between
+ * samples) of every block, and the number of samples at or beyond full
+ * scale, which an integer output has to clip.
+ *
+ * The audio thread is the only writer. At the end of each block it
+ * publishes a reading under a sequence counter, and read() copies it
+ * out, trying again if it raced with an update, so any number of other
+ * threads can poll the meter without ever holding up the audio thread.
+ * A reader that polls less often than once a block gets the running
+ * maxima and the energy so far along with the last block, so it can
+ * work out the levels over everything since its previous read. */
+class meter_plugin:
+	public plugin
+{
+public:
+	static const unsigned int max_channels = 8;
+
+	struct channel_levels {
+		/* Of the last block, as amplitudes; 1.0 is full scale */
+		float peak;
+		float rms;
+		float true_peak;
+
+		/* Since the meter was activated */
+		float max_peak;
+		float max_true_peak;
+		unsigned long clips;
+
+		/* The sum of squares */
+		double energy;
+	};
+
+	struct reading {
+		unsigned long blocks;
+		unsigned long frames;
+		channel_levels channels[max_channels];
+	};
+
+public:
+	meter_plugin(unsigned int channels);
+	~meter_plugin();
+
+public:
+	void activate();
+
+	bool is_audio_input(unsigned int port);
+
+	void run(unsigned int sample_count);
+
+	void read(reading* r);
+
+public:
+	unsigned int _nr_channels;
+
+private:
+	void measure(unsigned int channel, unsigned int sample_count);
+	void publish();
+
+private:
+	/* 4x oversampling, with 12 taps per phase */
+	static const unsigned int _phases = 4;
+	static const unsigned int _nr_taps = 12;
+
+	float _taps[_phases * _nr_taps];
+
+	/* The last _nr_taps - 1 samples of the previous block for each
+	 * channel, followed by this one */
+	float* _history;
+
+	reading _current;
+
+	/* Odd while _published is being updated */
+	unsigned int _sequence;
+	reading _published;
+};
+
+meter_plugin::meter_plugin(unsigned int channels):
+	_nr_channels(channels),
+	_sequence(0)
+{
+	assert(channels > 0 && channels <= max_channels);
+
+	_nr_ports = channels;
+	_ports = new float*[channels];
+	for (unsigned int i = 0; i < channels; ++i)
+		_ports[i] = silence_buffer;
+
+	/* Blackman-windowed sinc with its cutoff a little below the input
+	 * Nyquist frequency. Tap j of the prototype goes to phase j % 4,
+	 * and each phase is scaled to unity gain at DC. */
+	unsigned int length = _phases * _nr_taps;
+	for (unsigned int p = 0; p < _phases; ++p) {
+		float* h = &_taps[p * _nr_taps];
+		double sum = 0;
+
+		for (unsigned int k = 0; k < _nr_taps; ++k) {
+			unsigned int j = k * _phases + p;
+			double x = (j - (length - 1) / 2.) / _phases;
+			double w = 2 * M_PI * (j + 0.5) / length;
+
+			double sinc = x == 0 ? 1 : sin(0.9 * M_PI * x)
+				/ (0.9 * M_PI * x);
+			double window = 0.42 - 0.5 * cos(w) + 0.08 * cos(2 * w);
+
+			h[k] = sinc * window;
+			sum += h[k];
+		}
+
+		for (unsigned int k = 0; k < _nr_taps; ++k)
+			h[k] /= sum;
+	}
+
+	_history = new float[channels * (_nr_taps - 1 + buffer_size)]();
+
+	memset(&_current, 0, sizeof(_current));
+	memset(&_published, 0, sizeof(_published));
+}
+
+meter_plugin::~meter_plugin()
+{
+	delete[] _history;
+	delete[] _ports;
+}
+
+void
+meter_plugin::activate()
+{
+	memset(_history, 0, _nr_channels * (_nr_taps - 1 + buffer_size)
+		* sizeof(float));
+
+	memset(&_current, 0, sizeof(_current));
+	publish();
+}
+
+bool
+meter_plugin::is_audio_input(unsigned int port)
+{
+	return port < _nr_channels;
+}
+
+void
+meter_plugin::measure(unsigned int channel, unsigned int sample_count)
+{
+	channel_levels& c = _current.channels[channel];
+	float* history = _history + channel * (_nr_taps - 1 + buffer_size);
+	const float* in = _ports[channel];
+
+	if (*_silent[channel]) {
+		c.peak = 0;
+		c.rms = 0;
+		c.true_peak = 0;
+
+		memset(history, 0, (_nr_taps - 1) * sizeof(float));
+		return;
+	}
+
+	float peak;
+	float sum;
+	meter_levels(in, sample_count, &peak, &sum);
+
+	memcpy(history + _nr_taps - 1, in, sample_count * sizeof(float));
+	float true_peak = meter_true_peak(history + _nr_taps - 1,
+		sample_count, _taps, _nr_taps, _phases);
+	memmove(history, history + sample_count,
+		(_nr_taps - 1) * sizeof(float));
+
+	/* The same threshold as float_to_s16(), in the rare case it
+	 * matters */
+	if (peak * 32768.f > 32767.f) {
+		for (unsigned int i = 0; i < sample_count; ++i) {
+			if (fabsf(in[i]) * 32768.f > 32767.f)
+				++c.clips;
+		}
+	}
+
+	c.peak = peak;
+	c.rms = sqrtf(sum / sample_count);
+
+	/* The interpolated signal can come out a little below the samples
+	 * it goes through */
+	c.true_peak = true_peak > peak ? true_peak : peak;
+
+	if (c.peak > c.max_peak)
+		c.max_peak = c.peak;
+	if (c.true_peak > c.max_true_peak)
+		c.max_true_peak = c.true_peak;
+
+	c.energy += sum;
+}
+
+void
+meter_plugin::run(unsigned int sample_count)
+{
+	for (unsigned int i = 0; i < _nr_channels; ++i)
+		measure(i, sample_count);
+
+	++_current.blocks;
+	_current.frames += sample_count;
+
+	publish();
+}
+
+static void
+store_levels(meter_plugin::channel_levels* to,
+	meter_plugin::channel_levels* from)
+{
+	__atomic_store(&to->peak, &from->peak, __ATOMIC_RELAXED);
+	__atomic_store(&to->rms, &from->rms, __ATOMIC_RELAXED);
+	__atomic_store(&to->true_peak, &from->true_peak, __ATOMIC_RELAXED);
+	__atomic_store(&to->max_peak, &from->max_peak, __ATOMIC_RELAXED);
+	__atomic_store(&to->max_true_peak, &from->max_true_peak,
+		__ATOMIC_RELAXED);
+	__atomic_store(&to->clips, &from->clips, __ATOMIC_RELAXED);
+	__atomic_store(&to->energy, &from->energy, __ATOMIC_RELAXED);
+}
+
+static void
+load_levels(meter_plugin::channel_levels* to,
+	meter_plugin::channel_levels* from)
+{
+	__atomic_load(&from->peak, &to->peak, __ATOMIC_RELAXED);
+	__atomic_load(&from->rms, &to->rms, __ATOMIC_RELAXED);
+	__atomic_load(&from->true_peak, &to->true_peak, __ATOMIC_RELAXED);
+	__atomic_load(&from->max_peak, &to->max_peak, __ATOMIC_RELAXED);
+	__atomic_load(&from->max_true_peak, &to->max_true_peak,
+		__ATOMIC_RELAXED);
+	__atomic_load(&from->clips, &to->clips, __ATOMIC_RELAXED);
+	__atomic_load(&from->energy, &to->energy, __ATOMIC_RELAXED);
+}
+
+/* Only ever called from the thread that runs the graph */
+void
+meter_plugin::publish()
+{
+	unsigned int seq = _sequence;
+
+	__atomic_store_n(&_sequence, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&_published.blocks, _current.blocks,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&_published.frames, _current.frames,
+		__ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < _nr_channels; ++i)
+		store_levels(&_published.channels[i], &_current.channels[i]);
+
+	__atomic_store_n(&_sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Safe from any thread; waits for nothing but an update that is in
+ * progress */
+void
+meter_plugin::read(reading* r)
+{
+	memset(r, 0, sizeof(*r));
+
+	while (true) {
+		unsigned int seq = __atomic_load_n(&_sequence, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		r->blocks = __atomic_load_n(&_published.blocks,
+			__ATOMIC_RELAXED);
+		r->frames = __atomic_load_n(&_published.frames,
+			__ATOMIC_RELAXED);
+		for (unsigned int i = 0; i < _nr_channels; ++i)
+			load_levels(&r->channels[i], &_published.channels[i]);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&_sequence, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+}
+
+#endif
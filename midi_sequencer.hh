@@ -12,9 +12,13 @@ extern "C" {
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 }
 
+#include "event.hh"
+#include "sequencer.hh"
+
 class midi_event {
 public:
 	midi_event(unsigned int track, unsigned long timestamp,
@@ -29,6 +33,9 @@ public:
 	uint8_t _channel;
 	uint8_t _note;
 	uint8_t _velocity;
+
+	/* For a note on: ticks until its note off, or 0 if it has none */
+	unsigned long _length;
 };
 
 midi_event::midi_event(unsigned int track, unsigned long timestamp,
@@ -39,7 +46,8 @@ midi_event::midi_event(unsigned int track, unsigned long timestamp,
 	_command(command),
 	_channel(channel),
 	_note(note),
-	_velocity(velocity)
+	_velocity(velocity),
+	_length(0)
 {
 }
 
@@ -50,38 +58,53 @@ midi_event::~midi_event()
 class midi_voice
 {
 public:
-	typedef std::vector<midi_event*> event_vector;
+	typedef std::vector<midi_event*> midi_event_vector;
 
 public:
-	midi_voice();
+	explicit midi_voice(bool note_events = false);
 	~midi_voice();
 
 public:
 	void connect_gate(float* input_port);
 	void connect_frequency(float* input_port);
 
-	unsigned int duration_remaining();
-	void advance(unsigned int duration);
+	void run(unsigned int voice, unsigned int sample_count);
+	bool done();
+
+private:
+	void queue(unsigned int voice, unsigned int offset, midi_event* e);
 
 public:
-	event_vector _events;
+	midi_event_vector _events;
 	unsigned int _event_i;
+
+	/* Samples until _events[_event_i] is due */
 	unsigned int _duration;
 
 	float* _gate;
 	float* _frequency;
+
+	/* Queue EVENT_NOTE_ON/OFF rather than gate/frequency changes */
+	bool _note_events;
+
+	/* What run() found for the current block */
+	event_vector _queue;
 };
 
-midi_voice::midi_voice():
+midi_voice::midi_voice(bool note_events):
 	_event_i(0),
-	_duration(0)
+	_duration(0),
+	_gate(0),
+	_frequency(0),
+	_note_events(note_events)
 {
+	_queue.reserve(event_queue_reserve);
 }
 
 midi_voice::~midi_voice()
 {
-	for (event_vector::iterator i = _events.begin(), end = _events.end();
-		i != end; ++i)
+	for (midi_event_vector::iterator i = _events.begin(),
+		end = _events.end(); i != end; ++i)
 	{
 		midi_event* e = *i;
 		delete e;
@@ -100,52 +123,94 @@ midi_voice::connect_frequency(float* input_port)
 	_frequency = input_port;
 }
 
-unsigned int
-midi_voice::duration_remaining()
+/* Samples per MIDI tick at 44.1 kHz */
+#define TIMESTAMP_SCALE 100
+
+static unsigned long
+ticks_to_samples(unsigned long ticks)
 {
-	return _duration;
+	return (unsigned long long) ticks * TIMESTAMP_SCALE
+		* sample_rate / 44100;
 }
 
-#define TIMESTAMP_SCALE 100
-
 void
-midi_voice::advance(unsigned int duration)
+midi_voice::queue(unsigned int voice, unsigned int offset, midi_event* e)
 {
-	if (_event_i == _events.size())
-		return;
+	event ev;
+	ev.offset = offset;
+	ev.voice = voice;
+	ev.channel = e->_channel;
+	ev.note = e->_note;
+	ev.velocity = e->_velocity;
+	ev.duration = 0;
+	ev.port = 0;
+
+	if (_note_events) {
+		bool on = e->_command == 0x90 && e->_velocity != 0;
+
+		ev.type = on ? EVENT_NOTE_ON : EVENT_NOTE_OFF;
+		ev.value = 440. * pow(2, (e->_note - 69.) / 12.);
+
+		if (on && e->_length) {
+			ev.duration = ticks_to_samples(e->_timestamp + e->_length)
+				- ticks_to_samples(e->_timestamp);
+		}
 
-	assert(duration <= _duration);
-	//assert(duration > 0);
+		_queue.push_back(ev);
+		return;
+	}
 
-	_duration -= duration;
-	while (_duration == 0) {
-		midi_event* e = _events[_event_i];
-		switch (e->_command) {
-		case 0x80:
-			*_gate = 0;
-			break;
-		case 0x90:
-			if (e->_velocity == 0) {
-				*_gate = 0;
-			} else {
-				*_gate = 1;
-				*_frequency = 440.
-					* pow(2, (e->_note - 69.) / 12.);
-			}
+	switch (e->_command) {
+	case 0x90:
+		if (e->_velocity != 0) {
+			ev.type = EVENT_FREQUENCY;
+			ev.value = 440. * pow(2, (e->_note - 69.) / 12.);
+			ev.port = _frequency;
+			_queue.push_back(ev);
+
+			ev.type = EVENT_GATE;
+			ev.value = 1;
+			ev.port = _gate;
+			_queue.push_back(ev);
 			break;
 		}
 
-		if (_event_i == _events.size() - 1) {
-			_duration = buffer_size;
-			break;
-		}
+		/* Note on with velocity 0 is a note off */
+	case 0x80:
+		ev.type = EVENT_GATE;
+		ev.value = 0;
+		ev.port = _gate;
+		_queue.push_back(ev);
+		break;
+	}
+}
+
+bool
+midi_voice::done()
+{
+	return _event_i == _events.size();
+}
+
+void
+midi_voice::run(unsigned int voice, unsigned int sample_count)
+{
+	_queue.clear();
 
-		_duration = TIMESTAMP_SCALE * (_events[_event_i + 1]->_timestamp
-			- _events[_event_i]->_timestamp);
+	unsigned int offset = 0;
+	while (_event_i < _events.size() && offset + _duration < sample_count) {
+		offset += _duration;
+		queue(voice, offset, _events[_event_i]);
 
+		if (_event_i + 1 < _events.size()) {
+			_duration = ticks_to_samples(_events[_event_i + 1]->_timestamp)
+				- ticks_to_samples(_events[_event_i]->_timestamp);
+		}
 
 		++_event_i;
 	}
+
+	if (_event_i < _events.size())
+		_duration -= sample_count - offset;
 }
 
 class midi_sequencer:
@@ -163,11 +228,15 @@ public:
 	void connect_gate(unsigned int output_port, float* input_port);
 	void connect_frequency(unsigned int output_port, float* input_port);
 
-	unsigned int duration_remaining(unsigned int voice);
-	void advance(unsigned int voice, unsigned int duration);
+	void run(unsigned int sample_count);
+	const event_vector& events(unsigned int voice);
+	bool done();
 
 public:
 	voice_vector _voices;
+
+	/* Every note on/off, for sequencer::all_notes */
+	midi_voice* _all_notes;
 };
 
 static uint8_t
@@ -222,7 +291,8 @@ peek_lei(const uint8_t* m)
 }
 
 /* XXX: This is _not_ safe against corrupt MIDI files. */
-midi_sequencer::midi_sequencer(const char* filename)
+midi_sequencer::midi_sequencer(const char* filename):
+	_all_notes(new midi_voice(true))
 {
 	int fd = open(filename, O_RDONLY);
 	if (fd == -1)
@@ -382,6 +452,10 @@ midi_sequencer::midi_sequencer(const char* filename)
 printf("NOTEOFF %d %d %d\n", smallest_track, channel, note);
 #endif
 
+				_all_notes->_events.push_back(new midi_event(
+					smallest_track, t->timestamp, command & 0xf0,
+					channel, note, velocity));
+
 				if (!voices_is_playing[channel][note]) {
 					printf("warning: note wasn't already playing\n");
 				} else {
@@ -403,6 +477,10 @@ printf("NOTEOFF %d %d %d\n", smallest_track, channel, note);
 				uint8_t note = read_u8(t->bytes);
 				uint8_t velocity = read_u8(t->bytes);
 
+				_all_notes->_events.push_back(new midi_event(
+					smallest_track, t->timestamp, command & 0xf0,
+					channel, note, velocity));
+
 				if (velocity == 0) {
 #if 0
 printf("NOTEOFF %d %d %d\n", smallest_track, channel, note);
@@ -487,7 +565,32 @@ printf("NOTEON %d %d %d\n", smallest_track, channel, note);
 	{
 		midi_voice* v = *i;
 
-		v->_duration = TIMESTAMP_SCALE * v->_events[0]->_timestamp;
+		v->_duration = ticks_to_samples(v->_events[0]->_timestamp);
+	}
+
+	if (!_all_notes->_events.empty()) {
+		_all_notes->_duration = ticks_to_samples(
+			_all_notes->_events[0]->_timestamp);
+	}
+
+	/* Pair up the note ons and offs, so that each note on knows how
+	 * long it is */
+	int note_on[16][128];
+	memset(note_on, -1, sizeof(note_on));
+
+	for (unsigned int i = 0; i < _all_notes->_events.size(); ++i) {
+		midi_event* e = _all_notes->_events[i];
+		int* on = &note_on[e->_channel][e->_note];
+
+		if (e->_command == 0x90 && e->_velocity != 0) {
+			if (*on == -1)
+				*on = i;
+		} else if (*on != -1) {
+			midi_event* start = _all_notes->_events[*on];
+
+			start->_length = e->_timestamp - start->_timestamp;
+			*on = -1;
+		}
 	}
 
 	delete[] tracks;
@@ -504,6 +607,8 @@ midi_sequencer::~midi_sequencer()
 		midi_voice* v = *i;
 		delete v;
 	}
+
+	delete _all_notes;
 }
 
 void
@@ -522,20 +627,35 @@ midi_sequencer::connect_frequency(unsigned int output_port, float* input_port)
 	_voices[output_port]->connect_frequency(input_port);
 }
 
-unsigned int
-midi_sequencer::duration_remaining(unsigned int voice)
+void
+midi_sequencer::run(unsigned int sample_count)
 {
-	assert(voice < _voices.size());
+	for (unsigned int i = 0, n = _voices.size(); i < n; ++i)
+		_voices[i]->run(i, sample_count);
 
-	return _voices[voice]->duration_remaining();
+	_all_notes->run(all_notes, sample_count);
 }
 
-void
-midi_sequencer::advance(unsigned int voice, unsigned int duration)
+const event_vector&
+midi_sequencer::events(unsigned int voice)
 {
+	if (voice == all_notes)
+		return _all_notes->_queue;
+
 	assert(voice < _voices.size());
 
-	_voices[voice]->advance(duration);
+	return _voices[voice]->_queue;
+}
+
+bool
+midi_sequencer::done()
+{
+	for (unsigned int i = 0, n = _voices.size(); i < n; ++i) {
+		if (!_voices[i]->done())
+			return false;
+	}
+
+	return _all_notes->done();
 }
 
 #endif
@@ -0,0 +1,159 @@
+#ifndef MIX_KERNELS_HH
+#define MIX_KERNELS_HH
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MIX_KERNELS_X86 1
+#endif
+
+#ifdef MIX_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/* out[i] = gain * in[i] and out[i] += gain * in[i], in the widest
+ * vectors the CPU has. All versions do a separate multiply and add (no
+ * FMA), so the result doesn't depend on which one gets picked. Buffers
+ * need no particular alignment. */
+typedef void (*mix_kernel)(float* out, const float* in, float gain,
+	unsigned int n);
+
+static void
+mix_copy_scalar(float* out, const float* in, float gain, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; ++i)
+		out[i] = gain * in[i];
+}
+
+static void
+mix_add_scalar(float* out, const float* in, float gain, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; ++i)
+		out[i] += gain * in[i];
+}
+
+#ifdef MIX_KERNELS_X86
+__attribute__((target("sse2"))) static void
+mix_copy_sse2(float* out, const float* in, float gain, unsigned int n)
+{
+	__m128 g = _mm_set1_ps(gain);
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_loadu_ps(in + i);
+		__m128 b = _mm_loadu_ps(in + i + 4);
+		_mm_storeu_ps(out + i, _mm_mul_ps(g, a));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(g, b));
+	}
+
+	mix_copy_scalar(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("sse2"))) static void
+mix_add_sse2(float* out, const float* in, float gain, unsigned int n)
+{
+	__m128 g = _mm_set1_ps(gain);
+
+	unsigned int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_mul_ps(g, _mm_loadu_ps(in + i));
+		__m128 b = _mm_mul_ps(g, _mm_loadu_ps(in + i + 4));
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), a));
+		_mm_storeu_ps(out + i + 4,
+			_mm_add_ps(_mm_loadu_ps(out + i + 4), b));
+	}
+
+	mix_add_scalar(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+mix_copy_avx2(float* out, const float* in, float gain, unsigned int n)
+{
+	__m256 g = _mm256_set1_ps(gain);
+
+	unsigned int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_loadu_ps(in + i);
+		__m256 b = _mm256_loadu_ps(in + i + 8);
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(g, a));
+		_mm256_storeu_ps(out + i + 8, _mm256_mul_ps(g, b));
+	}
+
+	mix_copy_scalar(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+mix_add_avx2(float* out, const float* in, float gain, unsigned int n)
+{
+	__m256 g = _mm256_set1_ps(gain);
+
+	unsigned int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256 a = _mm256_mul_ps(g, _mm256_loadu_ps(in + i));
+		__m256 b = _mm256_mul_ps(g, _mm256_loadu_ps(in + i + 8));
+		_mm256_storeu_ps(out + i,
+			_mm256_add_ps(_mm256_loadu_ps(out + i), a));
+		_mm256_storeu_ps(out + i + 8,
+			_mm256_add_ps(_mm256_loadu_ps(out + i + 8), b));
+	}
+
+	mix_add_scalar(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+mix_copy_avx512(float* out, const float* in, float gain, unsigned int n)
+{
+	__m512 g = _mm512_set1_ps(gain);
+
+	unsigned int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512 a = _mm512_loadu_ps(in + i);
+		_mm512_storeu_ps(out + i, _mm512_mul_ps(g, a));
+	}
+
+	mix_copy_scalar(out + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+mix_add_avx512(float* out, const float* in, float gain, unsigned int n)
+{
+	__m512 g = _mm512_set1_ps(gain);
+
+	unsigned int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m512 a = _mm512_mul_ps(g, _mm512_loadu_ps(in + i));
+		_mm512_storeu_ps(out + i,
+			_mm512_add_ps(_mm512_loadu_ps(out + i), a));
+	}
+
+	mix_add_scalar(out + i, in + i, gain, n - i);
+}
+#endif
+
+static mix_kernel mix_copy = &mix_copy_scalar;
+static mix_kernel mix_add = &mix_add_scalar;
+static const char* mix_kernel_name = "scalar";
+
+/* Pick the kernels for the CPU we're running on; safe to call more than
+ * once, but not while somebody may be using them */
+static void
+init_mix_kernels()
+{
+#ifdef MIX_KERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		mix_copy = &mix_copy_avx512;
+		mix_add = &mix_add_avx512;
+		mix_kernel_name = "avx512";
+	} else if (__builtin_cpu_supports("avx2")) {
+		mix_copy = &mix_copy_avx2;
+		mix_add = &mix_add_avx2;
+		mix_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		mix_copy = &mix_copy_sse2;
+		mix_add = &mix_add_sse2;
+		mix_kernel_name = "sse2";
+	}
+#endif
+}
+
+#endif
@@ -1,53 +1,432 @@
 #ifndef MIXER_PLUGIN_HH
 #define MIXER_PLUGIN_HH
 
+extern "C" {
+#include <math.h>
+#include <string.h>
+}
+
+#include "mix_kernels.hh"
 #include "plugin.hh"
 
+/* Mixes N inputs into M output buses through an N x M matrix of levels.
+ * Ports 0..M-1 are the outputs and M..M+N-1 the inputs, so a mixer with
+ * a single output is laid out like a plain mono sum. Each input starts
+ * at unity gain, panned to the centre.
+ *
+ * After those, ports M+N..M+2N-1 are a fader for each input, on top of
+ * its levels. Faders are meant to be moved while playing: a change is
+ * spread over the block, and an automated fader follows its ramp.
+ *
+ * A mixer with a single output is a plain sum, so the graph may have
+ * plugins that feed it add into a bus instead (port M+2N, mixed in at
+ * unity), using their input's level times its fader. For those inputs
+ * a change of level or fader takes effect a block later, in one step.
+ *
+ * Levels may be set from one other thread while the graph runs. They
+ * are published to the audio thread, which takes them up at the start
+ * of the next block, like meter_plugin publishes its readings.
+ *
+ * The block is mixed a slice at a time, one input after the other, so
+ * that the output slices stay in cache while the inputs stream past. */
 class mixer_plugin:
 	public plugin
 {
 public:
-	mixer_plugin(unsigned int inputs);
+	mixer_plugin(unsigned int inputs, unsigned int outputs = 1);
 	~mixer_plugin();
 
 public:
+	void activate();
+
+	bool is_audio_input(unsigned int port);
+	bool is_audio_output(unsigned int port);
+
+	const float* adding_gain(unsigned int port);
+	int bus_port();
+
+	bool busy();
+
+	void set_gain(unsigned int input, float gain);
+	void set_pan(unsigned int input, float pan);
+	void set_level(unsigned int input, unsigned int output, float level);
+
 	void run(unsigned int sample_count);
 
 private:
+	void begin_levels(unsigned int input);
+	void end_levels(unsigned int input);
+	void update_levels(unsigned int input);
+	bool fetch_levels(unsigned int input);
+	const float* apply_fader(unsigned int input, const float* in,
+		unsigned int start, unsigned int n, unsigned int sample_count,
+		float* scale);
+
+private:
+	/* In frames; 4 KiB per buffer */
+	static const unsigned int _slice = 1024;
+
 	unsigned int _nr_inputs;
+	unsigned int _nr_outputs;
+
+	float* _gain;
+	float* _pan;
+
+	/* _levels[input * _nr_outputs + output], as used by run() */
+	float* _levels;
+
+	/* The levels as last set, laid out like _levels; an input's row
+	 * may only be read while its sequence number is even and doesn't
+	 * change, and is taken up by run() when that number moves on */
+	float* _pending;
+	unsigned int* _sequences;
+	unsigned int* _fetched;
+	float* _row;
+
+	/* The fader ports, and where each fader was at the end of the
+	 * last block */
+	float* _faders;
+	float* _applied;
+
+	/* Level times fader, for inputs that come in through the bus */
+	float* _bus_gains;
+
+	/* An input times its fader, when that isn't a constant */
+	float* _scaled;
+
+	/* The inputs that aren't silent in the current block */
+	unsigned int* _active;
+
+	/* Which outputs have something in them in the current slice */
+	bool* _written;
 };
 
-mixer_plugin::mixer_plugin(unsigned int inputs):
-	_nr_inputs(inputs)
+mixer_plugin::mixer_plugin(unsigned int inputs, unsigned int outputs):
+	_nr_inputs(inputs),
+	_nr_outputs(outputs)
 {
-	_ports = new float*[1 + inputs];
+	assert(outputs > 0);
 
-	_ports[0] = new float[buffer_size];
+	_bypass = true;
+
+	_nr_ports = outputs + 2 * inputs + 1;
+	_ports = new float*[outputs + 2 * inputs + 1];
+
+	/* Bound by the graph */
+	for (unsigned int i = 0; i < outputs; ++i)
+		_ports[i] = 0;
 	for (unsigned int i = 0; i < inputs; ++i)
-		_ports[1 + i] = silence_buffer;
+		_ports[outputs + i] = silence_buffer;
+	_ports[outputs + 2 * inputs] = silence_buffer;
+
+	_gain = new float[inputs];
+	_pan = new float[inputs];
+	_levels = new float[inputs * outputs];
+	_pending = new float[inputs * outputs];
+	_sequences = new unsigned int[inputs];
+	_fetched = new unsigned int[inputs];
+	_row = new float[outputs];
+	_faders = new float[inputs];
+	_applied = new float[inputs];
+	_bus_gains = new float[inputs];
+	_scaled = new float[_slice];
+	_active = new unsigned int[inputs];
+	_written = new bool[outputs];
+
+	for (unsigned int i = 0; i < inputs; ++i) {
+		_faders[i] = 1;
+		_applied[i] = 1;
+		_ports[outputs + inputs + i] = &_faders[i];
+
+		_gain[i] = 1;
+		_pan[i] = 0;
+		_sequences[i] = 0;
+		_fetched[i] = 0;
+		update_levels(i);
+
+		fetch_levels(i);
+		_bus_gains[i] = _levels[i * outputs];
+	}
 }
 
 mixer_plugin::~mixer_plugin()
 {
-	delete[] _ports[0];
-	for (unsigned int i = 0; i < _nr_inputs; ++i)
-		delete[] _ports[1 + i];
-
+	delete[] _written;
+	delete[] _active;
+	delete[] _scaled;
+	delete[] _bus_gains;
+	delete[] _applied;
+	delete[] _faders;
+	delete[] _row;
+	delete[] _fetched;
+	delete[] _sequences;
+	delete[] _pending;
+	delete[] _levels;
+	delete[] _pan;
+	delete[] _gain;
 	delete[] _ports;
 }
 
+/* Not running yet, so the levels set so far can be taken up here, and
+ * the inputs that add into the bus start out with them */
+void
+mixer_plugin::activate()
+{
+	for (unsigned int j = 0; j < _nr_inputs; ++j) {
+		fetch_levels(j);
+		_bus_gains[j] = _levels[j * _nr_outputs] * _applied[j];
+	}
+}
+
+bool
+mixer_plugin::is_audio_input(unsigned int port)
+{
+	return (port >= _nr_outputs && port < _nr_outputs + _nr_inputs)
+		|| port == _nr_outputs + 2 * _nr_inputs;
+}
+
+bool
+mixer_plugin::is_audio_output(unsigned int port)
+{
+	return port < _nr_outputs;
+}
+
+const float*
+mixer_plugin::adding_gain(unsigned int port)
+{
+	if (_nr_outputs != 1)
+		return 0;
+	if (port < _nr_outputs || port >= _nr_outputs + _nr_inputs)
+		return 0;
+
+	return &_bus_gains[port - _nr_outputs];
+}
+
+int
+mixer_plugin::bus_port()
+{
+	return _nr_outputs == 1 ? (int) (_nr_outputs + 2 * _nr_inputs) : -1;
+}
+
+/* Levels set or faders moved while we were bypassed have to reach
+ * _bus_gains, which only run() updates */
+bool
+mixer_plugin::busy()
+{
+	bool changed = false;
+
+	for (unsigned int j = 0; j < _nr_inputs; ++j) {
+		if (fetch_levels(j) || _faders[j] != _applied[j])
+			changed = true;
+	}
+
+	return changed;
+}
+
+void
+mixer_plugin::set_gain(unsigned int input, float gain)
+{
+	assert(input < _nr_inputs);
+
+	_gain[input] = gain;
+	update_levels(input);
+}
+
+/* -1 is the first bus and 1 the last; anything in between is spread
+ * over the two nearest buses with an equal-power law */
+void
+mixer_plugin::set_pan(unsigned int input, float pan)
+{
+	assert(input < _nr_inputs);
+
+	if (pan < -1)
+		pan = -1;
+	if (pan > 1)
+		pan = 1;
+
+	_pan[input] = pan;
+	update_levels(input);
+}
+
+/* Overrides gain and pan until either is set again */
+void
+mixer_plugin::set_level(unsigned int input, unsigned int output, float level)
+{
+	assert(input < _nr_inputs);
+	assert(output < _nr_outputs);
+
+	begin_levels(input);
+	__atomic_store(&_pending[input * _nr_outputs + output], &level,
+		__ATOMIC_RELAXED);
+	end_levels(input);
+}
+
+/* Around every change to an input's row of _pending; only the thread
+ * that sets levels writes it, so it may read the row as it likes */
+void
+mixer_plugin::begin_levels(unsigned int input)
+{
+	__atomic_store_n(&_sequences[input], _sequences[input] + 1,
+		__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+mixer_plugin::end_levels(unsigned int input)
+{
+	__atomic_store_n(&_sequences[input], _sequences[input] + 1,
+		__ATOMIC_RELEASE);
+}
+
+void
+mixer_plugin::update_levels(unsigned int input)
+{
+	float* levels = &_pending[input * _nr_outputs];
+	float gain = _gain[input];
+	float zero = 0;
+
+	begin_levels(input);
+
+	for (unsigned int i = 0; i < _nr_outputs; ++i)
+		__atomic_store(&levels[i], &zero, __ATOMIC_RELAXED);
+
+	if (_nr_outputs == 1) {
+		__atomic_store(&levels[0], &gain, __ATOMIC_RELAXED);
+		end_levels(input);
+		return;
+	}
+
+	float x = (_pan[input] + 1) / 2 * (_nr_outputs - 1);
+	unsigned int k = x;
+	if (k >= _nr_outputs - 1)
+		k = _nr_outputs - 2;
+
+	float f = x - k;
+	float a = gain * cosf(f * M_PI / 2);
+	float b = gain * sinf(f * M_PI / 2);
+	__atomic_store(&levels[k], &a, __ATOMIC_RELAXED);
+	__atomic_store(&levels[k + 1], &b, __ATOMIC_RELAXED);
+
+	end_levels(input);
+}
+
+/* Take up an input's levels if they were set since the last block; if
+ * they are being set right now, the next block will. Returns whether
+ * they changed. */
+bool
+mixer_plugin::fetch_levels(unsigned int input)
+{
+	unsigned int seq = __atomic_load_n(&_sequences[input],
+		__ATOMIC_ACQUIRE);
+	if (seq == _fetched[input] || (seq & 1))
+		return false;
+
+	const float* pending = &_pending[input * _nr_outputs];
+	for (unsigned int i = 0; i < _nr_outputs; ++i)
+		__atomic_load(&pending[i], &_row[i], __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&_sequences[input], __ATOMIC_RELAXED) != seq)
+		return false;
+
+	memcpy(&_levels[input * _nr_outputs], _row,
+		_nr_outputs * sizeof(float));
+	_fetched[input] = seq;
+	return true;
+}
+
+/* Returns the input to mix for this slice: either "in" itself, to be
+ * mixed with its levels times *scale, or "in" times the fader */
+const float*
+mixer_plugin::apply_fader(unsigned int input, const float* in,
+	unsigned int start, unsigned int n, unsigned int sample_count,
+	float* scale)
+{
+	const float* ramp = _ramps[_nr_outputs + _nr_inputs + input];
+	float from = _applied[input];
+	float to = _faders[input];
+
+	if (ramp) {
+		for (unsigned int i = 0; i < n; ++i)
+			_scaled[i] = in[i] * ramp[start + i];
+	} else if (from != to) {
+		float step = (to - from) / sample_count;
+		float f = from + step * (start + 1);
+
+		for (unsigned int i = 0; i < n; ++i)
+			_scaled[i] = in[i] * (f + step * i);
+	} else {
+		*scale = to;
+		return in;
+	}
+
+	*scale = 1;
+	return _scaled;
+}
+
 void
 mixer_plugin::run(unsigned int sample_count)
 {
-	float* out = _ports[0];
+	for (unsigned int j = 0; j < _nr_inputs; ++j)
+		fetch_levels(j);
+
+	/* Leave out the inputs that are known to be silent */
+	unsigned int nr_active = 0;
+	for (unsigned int j = 0; j < _nr_inputs; ++j) {
+		if (!*_silent[_nr_outputs + j])
+			_active[nr_active++] = j;
+	}
+
+	const float* bus = _ports[_nr_outputs + 2 * _nr_inputs];
+	bool bus_silent = *_silent[_nr_outputs + 2 * _nr_inputs];
+
+	for (unsigned int start = 0; start < sample_count; start += _slice) {
+		unsigned int n = sample_count - start;
+		if (n > _slice)
+			n = _slice;
 
-	for (unsigned int i = 0; i < sample_count; ++i) {
-		float sum = 0;
+		for (unsigned int k = 0; k < _nr_outputs; ++k)
+			_written[k] = false;
 
-		for (unsigned int j = 0; j < _nr_inputs; ++j)
-			sum += _ports[1 + j][i];
+		/* Only ever bound for a single output */
+		if (!bus_silent) {
+			mix_copy(_ports[0] + start, bus + start, 1, n);
+			_written[0] = true;
+		}
+
+		for (unsigned int j = 0; j < nr_active; ++j) {
+			unsigned int input = _active[j];
+			const float* in = _ports[_nr_outputs + input] + start;
+			const float* levels = &_levels[input * _nr_outputs];
+
+			float scale;
+			in = apply_fader(input, in, start, n, sample_count,
+				&scale);
+
+			for (unsigned int k = 0; k < _nr_outputs; ++k) {
+				if (levels[k] == 0)
+					continue;
+
+				float* out = _ports[k] + start;
+				if (_written[k]) {
+					mix_add(out, in, scale * levels[k], n);
+				} else {
+					mix_copy(out, in, scale * levels[k], n);
+					_written[k] = true;
+				}
+			}
+		}
+
+		for (unsigned int k = 0; k < _nr_outputs; ++k) {
+			if (!_written[k])
+				memset(_ports[k] + start, 0, n * sizeof(float));
+		}
+	}
 
-		out[i] = sum;
+	for (unsigned int j = 0; j < _nr_inputs; ++j) {
+		const float* ramp = _ramps[_nr_outputs + _nr_inputs + j];
+		_applied[j] = ramp ? ramp[sample_count - 1] : _faders[j];
+		_bus_gains[j] = _levels[j * _nr_outputs] * _applied[j];
 	}
 }
 
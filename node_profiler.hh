@@ -0,0 +1,458 @@
+#ifndef NODE_PROFILER_HH
+#define NODE_PROFILER_HH
+
+/* Empty unless built with -DNODE_PROFILING */
+#ifdef NODE_PROFILING
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "plugin.hh"
+
+/* Where the time of a block goes, node by node: how long each call to
+ * plugin::process() takes, how many of them actually ran the plugin
+ * rather than skip it as silent, and how many extra pieces those runs
+ * were split into (see ladspa_plugin::run()). Without NODE_PROFILING,
+ * none of this is compiled in and the graph runs exactly as before.
+ *
+ * Every thread that runs nodes (graph::run()'s caller and the executor's
+ * workers, by worker number) has its own set of counters, which only it
+ * ever writes, so recording takes no locks or atomic read-modify-writes.
+ * The counters are stored and loaded atomically one at a time, so a dump
+ * taken while the graph runs may be a call behind here and there, but
+ * never has torn values.
+ *
+ * Times are measured in TSC ticks where there is one, and nanoseconds
+ * elsewhere. They go into histograms with eight buckets per octave, so
+ * the percentiles are within 1/8 of the actual value. */
+class node_profiler {
+public:
+	static const unsigned int nr_buckets = 256;
+
+	struct counters {
+		unsigned long calls;
+		unsigned long runs;
+		unsigned long splits;
+
+		uint64_t ticks;
+		uint64_t min;
+		uint64_t max;
+
+		unsigned int histogram[nr_buckets];
+	};
+
+public:
+	node_profiler(unsigned int nr_threads, unsigned int max_nodes = 256);
+	~node_profiler();
+
+public:
+	void add(plugin* p);
+
+	static uint64_t now();
+	void record(unsigned int thread, plugin* p, uint64_t ticks,
+		unsigned long runs, unsigned long splits);
+	void record_block(uint64_t ticks, unsigned int sample_count);
+
+	void dump(FILE* f);
+	void dump(const char* path);
+
+	void start_dumping(const char* path);
+	void request_dump();
+
+private:
+	static void update(counters* c, uint64_t ticks);
+	static void load(counters* to, counters* from);
+	static void merge(counters* to, const counters* from);
+
+	static unsigned int bucket(uint64_t ticks);
+	static uint64_t bucket_start(unsigned int b);
+
+	double percentile(const counters* c, double p);
+	void print(FILE* f, int id, const char* name, const counters* c,
+		double total);
+
+	static void* dump_thread(void* arg);
+
+private:
+	unsigned int _nr_threads;
+	unsigned int _max_nodes;
+
+	/* _max_nodes counters for each thread, and one for whole blocks */
+	counters** _counters;
+	counters _blocks;
+	unsigned long _frames;
+
+	/* Indexed by plugin::_profile_id; only add() writes them */
+	std::vector<std::string> _names;
+	unsigned int _nr_nodes;
+
+	double _ticks_per_us;
+
+	/* Posted for every dump wanted by request_dump() */
+	const char* _path;
+	pthread_t _thread;
+	sem_t _dump;
+	bool _exit;
+	bool _dumping;
+};
+
+node_profiler::node_profiler(unsigned int nr_threads,
+	unsigned int max_nodes):
+	_nr_threads(nr_threads),
+	_max_nodes(max_nodes),
+	_frames(0),
+	_names(max_nodes),
+	_nr_nodes(0),
+	_path(0),
+	_exit(false),
+	_dumping(false)
+{
+	_counters = new counters*[nr_threads];
+	for (unsigned int i = 0; i < nr_threads; ++i) {
+		_counters[i] = new counters[max_nodes];
+		memset(_counters[i], 0, max_nodes * sizeof(counters));
+	}
+
+	memset(&_blocks, 0, sizeof(_blocks));
+
+	/* Time the clock against CLOCK_MONOTONIC for 20 ms */
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t start_ticks = now();
+
+	double elapsed;
+	do {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+
+		elapsed = (t.tv_sec - start.tv_sec) * 1e6
+			+ (t.tv_nsec - start.tv_nsec) / 1e3;
+	} while (elapsed < 20000);
+
+	_ticks_per_us = (now() - start_ticks) / elapsed;
+}
+
+node_profiler::~node_profiler()
+{
+	if (_dumping) {
+		_exit = true;
+		sem_post(&_dump);
+		pthread_join(_thread, NULL);
+		sem_destroy(&_dump);
+	}
+
+	for (unsigned int i = 0; i < _nr_threads; ++i)
+		delete[] _counters[i];
+	delete[] _counters;
+}
+
+uint64_t
+node_profiler::now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+/* Called by the graph for every plugin it gets, before the plugin first
+ * runs. Plugins beyond max_nodes aren't profiled. */
+void
+node_profiler::add(plugin* p)
+{
+	if (p->_profile_id >= 0)
+		return;
+	if (_nr_nodes == _max_nodes)
+		return;
+
+	_names[_nr_nodes] = p->name();
+	p->_profile_id = _nr_nodes;
+
+	__atomic_store_n(&_nr_nodes, _nr_nodes + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int
+node_profiler::bucket(uint64_t ticks)
+{
+	if (ticks < 8)
+		return ticks;
+
+	unsigned int octave = 63 - __builtin_clzll(ticks);
+	unsigned int b = (octave - 2) * 8 + ((ticks >> (octave - 3)) & 7);
+
+	return b < nr_buckets ? b : nr_buckets - 1;
+}
+
+uint64_t
+node_profiler::bucket_start(unsigned int b)
+{
+	if (b < 8)
+		return b;
+
+	unsigned int octave = b / 8 + 2;
+	return (uint64_t) (8 + b % 8) << (octave - 3);
+}
+
+/* Only ever called by the thread that owns c */
+void
+node_profiler::update(counters* c, uint64_t ticks)
+{
+	__atomic_store_n(&c->calls, c->calls + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->ticks, c->ticks + ticks, __ATOMIC_RELAXED);
+
+	if (ticks < c->min || c->calls == 1)
+		__atomic_store_n(&c->min, ticks, __ATOMIC_RELAXED);
+	if (ticks > c->max)
+		__atomic_store_n(&c->max, ticks, __ATOMIC_RELAXED);
+
+	unsigned int* h = &c->histogram[bucket(ticks)];
+	__atomic_store_n(h, *h + 1, __ATOMIC_RELAXED);
+}
+
+void
+node_profiler::record(unsigned int thread, plugin* p, uint64_t ticks,
+	unsigned long runs, unsigned long splits)
+{
+	assert(thread < _nr_threads);
+
+	if (p->_profile_id < 0)
+		return;
+
+	counters* c = &_counters[thread][p->_profile_id];
+
+	update(c, ticks);
+	__atomic_store_n(&c->runs, c->runs + runs, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->splits, c->splits + splits, __ATOMIC_RELAXED);
+}
+
+/* From graph::run() only */
+void
+node_profiler::record_block(uint64_t ticks, unsigned int sample_count)
+{
+	update(&_blocks, ticks);
+	__atomic_store_n(&_frames, _frames + sample_count, __ATOMIC_RELAXED);
+}
+
+void
+node_profiler::load(counters* to, counters* from)
+{
+	to->calls = __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+	to->runs = __atomic_load_n(&from->runs, __ATOMIC_RELAXED);
+	to->splits = __atomic_load_n(&from->splits, __ATOMIC_RELAXED);
+	to->ticks = __atomic_load_n(&from->ticks, __ATOMIC_RELAXED);
+	to->min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+	to->max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+
+	for (unsigned int i = 0; i < nr_buckets; ++i) {
+		to->histogram[i] = __atomic_load_n(&from->histogram[i],
+			__ATOMIC_RELAXED);
+	}
+}
+
+void
+node_profiler::merge(counters* to, const counters* from)
+{
+	if (!from->calls)
+		return;
+
+	if (!to->calls || from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+
+	to->calls += from->calls;
+	to->runs += from->runs;
+	to->splits += from->splits;
+	to->ticks += from->ticks;
+
+	for (unsigned int i = 0; i < nr_buckets; ++i)
+		to->histogram[i] += from->histogram[i];
+}
+
+/* In microseconds: where the bucket that the p-th fraction of the calls
+ * falls into ends, but no more than the longest call */
+double
+node_profiler::percentile(const counters* c, double p)
+{
+	unsigned long wanted = (unsigned long) ceil(p * c->calls);
+	unsigned long seen = 0;
+
+	for (unsigned int i = 0; i < nr_buckets; ++i) {
+		seen += c->histogram[i];
+		if (seen < wanted)
+			continue;
+
+		uint64_t end = i + 1 < nr_buckets ? bucket_start(i + 1)
+			: c->max;
+		return (end < c->max ? end : c->max) / _ticks_per_us;
+	}
+
+	return c->max / _ticks_per_us;
+}
+
+void
+node_profiler::print(FILE* f, int id, const char* name, const counters* c,
+	double total)
+{
+	if (!c->calls)
+		return;
+
+	fprintf(f, "%d,%s,%lu,%lu,%lu,%.3f,%.3f,%.3f,%.3f,%.1f\n",
+		id, name, c->calls, c->runs, c->splits,
+		c->min / _ticks_per_us, c->ticks / _ticks_per_us / c->calls,
+		percentile(c, 0.99), c->max / _ticks_per_us,
+		total > 0 ? 100 * c->ticks / total : 0);
+}
+
+/* As CSV: one line for each node that has been called, with its share
+ * of the time spent in blocks, then one for whole blocks (id -1), with
+ * how much of the real time they stand for they took on average, i.e.
+ * the DSP load. Times are in microseconds. */
+void
+node_profiler::dump(FILE* f)
+{
+	unsigned int nr_nodes = __atomic_load_n(&_nr_nodes, __ATOMIC_ACQUIRE);
+
+	counters block;
+	load(&block, &_blocks);
+	unsigned long frames = __atomic_load_n(&_frames, __ATOMIC_RELAXED);
+
+	fprintf(f, "id,name,calls,runs,splits,min_us,avg_us,p99_us,max_us,"
+		"percent\n");
+
+	counters c;
+	counters total;
+	for (unsigned int i = 0; i < nr_nodes; ++i) {
+		memset(&total, 0, sizeof(total));
+		for (unsigned int j = 0; j < _nr_threads; ++j) {
+			load(&c, &_counters[j][i]);
+			merge(&total, &c);
+		}
+
+		print(f, i, _names[i].c_str(), &total, block.ticks);
+	}
+
+	if (block.calls && frames) {
+		double real_time = 1e6 * frames / sample_rate;
+
+		fprintf(f, "-1,block,%lu,%lu,0,%.3f,%.3f,%.3f,%.3f,%.1f\n",
+			block.calls, block.calls,
+			block.min / _ticks_per_us,
+			block.ticks / _ticks_per_us / block.calls,
+			percentile(&block, 0.99), block.max / _ticks_per_us,
+			100 * block.ticks / _ticks_per_us / real_time);
+	}
+
+	fflush(f);
+}
+
+/* Replaces the file, so that whoever reads it never sees half a dump */
+void
+node_profiler::dump(const char* path)
+{
+	std::string tmp = std::string(path) + ".tmp";
+
+	FILE* f = fopen(tmp.c_str(), "w");
+	if (!f) {
+		perror(tmp.c_str());
+		return;
+	}
+
+	dump(f);
+	fclose(f);
+
+	if (rename(tmp.c_str(), path) == -1)
+		perror(path);
+}
+
+void*
+node_profiler::dump_thread(void* arg)
+{
+	node_profiler* p = (node_profiler*) arg;
+
+	while (true) {
+		while (sem_wait(&p->_dump) == -1)
+			assert(errno == EINTR);
+
+		if (p->_exit)
+			break;
+
+		if (p->_path)
+			p->dump(p->_path);
+		else
+			p->dump(stdout);
+	}
+
+	return NULL;
+}
+
+/* Dumps to the file (or to stdout if path is 0) on a thread of its own
+ * every time request_dump() is called */
+void
+node_profiler::start_dumping(const char* path)
+{
+	_path = path;
+
+	if (sem_init(&_dump, 0, 0) == -1)
+		exit(EXIT_FAILURE);
+
+	if (pthread_create(&_thread, NULL, &dump_thread, (void*) this))
+		exit(EXIT_FAILURE);
+
+	_dumping = true;
+}
+
+/* Safe to call from a signal handler */
+void
+node_profiler::request_dump()
+{
+	if (_dumping)
+		sem_post(&_dump);
+}
+
+/* plugin::process(), timed on behalf of the given thread if there is a
+ * profiler */
+static inline void
+profile_process(node_profiler* profiler, unsigned int thread, plugin* p,
+	unsigned int sample_count)
+{
+	if (!profiler) {
+		p->process(sample_count);
+		return;
+	}
+
+	unsigned long runs = p->_nr_runs;
+	unsigned long splits = p->_nr_splits;
+	uint64_t start = node_profiler::now();
+
+	p->process(sample_count);
+
+	uint64_t ticks = node_profiler::now() - start;
+	profiler->record(thread, p, ticks, p->_nr_runs - runs,
+		p->_nr_splits - splits);
+}
+
+#endif
+
+#endif
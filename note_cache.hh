@@ -0,0 +1,487 @@
+#ifndef NOTE_CACHE_HH
+#define NOTE_CACHE_HH
+
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+}
+
+#include "mix_kernels.hh"
+
+/* Rendered notes of a deterministic voice, so that a note that has been
+ * played before (same note, velocity, frequency, duration and control
+ * port values) can be mixed in from memory instead of rendered again.
+ *
+ * Everything lives in an arena that is allocated up front, split into
+ * fixed-size chunks; a note is a chain of chunks. When the arena is
+ * full, the least recently used notes that nobody is playing are
+ * evicted. None of the functions allocate, so they can be called from
+ * the audio thread (but only from one thread). */
+class note_cache {
+public:
+	struct key {
+		uint8_t note;
+		uint8_t velocity;
+		float frequency;
+		unsigned long duration;
+		uint64_t params;
+	};
+
+	/* Where a playback has got to */
+	struct cursor {
+		int entry;
+		int chunk;
+		unsigned int pos;
+		unsigned long left;
+	};
+
+public:
+	explicit note_cache(unsigned long bytes);
+	~note_cache();
+
+public:
+	bool lookup(const key& k, cursor* c);
+	unsigned int mix(cursor* c, float* out, unsigned int n);
+	void close(cursor* c);
+
+	int record(const key& k);
+	bool append(int entry, const float* samples, unsigned int n);
+	void finish(int entry);
+	void abort(int entry);
+
+	void print_stats();
+
+public:
+	/* In samples; 16 KiB */
+	static const unsigned int chunk_size = 4096;
+
+	unsigned long _nr_hits;
+	unsigned long _nr_misses;
+	unsigned long _nr_evictions;
+
+	/* Recordings given up because the arena was full of notes being
+	 * played */
+	unsigned long _nr_aborted;
+
+private:
+	enum entry_state {
+		ENTRY_FREE,
+		ENTRY_RECORDING,
+		ENTRY_READY,
+	};
+
+	struct entry {
+		key k;
+		uint32_t hash;
+		entry_state state;
+
+		/* Number of cursors playing it */
+		unsigned int users;
+
+		unsigned long length;
+		int first_chunk;
+		int last_chunk;
+
+		/* Hash chain, or free list */
+		int next;
+
+		/* Least recently used list; only ready entries are on it */
+		int lru_prev;
+		int lru_next;
+	};
+
+private:
+	static uint32_t hash(const key& k);
+	static bool equal(const key& a, const key& b);
+
+	int find(const key& k, uint32_t h);
+	int get_chunk();
+	bool evict();
+	void free_chunks(entry& e);
+
+	void lru_remove(int i);
+	void lru_push(int i);
+
+	void unhash(int i);
+
+private:
+	unsigned int _nr_chunks;
+	float* _arena;
+
+	/* Chunk chains, and the free list */
+	std::vector<int> _chunk_next;
+	int _free_chunks;
+
+	std::vector<entry> _entries;
+	int _free_entries;
+
+	std::vector<int> _buckets;
+
+	/* Most and least recently used */
+	int _lru_head;
+	int _lru_tail;
+};
+
+note_cache::note_cache(unsigned long bytes):
+	_nr_hits(0),
+	_nr_misses(0),
+	_nr_evictions(0),
+	_nr_aborted(0),
+	_lru_head(-1),
+	_lru_tail(-1)
+{
+	_nr_chunks = bytes / (chunk_size * sizeof(float));
+	if (_nr_chunks == 0)
+		_nr_chunks = 1;
+
+	_arena = new float[(unsigned long) _nr_chunks * chunk_size];
+
+	_chunk_next.resize(_nr_chunks);
+	for (unsigned int i = 0; i < _nr_chunks; ++i)
+		_chunk_next[i] = i + 1 < _nr_chunks ? (int) i + 1 : -1;
+	_free_chunks = 0;
+
+	/* A note takes at least one chunk */
+	_entries.resize(_nr_chunks);
+	for (unsigned int i = 0; i < _nr_chunks; ++i) {
+		_entries[i].state = ENTRY_FREE;
+		_entries[i].next = i + 1 < _nr_chunks ? (int) i + 1 : -1;
+	}
+	_free_entries = 0;
+
+	unsigned int nr_buckets = 1;
+	while (nr_buckets < 2 * _nr_chunks)
+		nr_buckets *= 2;
+
+	_buckets.assign(nr_buckets, -1);
+}
+
+note_cache::~note_cache()
+{
+	delete[] _arena;
+}
+
+uint32_t
+note_cache::hash(const key& k)
+{
+	/* FNV-1a */
+	uint64_t words[] = {
+		(uint64_t) k.note << 8 | k.velocity,
+		k.duration,
+		k.params,
+	};
+
+	uint32_t f;
+	memcpy(&f, &k.frequency, sizeof(f));
+
+	uint32_t h = 2166136261U ^ f;
+	h *= 16777619U;
+	for (unsigned int i = 0; i < 3; ++i) {
+		for (unsigned int j = 0; j < 8; ++j) {
+			h ^= (words[i] >> (8 * j)) & 0xff;
+			h *= 16777619U;
+		}
+	}
+
+	return h;
+}
+
+bool
+note_cache::equal(const key& a, const key& b)
+{
+	return a.note == b.note && a.velocity == b.velocity
+		&& a.frequency == b.frequency && a.duration == b.duration
+		&& a.params == b.params;
+}
+
+int
+note_cache::find(const key& k, uint32_t h)
+{
+	for (int i = _buckets[h & (_buckets.size() - 1)]; i != -1;
+		i = _entries[i].next)
+	{
+		const entry& e = _entries[i];
+		if (e.hash == h && equal(e.k, k))
+			return i;
+	}
+
+	return -1;
+}
+
+void
+note_cache::lru_remove(int i)
+{
+	entry& e = _entries[i];
+
+	if (e.lru_prev != -1)
+		_entries[e.lru_prev].lru_next = e.lru_next;
+	else
+		_lru_head = e.lru_next;
+
+	if (e.lru_next != -1)
+		_entries[e.lru_next].lru_prev = e.lru_prev;
+	else
+		_lru_tail = e.lru_prev;
+}
+
+void
+note_cache::lru_push(int i)
+{
+	entry& e = _entries[i];
+
+	e.lru_prev = -1;
+	e.lru_next = _lru_head;
+
+	if (_lru_head != -1)
+		_entries[_lru_head].lru_prev = i;
+	else
+		_lru_tail = i;
+
+	_lru_head = i;
+}
+
+void
+note_cache::unhash(int i)
+{
+	int* p = &_buckets[_entries[i].hash & (_buckets.size() - 1)];
+	while (*p != i)
+		p = &_entries[*p].next;
+
+	*p = _entries[i].next;
+}
+
+void
+note_cache::free_chunks(entry& e)
+{
+	if (e.first_chunk != -1) {
+		_chunk_next[e.last_chunk] = _free_chunks;
+		_free_chunks = e.first_chunk;
+	}
+
+	e.first_chunk = -1;
+	e.last_chunk = -1;
+}
+
+/* Throw out the least recently used note that isn't playing */
+bool
+note_cache::evict()
+{
+	int i = _lru_tail;
+	while (i != -1 && _entries[i].users)
+		i = _entries[i].lru_prev;
+
+	if (i == -1)
+		return false;
+
+	entry& e = _entries[i];
+
+	lru_remove(i);
+	unhash(i);
+	free_chunks(e);
+
+	e.state = ENTRY_FREE;
+	e.next = _free_entries;
+	_free_entries = i;
+
+	++_nr_evictions;
+	return true;
+}
+
+int
+note_cache::get_chunk()
+{
+	if (_free_chunks == -1 && !evict())
+		return -1;
+
+	int c = _free_chunks;
+	_free_chunks = _chunk_next[c];
+	_chunk_next[c] = -1;
+	return c;
+}
+
+/* Starts playing the note if we have it */
+bool
+note_cache::lookup(const key& k, cursor* c)
+{
+	int i = find(k, hash(k));
+	if (i == -1) {
+		++_nr_misses;
+		return false;
+	}
+
+	++_nr_hits;
+
+	entry& e = _entries[i];
+	++e.users;
+
+	lru_remove(i);
+	lru_push(i);
+
+	c->entry = i;
+	c->chunk = e.first_chunk;
+	c->pos = 0;
+	c->left = e.length;
+	return true;
+}
+
+/* Adds up to n samples of the note to out; returns how many there were */
+unsigned int
+note_cache::mix(cursor* c, float* out, unsigned int n)
+{
+	unsigned int done = 0;
+
+	while (done < n && c->left) {
+		unsigned int count = chunk_size - c->pos;
+		if (count > n - done)
+			count = n - done;
+		if (count > c->left)
+			count = c->left;
+
+		const float* in = _arena + (unsigned long) c->chunk * chunk_size
+			+ c->pos;
+		mix_add(out + done, in, 1, count);
+
+		done += count;
+		c->left -= count;
+		c->pos += count;
+
+		if (c->pos == chunk_size) {
+			c->chunk = _chunk_next[c->chunk];
+			c->pos = 0;
+		}
+	}
+
+	return done;
+}
+
+void
+note_cache::close(cursor* c)
+{
+	assert(_entries[c->entry].users > 0);
+	--_entries[c->entry].users;
+}
+
+/* Returns the entry to append() the note to, or -1 if there is no room */
+int
+note_cache::record(const key& k)
+{
+	int i = _free_entries;
+	if (i == -1) {
+		if (!evict())
+			return -1;
+
+		i = _free_entries;
+	}
+
+	entry& e = _entries[i];
+	_free_entries = e.next;
+
+	e.k = k;
+	e.hash = hash(k);
+	e.state = ENTRY_RECORDING;
+	e.users = 0;
+	e.length = 0;
+	e.first_chunk = -1;
+	e.last_chunk = -1;
+	e.next = -1;
+
+	return i;
+}
+
+/* Returns false if the arena ran out, in which case the recording has
+ * been dropped */
+bool
+note_cache::append(int i, const float* samples, unsigned int n)
+{
+	entry& e = _entries[i];
+	assert(e.state == ENTRY_RECORDING);
+
+	while (n) {
+		unsigned int pos = e.length % chunk_size;
+
+		if (pos == 0) {
+			int c = get_chunk();
+			if (c == -1) {
+				++_nr_aborted;
+				abort(i);
+				return false;
+			}
+
+			if (e.last_chunk == -1)
+				e.first_chunk = c;
+			else
+				_chunk_next[e.last_chunk] = c;
+
+			e.last_chunk = c;
+		}
+
+		unsigned int count = chunk_size - pos;
+		if (count > n)
+			count = n;
+
+		memcpy(_arena + (unsigned long) e.last_chunk * chunk_size + pos,
+			samples, count * sizeof(float));
+
+		e.length += count;
+		samples += count;
+		n -= count;
+	}
+
+	return true;
+}
+
+/* The note has died away; make it available */
+void
+note_cache::finish(int i)
+{
+	entry& e = _entries[i];
+	assert(e.state == ENTRY_RECORDING);
+
+	/* Two voices recorded the same note at once */
+	if (find(e.k, e.hash) != -1) {
+		abort(i);
+		return;
+	}
+
+	int* bucket = &_buckets[e.hash & (_buckets.size() - 1)];
+	e.next = *bucket;
+	*bucket = i;
+
+	e.state = ENTRY_READY;
+	lru_push(i);
+}
+
+void
+note_cache::abort(int i)
+{
+	entry& e = _entries[i];
+	assert(e.state == ENTRY_RECORDING);
+
+	free_chunks(e);
+
+	e.state = ENTRY_FREE;
+	e.next = _free_entries;
+	_free_entries = i;
+}
+
+void
+note_cache::print_stats()
+{
+	unsigned long lookups = _nr_hits + _nr_misses;
+	unsigned int used = 0;
+
+	for (int c = _free_chunks; c != -1; c = _chunk_next[c])
+		++used;
+	used = _nr_chunks - used;
+
+	printf("note cache: %lu/%lu hits (%.1f%%), %lu evictions, "
+		"%lu dropped, %u of %u chunks in use\n",
+		_nr_hits, lookups, lookups ? 100. * _nr_hits / lookups : 0.,
+		_nr_evictions, _nr_aborted, used, _nr_chunks);
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef OFFLINE_RENDERER_HH
+#define OFFLINE_RENDERER_HH
+
+extern "C" {
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+}
+
+#include "graph.hh"
+#include "plugin.hh"
+
+/* Renders a graph as fast as the CPU allows: from time zero until every
+ * sequencer has played all its events, and then on until what reaches
+ * the output has stayed below silence_threshold for _tail_silence
+ * seconds (e.g. the end of the reverb tail), or until _max_tail seconds
+ * have passed. "output" is the sink whose inputs are measured. */
+class offline_renderer {
+public:
+	offline_renderer(graph* g, plugin* output);
+	~offline_renderer();
+
+public:
+	void run(const bool* running);
+	void print_stats();
+
+private:
+	float output_peak(unsigned int sample_count);
+
+public:
+	/* In seconds */
+	double _tail_silence;
+	double _max_tail;
+
+private:
+	graph* _graph;
+	plugin* _output;
+
+	unsigned long _song_length;
+	unsigned long _length;
+	double _elapsed;
+};
+
+offline_renderer::offline_renderer(graph* g, plugin* output):
+	_tail_silence(0.1),
+	_max_tail(30),
+	_graph(g),
+	_output(output),
+	_song_length(0),
+	_length(0),
+	_elapsed(0)
+{
+}
+
+offline_renderer::~offline_renderer()
+{
+}
+
+float
+offline_renderer::output_peak(unsigned int sample_count)
+{
+	float peak = 0;
+
+	for (unsigned int i = 0; i < _output->_audio_inputs.size(); ++i) {
+		unsigned int port = _output->_audio_inputs[i];
+		const float* buffer = _output->_ports[port];
+
+		if (*_output->_silent[port])
+			continue;
+
+		for (unsigned int j = 0; j < sample_count; ++j) {
+			float a = fabsf(buffer[j]);
+			if (a > peak)
+				peak = a;
+		}
+	}
+
+	return peak;
+}
+
+void
+offline_renderer::run(const bool* running)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	unsigned long silence_needed = _tail_silence * sample_rate;
+	unsigned long max_tail_length = _max_tail * sample_rate;
+
+	unsigned long t = 0;
+	unsigned long song_end = 0;
+	unsigned long silence = 0;
+	bool song_done = false;
+
+	while (*running) {
+		_graph->run(buffer_size);
+		t += buffer_size;
+
+		/* The sequencers have queued everything up to t by now */
+		if (!song_done) {
+			if (!_graph->sequencers_done())
+				continue;
+
+			song_done = true;
+			song_end = t;
+		}
+
+		if (output_peak(buffer_size) < silence_threshold)
+			silence += buffer_size;
+		else
+			silence = 0;
+
+		if (silence >= silence_needed)
+			break;
+		if (t - song_end >= max_tail_length)
+			break;
+	}
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	_song_length = song_done ? song_end : t;
+	_length = t;
+	_elapsed = (end.tv_sec - start.tv_sec)
+		+ 1e-9 * (end.tv_nsec - start.tv_nsec);
+}
+
+void
+offline_renderer::print_stats()
+{
+	double seconds = (double) _length / sample_rate;
+
+	printf("rendered %.2f s (song %.2f s, tail %.2f s) in %.3f s, "
+		"%.1fx realtime\n",
+		seconds, (double) _song_length / sample_rate,
+		(double) (_length - _song_length) / sample_rate,
+		_elapsed, _elapsed > 0 ? seconds / _elapsed : 0);
+}
+
+#endif
@@ -0,0 +1,606 @@
+#ifndef ORGAN_PLUGIN_HH
+#define ORGAN_PLUGIN_HH
+
+#include <vector>
+
+extern "C" {
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+}
+
+#include "event.hh"
+#include "plugin.hh"
+
+/* A polyphonic drawbar organ that renders all of its voices together.
+ *
+ * It has the same ports as the CMT "organ" LADSPA plugin, so it can be
+ * set up the same way, but instead of a gate and a frequency it listens
+ * to a sequencer's all_notes stream (like poly_plugin) and assigns the
+ * notes to its own voices.
+ *
+ * The voice state is kept as arrays (struct-of-arrays) and rendered
+ * eight voices at a time with GCC vector extensions. Each voice is a
+ * rotating phasor an octave below its note, the 16' drawbar; the
+ * partials of all the drawbars come out of it through the Chebyshev
+ * recurrence, with no tables or sin() calls. Partials at or above the
+ * Nyquist frequency are left out, so high notes don't alias. The lower
+ * three drawbars follow the "lo" envelope and the upper three the "hi"
+ * one.
+ *
+ * As with the CMT organ, the output is scaled by the velocity port;
+ * each note is scaled by its own velocity as well. */
+class organ_plugin:
+	public plugin
+{
+public:
+	organ_plugin(unsigned int voices);
+	~organ_plugin();
+
+public:
+	void deactivate();
+
+	bool is_audio_output(unsigned int port);
+
+	bool busy();
+
+	void run(unsigned int sample_count);
+
+public:
+	/* Voices rendered together, and partials of the 16' pitch */
+	static const unsigned int lanes = 8;
+	static const unsigned int nr_partials = 16;
+
+	enum stage {
+		STAGE_ATTACK,
+		STAGE_DECAY,
+		STAGE_RELEASE,
+	};
+
+	/* The parts of the voices that the kernel looks at; every array
+	 * has _nr_voices entries */
+	struct voices {
+		float* cos;
+		float* sin;
+
+		/* The phasor is rotated by this every sample */
+		float* step_cos;
+		float* step_sin;
+
+		float* velocity;
+
+		/* Partials up to this one are below the Nyquist frequency */
+		float* max_partial;
+
+		float* env_lo;
+		float* env_hi;
+		int32_t* stage_lo;
+		int32_t* stage_hi;
+	};
+
+	/* Per block, from the control ports */
+	struct params {
+		float partials_lo[nr_partials + 1];
+		float partials_hi[nr_partials + 1];
+
+		float coeff_attack_lo;
+		float coeff_decay_lo;
+		float coeff_release_lo;
+		float sustain_lo;
+
+		float coeff_attack_hi;
+		float coeff_decay_hi;
+		float coeff_release_hi;
+		float sustain_hi;
+
+		float velocity;
+	};
+
+private:
+	enum voice_state {
+		VOICE_FREE,
+		VOICE_PLAYING,
+		VOICE_RELEASING,
+	};
+
+	struct voice {
+		voice_state state;
+
+		uint8_t channel;
+		uint8_t note;
+
+		/* When the current note started, in samples */
+		unsigned long started;
+	};
+
+	typedef std::vector<voice> voice_vector;
+
+private:
+	void update_params();
+	unsigned int allocate();
+	void note_on(const event& e);
+	void note_off(const event& e);
+	void render(unsigned int offset, unsigned int n);
+
+private:
+	unsigned int _nr_voices;
+	voice_vector _voices;
+	voices _v;
+	params _params;
+
+	/* Samples rendered so far */
+	unsigned long _time;
+
+	/* lanes samples per frame: the voices of each lane summed */
+	float* _mix;
+
+	/* The control ports as of the last busy() */
+	float* _controls;
+
+	unsigned int _nr_stolen;
+};
+
+/* The voice arrays are 64-byte aligned and lane groups start at
+ * multiples of lanes, so they can be accessed through these directly */
+typedef float v8sf __attribute__((vector_size(32)));
+typedef int32_t v8si __attribute__((vector_size(32)));
+typedef float v8sf_mem __attribute__((vector_size(32), may_alias));
+typedef int32_t v8si_mem __attribute__((vector_size(32), may_alias));
+
+/* Exponential approach to the stage's target. The attack aims past 1 so
+ * that it gets there in finite time, and then turns into the decay.
+ * (Vectors are passed by pointer, as passing them by value depends on
+ * whether AVX is enabled.) */
+static inline __attribute__((always_inline)) void
+organ_envelope(v8sf* env, v8si* stage, float attack, float decay,
+	float release, float sustain)
+{
+	v8si attacking = *stage == (int32_t) organ_plugin::STAGE_ATTACK;
+	v8si decaying = *stage == (int32_t) organ_plugin::STAGE_DECAY;
+
+	v8sf zero = {};
+	v8sf target = attacking ? zero + 1.5f
+		: (decaying ? zero + sustain : zero);
+	v8sf coeff = attacking ? zero + attack
+		: (decaying ? zero + decay : zero + release);
+
+	v8sf e = *env + (target - *env) * coeff;
+
+	v8si done = attacking & (e >= 1.f);
+	*env = done ? zero + 1.f : e;
+	*stage = done ? *stage + 1 : *stage;
+}
+
+/* Renders lanes voices, starting at "first", for n samples and adds
+ * each lane's output to mix[lanes * i + lane] */
+__attribute__((target_clones("avx2", "default"))) static void
+organ_render_group(organ_plugin::voices* v, unsigned int first,
+	const organ_plugin::params* params, float* mix, unsigned int n)
+{
+	/* A local copy, so that the stores to mix can't alias it */
+	organ_plugin::params p_copy = *params;
+	const organ_plugin::params* p = &p_copy;
+
+	v8sf c = *(v8sf_mem*) (v->cos + first);
+	v8sf s = *(v8sf_mem*) (v->sin + first);
+	v8sf step_c = *(v8sf_mem*) (v->step_cos + first);
+	v8sf step_s = *(v8sf_mem*) (v->step_sin + first);
+	v8sf velocity = *(v8sf_mem*) (v->velocity + first);
+	v8sf max_partial = *(v8sf_mem*) (v->max_partial + first);
+	v8sf env_lo = *(v8sf_mem*) (v->env_lo + first);
+	v8sf env_hi = *(v8sf_mem*) (v->env_hi + first);
+	v8si stage_lo = *(v8si_mem*) (v->stage_lo + first);
+	v8si stage_hi = *(v8si_mem*) (v->stage_hi + first);
+
+	/* Each lane's partial amplitudes, without the ones it can't have */
+	v8sf a[organ_plugin::nr_partials + 1];
+	v8sf b[organ_plugin::nr_partials + 1];
+	for (unsigned int k = 1; k <= organ_plugin::nr_partials; ++k) {
+		v8sf zero = {};
+		v8si below = zero + (float) k <= max_partial;
+
+		a[k] = below ? zero + p->partials_lo[k] : zero;
+		b[k] = below ? zero + p->partials_hi[k] : zero;
+	}
+
+	for (unsigned int i = 0; i < n; ++i) {
+		/* sin(k x) = 2 cos(x) sin((k - 1) x) - sin((k - 2) x) gets
+		 * us the first four partials. The rest come four at a time
+		 * from sin((k + 4) x) = 2 cos(4 x) sin(k x) - sin((k - 4) x),
+		 * which keeps the chains of dependent operations short. */
+		v8sf two_c = c + c;
+		v8sf s1 = s;
+		v8sf s2 = two_c * s1;
+		v8sf s3 = two_c * s2 - s1;
+		v8sf s4 = two_c * s3 - s2;
+
+		v8sf c2 = two_c * c - 1;
+		v8sf two_c4 = 4 * c2 * c2 - 2;
+		v8sf s5 = two_c4 * s1 + s3;
+		v8sf s6 = two_c4 * s2 + s2;
+		v8sf s7 = two_c4 * s3 + s1;
+		v8sf s8 = two_c4 * s4;
+		v8sf s9 = two_c4 * s5 - s1;
+		v8sf s10 = two_c4 * s6 - s2;
+		v8sf s11 = two_c4 * s7 - s3;
+		v8sf s12 = two_c4 * s8 - s4;
+		v8sf s13 = two_c4 * s9 - s5;
+		v8sf s14 = two_c4 * s10 - s6;
+		v8sf s15 = two_c4 * s11 - s7;
+		v8sf s16 = two_c4 * s12 - s8;
+
+		/* Four sums each, again for shorter chains */
+		v8sf lo = ((s1 * a[1] + s5 * a[5]) + (s9 * a[9] + s13 * a[13]))
+			+ ((s2 * a[2] + s6 * a[6]) + (s10 * a[10] + s14 * a[14]))
+			+ ((s3 * a[3] + s7 * a[7]) + (s11 * a[11] + s15 * a[15]))
+			+ ((s4 * a[4] + s8 * a[8]) + (s12 * a[12] + s16 * a[16]));
+
+		v8sf hi = ((s1 * b[1] + s5 * b[5]) + (s9 * b[9] + s13 * b[13]))
+			+ ((s2 * b[2] + s6 * b[6]) + (s10 * b[10] + s14 * b[14]))
+			+ ((s3 * b[3] + s7 * b[7]) + (s11 * b[11] + s15 * b[15]))
+			+ ((s4 * b[4] + s8 * b[8]) + (s12 * b[12] + s16 * b[16]));
+
+		*(v8sf_mem*) (mix + organ_plugin::lanes * i)
+			+= velocity * (env_lo * lo + env_hi * hi);
+
+		v8sf next_c = c * step_c - s * step_s;
+		s = s * step_c + c * step_s;
+		c = next_c;
+
+		organ_envelope(&env_lo, &stage_lo, p->coeff_attack_lo,
+			p->coeff_decay_lo, p->coeff_release_lo, p->sustain_lo);
+		organ_envelope(&env_hi, &stage_hi, p->coeff_attack_hi,
+			p->coeff_decay_hi, p->coeff_release_hi, p->sustain_hi);
+	}
+
+	/* Keep the rounding errors from changing the amplitude */
+	v8sf r = c * c + s * s;
+	v8sf scale = (3 - r) * 0.5f;
+	c *= scale;
+	s *= scale;
+
+	*(v8sf_mem*) (v->cos + first) = c;
+	*(v8sf_mem*) (v->sin + first) = s;
+	*(v8sf_mem*) (v->env_lo + first) = env_lo;
+	*(v8sf_mem*) (v->env_hi + first) = env_hi;
+	*(v8si_mem*) (v->stage_lo + first) = stage_lo;
+	*(v8si_mem*) (v->stage_hi + first) = stage_hi;
+}
+
+template<typename T>
+static T*
+organ_alloc(unsigned int n)
+{
+	void* p;
+	if (posix_memalign(&p, 64, n * sizeof(T)))
+		exit(1);
+
+	memset(p, 0, n * sizeof(T));
+	return (T*) p;
+}
+
+organ_plugin::organ_plugin(unsigned int voices):
+	_time(0),
+	_nr_stolen(0)
+{
+	assert(voices > 0);
+
+	_bypass = true;
+
+	/* A whole number of lane groups */
+	_nr_voices = (voices + lanes - 1) / lanes * lanes;
+
+	_nr_ports = 21;
+	_ports = new float*[21];
+
+	/* Bound by the graph */
+	_ports[0] = 0;
+
+	/* Controls; see main.cc for what they are */
+	for (unsigned int i = 1; i < 21; ++i)
+		_ports[i] = new float[1]();
+
+	_ports[6][0] = 1;	/* Flute */
+	_ports[8][0] = 1;	/* 8th Harmonic */
+	for (unsigned int i = 13; i <= 20; ++i)
+		_ports[i][0] = 0.01;	/* Attack, decay, release */
+	_ports[15][0] = 1;	/* Sustain Lo */
+	_ports[19][0] = 1;	/* Sustain Hi */
+
+	_controls = new float[21];
+	for (unsigned int i = 1; i < 21; ++i)
+		_controls[i] = _ports[i][0];
+
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		voice v;
+		v.state = VOICE_FREE;
+		v.channel = 0;
+		v.note = 0;
+		v.started = 0;
+		_voices.push_back(v);
+	}
+
+	_v.cos = organ_alloc<float>(_nr_voices);
+	_v.sin = organ_alloc<float>(_nr_voices);
+	_v.step_cos = organ_alloc<float>(_nr_voices);
+	_v.step_sin = organ_alloc<float>(_nr_voices);
+	_v.velocity = organ_alloc<float>(_nr_voices);
+	_v.max_partial = organ_alloc<float>(_nr_voices);
+	_v.env_lo = organ_alloc<float>(_nr_voices);
+	_v.env_hi = organ_alloc<float>(_nr_voices);
+	_v.stage_lo = organ_alloc<int32_t>(_nr_voices);
+	_v.stage_hi = organ_alloc<int32_t>(_nr_voices);
+
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		_v.cos[i] = 1;
+		_v.step_cos[i] = 1;
+		_v.stage_lo[i] = STAGE_RELEASE;
+		_v.stage_hi[i] = STAGE_RELEASE;
+	}
+
+	_mix = organ_alloc<float>(lanes * buffer_size);
+}
+
+organ_plugin::~organ_plugin()
+{
+	free(_mix);
+
+	free(_v.cos);
+	free(_v.sin);
+	free(_v.step_cos);
+	free(_v.step_sin);
+	free(_v.velocity);
+	free(_v.max_partial);
+	free(_v.env_lo);
+	free(_v.env_hi);
+	free(_v.stage_lo);
+	free(_v.stage_hi);
+
+	for (unsigned int i = 1; i < 21; ++i)
+		delete[] _ports[i];
+
+	delete[] _controls;
+	delete[] _ports;
+}
+
+void
+organ_plugin::deactivate()
+{
+	if (_nr_stolen)
+		printf("organ: %u voices stolen\n", _nr_stolen);
+}
+
+bool
+organ_plugin::is_audio_output(unsigned int port)
+{
+	return port == 0;
+}
+
+/* A control that was moved while we were bypassed has to be taken up */
+bool
+organ_plugin::busy()
+{
+	bool changed = false;
+
+	for (unsigned int i = 1; i < 21; ++i) {
+		float value = _ports[i][0];
+
+		if (value != _controls[i]) {
+			_controls[i] = value;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/* A one-pole coefficient that gets about 1/e of the way to the target
+ * in the given number of seconds */
+static float
+time_coeff(float seconds)
+{
+	if (seconds < 0.001)
+		seconds = 0.001;
+
+	return 1 - expf(-1. / (seconds * sample_rate));
+}
+
+/* Turn the control ports into partial amplitudes and envelope
+ * coefficients. Each drawbar is a pitch (in partials of 16') and has a
+ * flute (sine), reed (odd harmonics) and brass (all harmonics) part. */
+void
+organ_plugin::update_params()
+{
+	static const unsigned int drawbar_partial[] = { 1, 2, 3, 4, 6, 8 };
+
+	float brass = _ports[4][0];
+	float reed = _ports[5][0];
+	float flute = _ports[6][0];
+
+	float tone = brass + reed + flute;
+	float gain = tone > 0 ? 1. / (6 * tone) : 0;
+
+	for (unsigned int k = 0; k <= nr_partials; ++k) {
+		_params.partials_lo[k] = 0;
+		_params.partials_hi[k] = 0;
+	}
+
+	for (unsigned int i = 0; i < 6; ++i) {
+		float* partials = i < 3
+			? _params.partials_lo : _params.partials_hi;
+		float level = gain * _ports[7 + i][0];
+		unsigned int m = drawbar_partial[i];
+
+		partials[m] += level * flute;
+
+		for (unsigned int j = 1; m * j <= nr_partials; ++j) {
+			partials[m * j] += level * brass / j;
+			if (j % 2)
+				partials[m * j] += level * reed / j;
+		}
+	}
+
+	_params.coeff_attack_lo = time_coeff(_ports[13][0]);
+	_params.coeff_decay_lo = time_coeff(_ports[14][0]);
+	_params.sustain_lo = _ports[15][0];
+	_params.coeff_release_lo = time_coeff(_ports[16][0]);
+	_params.coeff_attack_hi = time_coeff(_ports[17][0]);
+	_params.coeff_decay_hi = time_coeff(_ports[18][0]);
+	_params.sustain_hi = _ports[19][0];
+	_params.coeff_release_hi = time_coeff(_ports[20][0]);
+
+	_params.velocity = _ports[2][0];
+}
+
+/* A free voice if there is one, otherwise the oldest releasing one,
+ * otherwise the oldest */
+unsigned int
+organ_plugin::allocate()
+{
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		if (_voices[i].state == VOICE_FREE)
+			return i;
+	}
+
+	++_nr_stolen;
+
+	unsigned int best = 0;
+	for (unsigned int i = 1; i < _nr_voices; ++i) {
+		const voice& v = _voices[i];
+		const voice& b = _voices[best];
+
+		if (v.state != b.state) {
+			if (v.state == VOICE_RELEASING)
+				best = i;
+			continue;
+		}
+
+		if (v.started < b.started)
+			best = i;
+	}
+
+	return best;
+}
+
+void
+organ_plugin::note_on(const event& e)
+{
+	unsigned int i = allocate();
+	voice& v = _voices[i];
+
+	v.state = VOICE_PLAYING;
+	v.channel = e.channel;
+	v.note = e.note;
+	v.started = _time + e.offset;
+
+	/* The note is the 8' pitch, so 16' is half of it */
+	double w = M_PI * e.value / sample_rate;
+	_v.step_cos[i] = cos(w);
+	_v.step_sin[i] = sin(w);
+	_v.velocity[i] = e.velocity / 127.;
+
+	/* Partial k is at k * e.value / 2 Hz; keep those below Nyquist,
+	 * with a little room to spare */
+	_v.max_partial[i] = e.value > 0
+		? floor(0.49 * sample_rate / (e.value / 2)) : 0;
+
+	/* A stolen voice keeps its phase and level, so it doesn't click */
+	_v.stage_lo[i] = STAGE_ATTACK;
+	_v.stage_hi[i] = STAGE_ATTACK;
+}
+
+void
+organ_plugin::note_off(const event& e)
+{
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		voice& v = _voices[i];
+
+		if (v.state != VOICE_PLAYING)
+			continue;
+		if (v.channel != e.channel || v.note != e.note)
+			continue;
+
+		v.state = VOICE_RELEASING;
+		_v.stage_lo[i] = STAGE_RELEASE;
+		_v.stage_hi[i] = STAGE_RELEASE;
+		return;
+	}
+
+	/* The note was stolen before it ended */
+}
+
+/* Render n samples into the output from offset on, skipping the groups
+ * that have no sounding voices */
+void
+organ_plugin::render(unsigned int offset, unsigned int n)
+{
+	if (n == 0)
+		return;
+
+	memset(_mix, 0, lanes * n * sizeof(float));
+
+	for (unsigned int i = 0; i < _nr_voices; i += lanes) {
+		bool active = false;
+		for (unsigned int j = 0; j < lanes; ++j)
+			active = active || _voices[i + j].state != VOICE_FREE;
+
+		if (active)
+			organ_render_group(&_v, i, &_params, _mix, n);
+	}
+
+	float* out = _ports[0] + offset;
+	for (unsigned int i = 0; i < n; ++i) {
+		float sum = 0;
+		for (unsigned int j = 0; j < lanes; ++j)
+			sum += _mix[lanes * i + j];
+
+		out[i] = _params.velocity * sum;
+	}
+}
+
+void
+organ_plugin::run(unsigned int sample_count)
+{
+	update_params();
+
+	unsigned int offset = 0;
+	for (unsigned int i = 0, n = _events.size(); i < n; ++i) {
+		const event& e = _events[i];
+
+		if (e.type != EVENT_NOTE_ON && e.type != EVENT_NOTE_OFF)
+			continue;
+
+		render(offset, e.offset - offset);
+		offset = e.offset;
+
+		if (e.type == EVENT_NOTE_ON)
+			note_on(e);
+		else
+			note_off(e);
+	}
+
+	render(offset, sample_count - offset);
+
+	/* Voices whose release has died away can be reused */
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		voice& v = _voices[i];
+
+		if (v.state != VOICE_RELEASING)
+			continue;
+		if (_v.env_lo[i] >= silence_threshold
+			|| _v.env_hi[i] >= silence_threshold)
+		{
+			continue;
+		}
+
+		v.state = VOICE_FREE;
+		_v.env_lo[i] = 0;
+		_v.env_hi[i] = 0;
+	}
+
+	_time += sample_count;
+}
+
+#endif
@@ -0,0 +1,376 @@
+#ifndef PARALLEL_EXECUTOR_HH
+#define PARALLEL_EXECUTOR_HH
+
+extern "C" {
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+}
+
+#include "denormals.hh"
+#include "schedule.hh"
+
+/* Runs a compiled schedule on a pool of worker threads.
+ *
+ * Every node has a counter of dependencies that haven't run yet in the
+ * current block; whoever finishes the last dependency of a node pushes
+ * it onto its own deque. Idle workers steal from the other deques. The
+ * thread calling run() takes part as worker 0, so nr_threads == 1 is
+ * the same as running the schedule inline.
+ *
+ * Each node still runs exactly once, after all its inputs, and reads
+ * the same buffers as it would in graph::run(), so the output does not
+ * depend on the number of threads. */
+class parallel_executor {
+public:
+	explicit parallel_executor(unsigned int nr_threads);
+	~parallel_executor();
+
+public:
+	void prepare(schedule& s);
+	void run(schedule& s, unsigned int sample_count);
+
+private:
+	/* Owner pushes and pops at the bottom, thieves take from the top.
+	 * Each worker's deque has a cache line to itself. */
+	struct deque {
+		volatile int lock;
+		unsigned int top;
+		unsigned int bottom;
+		unsigned int capacity;
+		unsigned int* tasks;
+	} __attribute__((aligned(64)));
+
+	struct worker {
+		parallel_executor* executor;
+		unsigned int id;
+		pthread_t thread;
+		sem_t start;
+		deque queue;
+	};
+
+private:
+	static void* worker_thread(void* arg);
+
+	void push(unsigned int id, unsigned int node);
+	bool pop(unsigned int id, unsigned int& node);
+	bool steal(unsigned int id, unsigned int& node);
+
+	void execute(unsigned int id, unsigned int node);
+	void work(unsigned int id);
+
+	void pin_caller();
+
+private:
+	unsigned int _nr_threads;
+	worker* _workers;
+
+	/* The thread that last called run(), once it has been pinned */
+	bool _caller_pinned;
+	pthread_t _caller;
+
+	bool _exit;
+
+	schedule* _schedule;
+	unsigned int _sample_count;
+
+	unsigned int* _pending;
+	volatile unsigned int _remaining;
+	volatile unsigned int _active;
+};
+
+static inline void
+cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#else
+	sched_yield();
+#endif
+}
+
+/* Spin for a while, then start giving the CPU away in case we are
+ * sharing it with the thread we are waiting for. */
+static inline void
+cpu_backoff(unsigned int& spins)
+{
+	if (++spins < 256) {
+		cpu_relax();
+	} else {
+		sched_yield();
+	}
+}
+
+parallel_executor::parallel_executor(unsigned int nr_threads):
+	_nr_threads(nr_threads),
+	_caller_pinned(false),
+	_exit(false),
+	_schedule(0),
+	_sample_count(0),
+	_pending(0),
+	_remaining(0),
+	_active(0)
+{
+	assert(nr_threads > 0);
+
+	/* new[] needn't respect the deques' alignment */
+	if (posix_memalign((void**) &_workers, 64,
+		nr_threads * sizeof(worker)))
+	{
+		exit(1);
+	}
+
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_cpus < 1)
+		nr_cpus = 1;
+
+	for (unsigned int i = 0; i < nr_threads; ++i) {
+		worker* w = &_workers[i];
+
+		w->executor = this;
+		w->id = i;
+		w->queue.lock = 0;
+		w->queue.top = 0;
+		w->queue.bottom = 0;
+		w->queue.capacity = 0;
+		w->queue.tasks = 0;
+
+		/* Worker 0 is whoever calls run() */
+		if (i == 0)
+			continue;
+
+		if (sem_init(&w->start, 0, 0) == -1)
+			exit(1);
+
+		if (pthread_create(&w->thread, NULL, &worker_thread, (void*) w))
+			exit(1);
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(i % nr_cpus, &cpus);
+		if (pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus))
+			printf("warning: could not pin worker %u\n", i);
+	}
+}
+
+parallel_executor::~parallel_executor()
+{
+	_exit = true;
+	__sync_synchronize();
+
+	for (unsigned int i = 1; i < _nr_threads; ++i)
+		sem_post(&_workers[i].start);
+
+	for (unsigned int i = 1; i < _nr_threads; ++i) {
+		pthread_join(_workers[i].thread, NULL);
+		sem_destroy(&_workers[i].start);
+	}
+
+	free(_workers);
+}
+
+/* Size the per-node scratch space of a schedule before it is published,
+ * so that run() never has to allocate. */
+void
+parallel_executor::prepare(schedule& s)
+{
+	unsigned int n = s._nodes.size();
+
+	s._pending.resize(n);
+	s._queues.resize(n * _nr_threads);
+}
+
+void
+parallel_executor::push(unsigned int id, unsigned int node)
+{
+	deque* q = &_workers[id].queue;
+
+	while (__sync_lock_test_and_set(&q->lock, 1))
+		cpu_relax();
+
+	/* Every node is pushed at most once per block */
+	assert(q->bottom < q->capacity);
+	q->tasks[q->bottom++] = node;
+
+	__sync_lock_release(&q->lock);
+}
+
+bool
+parallel_executor::pop(unsigned int id, unsigned int& node)
+{
+	deque* q = &_workers[id].queue;
+	bool found = false;
+
+	while (__sync_lock_test_and_set(&q->lock, 1))
+		cpu_relax();
+
+	if (q->bottom != q->top) {
+		node = q->tasks[--q->bottom];
+		found = true;
+	}
+
+	__sync_lock_release(&q->lock);
+	return found;
+}
+
+bool
+parallel_executor::steal(unsigned int id, unsigned int& node)
+{
+	for (unsigned int i = 1; i < _nr_threads; ++i) {
+		deque* q = &_workers[(id + i) % _nr_threads].queue;
+
+		/* Peek without the lock first; most deques are empty */
+		if (q->bottom == q->top)
+			continue;
+
+		bool found = false;
+
+		while (__sync_lock_test_and_set(&q->lock, 1))
+			cpu_relax();
+
+		if (q->bottom != q->top) {
+			node = q->tasks[q->top++];
+			found = true;
+		}
+
+		__sync_lock_release(&q->lock);
+
+		if (found)
+			return true;
+	}
+
+	return false;
+}
+
+void
+parallel_executor::execute(unsigned int id, unsigned int i)
+{
+	const schedule::node& n = _schedule->_nodes[i];
+
+#ifdef NODE_PROFILING
+	profile_process(_schedule->_profiler, id, n.p, _sample_count);
+#else
+	n.p->process(_sample_count);
+#endif
+
+	for (unsigned int j = 0; j < n.nr_successors; ++j) {
+		unsigned int s = _schedule->_successors[n.first_successor + j];
+
+		/* The full barrier also publishes our output buffers */
+		if (__sync_sub_and_fetch(&_pending[s], 1) == 0)
+			push(id, s);
+	}
+
+	__sync_sub_and_fetch(&_remaining, 1);
+}
+
+void
+parallel_executor::work(unsigned int id)
+{
+	unsigned int spins = 0;
+
+	while (__sync_fetch_and_add(&_remaining, 0) != 0) {
+		unsigned int node;
+
+		if (pop(id, node) || steal(id, node)) {
+			execute(id, node);
+			spins = 0;
+		} else {
+			cpu_backoff(spins);
+		}
+	}
+}
+
+void*
+parallel_executor::worker_thread(void* arg)
+{
+	worker* w = (worker*) arg;
+	parallel_executor* e = w->executor;
+
+	denormal_guard guard;
+
+	while (true) {
+		while (sem_wait(&w->start) == -1)
+			assert(errno == EINTR);
+
+		if (e->_exit)
+			break;
+
+		e->work(w->id);
+		__sync_sub_and_fetch(&e->_active, 1);
+	}
+
+	return NULL;
+}
+
+/* Worker 0 gets CPU 0, like the others get theirs. Only done the first
+ * time a thread calls run(), as it is a system call. */
+void
+parallel_executor::pin_caller()
+{
+	_caller = pthread_self();
+	_caller_pinned = true;
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+	if (pthread_setaffinity_np(_caller, sizeof(cpus), &cpus))
+		printf("warning: could not pin worker 0\n");
+}
+
+void
+parallel_executor::run(schedule& s, unsigned int sample_count)
+{
+	unsigned int n = s._nodes.size();
+	assert(s._pending.size() == n);
+	assert(s._queues.size() == n * _nr_threads);
+
+	if (!_caller_pinned || !pthread_equal(_caller, pthread_self()))
+		pin_caller();
+
+	_schedule = &s;
+	_sample_count = sample_count;
+	_pending = &s._pending[0];
+
+	for (unsigned int i = 0; i < _nr_threads; ++i) {
+		deque* q = &_workers[i].queue;
+
+		q->top = 0;
+		q->bottom = 0;
+		q->capacity = n;
+		q->tasks = &s._queues[i * n];
+	}
+
+	/* Hand out the nodes without dependencies round-robin */
+	unsigned int next = 0;
+	for (unsigned int i = 0; i < n; ++i) {
+		_pending[i] = s._nodes[i].nr_deps;
+
+		if (s._nodes[i].nr_deps == 0) {
+			push(next, i);
+			next = (next + 1) % _nr_threads;
+		}
+	}
+
+	_remaining = n;
+	_active = _nr_threads - 1;
+	__sync_synchronize();
+
+	for (unsigned int i = 1; i < _nr_threads; ++i)
+		sem_post(&_workers[i].start);
+
+	work(0);
+
+	/* Don't let the next block reset the deques under a worker that
+	 * is still looking at them */
+	unsigned int spins = 0;
+	while (__sync_fetch_and_add(&_active, 0) != 0)
+		cpu_backoff(spins);
+}
+
+#endif
@@ -2,11 +2,33 @@
 #define PLUGIN_HH
 
 #include <map>
+#include <string>
+#include <typeinfo>
+#include <vector>
 
+#include <cxxabi.h>
+
+extern "C" {
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+}
+
+#include "denormals.hh"
 #include "edge.hh"
+#include "event.hh"
+#include "mix_kernels.hh"
 
 class sequencer;
 
+/* Anything quieter than this (about -100 dBFS) counts as silence */
+static const float silence_threshold = 1e-5;
+
+/* How often a plugin that adds into a bus checks whether it has gone
+ * quiet, in blocks */
+static const unsigned int adding_probe_interval = 8;
+
 class plugin {
 public:
 	typedef std::map<plugin*, edge*> plugin_map;
@@ -20,22 +42,152 @@ public:
 	virtual void activate();
 	virtual void deactivate();
 
+	/* For reports; the class name unless the plugin knows better */
+	virtual const char* name();
+
 	virtual void connect(unsigned int port, float* buffer);
 	virtual void disconnect(unsigned int port);
 
+	/* The graph binds every audio port when it publishes a schedule;
+	 * outputs get their buffers from the graph's pool */
+	virtual bool is_audio_input(unsigned int port);
+	virtual bool is_audio_output(unsigned int port);
+
+	/* Samples by which the outputs lag the inputs */
+	virtual unsigned int latency();
+
+	/* Whether the plugin has to run even though no input, gate or
+	 * event says so, e.g. because a control port was written to
+	 * directly. Only asked of plugins that could be bypassed, once per
+	 * block. */
+	virtual bool busy();
+
+	/* Whether run() still works when an output is given the same
+	 * buffer as an input; the graph does that when nothing else reads
+	 * the input after this plugin */
+	virtual bool can_run_in_place();
+
+	/* Whether run_adding() is there: like run(), but adding gain times
+	 * the output to what is in the output buffer already */
+	virtual bool can_run_adding();
+
+	/* For a plugin that sums its inputs: where it keeps the gain it
+	 * applies to an input port, or 0 if it doesn't sum that one, and
+	 * the input port for a bus that plugins feeding it add into with
+	 * that gain, or -1 */
+	virtual const float* adding_gain(unsigned int port);
+	virtual int bus_port();
+
 	virtual void run(unsigned int sample_count) = 0;
+	virtual void run_adding(unsigned int sample_count, float gain);
+
+	void setup_ports();
+	void process(unsigned int sample_count);
+
+private:
+	bool inputs_silent();
+	bool outputs_silent(unsigned int sample_count);
+	void find_denormals(unsigned int sample_count);
+
+	void process_adding(unsigned int sample_count, bool quiet);
 
 public:
+	unsigned int _nr_ports;
 	float** _ports;
 
+	/* For each audio port, the flag that says whether its buffer is
+	 * all zeros; set up by the graph along with _ports */
+	std::vector<bool*> _silent;
+	std::vector<unsigned int> _audio_inputs;
+	std::vector<unsigned int> _audio_outputs;
+
+	/* For each control port driven by an automation lane, this block's
+	 * value of every sample; null for the others. Plugins may use it
+	 * instead of _ports[port][0] to follow changes within a block. */
+	std::vector<const float*> _ramps;
+
+	/* For each port with a ramp, how often the lane behind it computes
+	 * a new value; plugins that can only take one value per run() split
+	 * the block there */
+	std::vector<unsigned int> _ramp_periods;
+
+	/* Whether process() may skip run() when the plugin has gone quiet.
+	 * Only safe for plugins that can't start making sound on their own
+	 * without an input, a gate, an event or being busy(), and that
+	 * have no sound left in them (a delay line, say) once their output
+	 * has been silent for a block. */
+	bool _bypass;
+
+	/* Whether the output from a note on onwards only depends on the
+	 * note and the control ports, not on anything played before it,
+	 * as long as the plugin had gone quiet; see note_cache */
+	bool _deterministic;
+
+	/* Last gate value from _events */
+	bool _gate;
+
+	/* Last run() left all the outputs below silence_threshold */
+	bool _idle;
+
+	/* Set by the graph when the output is a bus shared with other
+	 * plugins: the gain to add with, whether this plugin is the first
+	 * to add to the bus in the block (and so has to clear it), and
+	 * somewhere to render to on the side */
+	const float* _adding_gain;
+	bool _clear_bus;
+	float* _scratch;
+
+	/* Blocks to go before the next check */
+	unsigned int _probe;
+
+	/* With check_denormals: subnormal output samples so far, and the
+	 * blocks in which they appeared without coming in on an input */
+	unsigned long _nr_denormals;
+	unsigned long _denormal_blocks;
+
+#ifdef NODE_PROFILING
+	/* For node_profiler: calls to run() or run_adding(), the extra
+	 * pieces the plugin split them into, and where the profiler keeps
+	 * this plugin's counters (-1 for nowhere) */
+	unsigned long _nr_runs;
+	unsigned long _nr_splits;
+	int _profile_id;
+#endif
+
 	plugin_map _deps;
 	plugin_map _rev_deps;
 
 	sequencer_map _seqs;
+
+private:
+	std::string _name;
+
+public:
+
+	/* The events of this block from all the sequencer voices in _seqs,
+	 * sorted by offset; filled in by the graph before run() */
+	event_vector _events;
 };
 
-plugin::plugin()
+plugin::plugin():
+	_nr_ports(0),
+	_bypass(false),
+	_deterministic(false),
+	_gate(false),
+	_idle(false),
+	_adding_gain(0),
+	_clear_bus(false),
+	_scratch(0),
+	_probe(0),
+	_nr_denormals(0),
+	_denormal_blocks(0)
+#ifdef NODE_PROFILING
+	, _nr_runs(0),
+	_nr_splits(0),
+	_profile_id(-1)
+#endif
 {
+	_events.reserve(event_queue_reserve);
 }
 
 plugin::~plugin()
@@ -52,6 +204,21 @@ plugin::deactivate()
 {
 }
 
+const char*
+plugin::name()
+{
+	if (_name.empty()) {
+		int status;
+		char* s = abi::__cxa_demangle(typeid(*this).name(), 0, 0,
+			&status);
+
+		_name = s ? s : typeid(*this).name();
+		free(s);
+	}
+
+	return _name.c_str();
+}
+
 void
 plugin::connect(unsigned int port, float* buffer)
 {
@@ -64,4 +231,227 @@ plugin::disconnect(unsigned int port)
 	_ports[port] = silence_buffer;
 }
 
+bool
+plugin::is_audio_input(unsigned int port)
+{
+	return false;
+}
+
+bool
+plugin::is_audio_output(unsigned int port)
+{
+	return false;
+}
+
+unsigned int
+plugin::latency()
+{
+	return 0;
+}
+
+bool
+plugin::busy()
+{
+	return false;
+}
+
+bool
+plugin::can_run_in_place()
+{
+	return false;
+}
+
+bool
+plugin::can_run_adding()
+{
+	return false;
+}
+
+const float*
+plugin::adding_gain(unsigned int port)
+{
+	return 0;
+}
+
+int
+plugin::bus_port()
+{
+	return -1;
+}
+
+void
+plugin::run_adding(unsigned int sample_count, float gain)
+{
+	/* Only called if can_run_adding() */
+	assert(false);
+}
+
+/* Called by the graph before the plugin is first scheduled */
+void
+plugin::setup_ports()
+{
+	if (_silent.size() == _nr_ports)
+		return;
+
+	_silent.assign(_nr_ports, &silence_flag);
+	_ramps.assign(_nr_ports, (const float*) 0);
+	_ramp_periods.assign(_nr_ports, 0);
+	_audio_inputs.clear();
+	_audio_outputs.clear();
+
+	for (unsigned int i = 0; i < _nr_ports; ++i) {
+		if (is_audio_input(i))
+			_audio_inputs.push_back(i);
+		if (is_audio_output(i))
+			_audio_outputs.push_back(i);
+	}
+}
+
+bool
+plugin::inputs_silent()
+{
+	for (unsigned int i = 0; i < _audio_inputs.size(); ++i) {
+		if (!*_silent[_audio_inputs[i]])
+			return false;
+	}
+
+	return true;
+}
+
+bool
+plugin::outputs_silent(unsigned int sample_count)
+{
+	for (unsigned int i = 0; i < _audio_outputs.size(); ++i) {
+		const float* buffer = _ports[_audio_outputs[i]];
+
+		for (unsigned int j = 0; j < sample_count; ++j) {
+			if (fabsf(buffer[j]) >= silence_threshold)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Counts the subnormals in the outputs, and whether the plugin made
+ * them itself rather than pass them on from an input. Slow, so only
+ * done with check_denormals. */
+void
+plugin::find_denormals(unsigned int sample_count)
+{
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < _audio_outputs.size(); ++i)
+		count += count_denormals(_ports[_audio_outputs[i]], sample_count);
+
+	if (count == 0)
+		return;
+
+	_nr_denormals += count;
+
+	for (unsigned int i = 0; i < _audio_inputs.size(); ++i) {
+		unsigned int port = _audio_inputs[i];
+
+		if (!*_silent[port]
+			&& count_denormals(_ports[port], sample_count) > 0)
+		{
+			return;
+		}
+	}
+
+	++_denormal_blocks;
+}
+
+/* What the graph calls instead of run(). A plugin that may be bypassed,
+ * has no events and a closed gate, only reads silence and last produced
+ * (near) silence is not run at all; its outputs are zeroed and flagged
+ * silent instead, so that consumers can skip them as well. */
+void
+plugin::process(unsigned int sample_count)
+{
+	for (unsigned int i = 0, n = _events.size(); i < n; ++i) {
+		if (_events[i].type == EVENT_GATE)
+			_gate = _events[i].value != 0;
+	}
+
+	bool quiet = _bypass && !_gate && _events.empty()
+		&& !_audio_outputs.empty() && inputs_silent() && !busy();
+
+	if (_adding_gain) {
+		process_adding(sample_count, quiet);
+		return;
+	}
+
+	if (quiet && _idle) {
+		for (unsigned int i = 0; i < _audio_outputs.size(); ++i) {
+			unsigned int port = _audio_outputs[i];
+
+			if (*_silent[port])
+				continue;
+
+			memset(_ports[port], 0, buffer_size * sizeof(float));
+			*_silent[port] = true;
+		}
+
+		return;
+	}
+
+	run(sample_count);
+#ifdef NODE_PROFILING
+	++_nr_runs;
+#endif
+
+	if (check_denormals)
+		find_denormals(sample_count);
+
+	/* Only look at the output once nothing else keeps us busy */
+	_idle = quiet && outputs_silent(sample_count);
+
+	for (unsigned int i = 0; i < _audio_outputs.size(); ++i)
+		*_silent[_audio_outputs[i]] = false;
+}
+
+/* process() for a plugin whose single output is a bus that others add
+ * to as well. While the plugin is going quiet it now and then renders
+ * to the side instead, so that it can still tell when it has gone
+ * silent. */
+void
+plugin::process_adding(unsigned int sample_count, bool quiet)
+{
+	unsigned int port = _audio_outputs[0];
+	float* bus = _ports[port];
+	bool* silent = _silent[port];
+
+	if (_clear_bus && !*silent) {
+		memset(bus, 0, buffer_size * sizeof(float));
+		*silent = true;
+	}
+
+	if (quiet && _idle)
+		return;
+
+	_idle = false;
+
+#ifdef NODE_PROFILING
+	++_nr_runs;
+#endif
+
+	if (!quiet || _probe > 0) {
+		run_adding(sample_count, *_adding_gain);
+		*silent = false;
+
+		_probe = quiet ? _probe - 1 : 0;
+		return;
+	}
+
+	_probe = adding_probe_interval - 1;
+
+	connect(port, _scratch);
+	run(sample_count);
+	_idle = outputs_silent(sample_count);
+	connect(port, bus);
+
+	mix_add(bus, _scratch, *_adding_gain, sample_count);
+	*silent = false;
+}
+
 #endif
@@ -0,0 +1,482 @@
+#ifndef POLY_PLUGIN_HH
+#define POLY_PLUGIN_HH
+
+#include <vector>
+
+extern "C" {
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+}
+
+#include "event.hh"
+#include "note_cache.hh"
+#include "plugin.hh"
+
+/* A polyphonic instrument made from a fixed pool of monophonic plugin
+ * instances. It listens to a sequencer's all_notes stream and assigns
+ * each note on to a voice when it is played, stealing one if the pool
+ * is exhausted. A voice goes back to the pool once its release has
+ * died away. The voices are not part of the graph; their outputs are
+ * summed into our single output port.
+ *
+ * With a note cache, notes whose duration the sequencer knows are
+ * recorded as a free voice plays them, and played back from the cache
+ * the next time they come up, without taking a voice. That is only
+ * done for voices that are marked _deterministic, and assumes that all
+ * the voices are set up alike. */
+class poly_plugin:
+	public plugin
+{
+public:
+	enum steal_policy {
+		STEAL_OLDEST,
+		STEAL_QUIETEST,
+	};
+
+	typedef std::vector<plugin*> plugin_vector;
+
+public:
+	poly_plugin(const plugin_vector& voices,
+		unsigned int gate_port, unsigned int frequency_port,
+		unsigned int velocity_port, unsigned int output_port,
+		steal_policy policy);
+	~poly_plugin();
+
+public:
+	void activate();
+	void deactivate();
+
+	bool is_audio_output(unsigned int port);
+
+	void set_cache(note_cache* cache);
+
+	void run(unsigned int sample_count);
+
+private:
+	enum voice_state {
+		VOICE_FREE,
+		VOICE_PLAYING,
+		VOICE_RELEASING,
+	};
+
+	struct voice {
+		plugin* p;
+		voice_state state;
+
+		uint8_t channel;
+		uint8_t note;
+
+		/* When the current note started, in samples */
+		unsigned long started;
+
+		/* Peak of the last block the voice rendered */
+		float peak;
+
+		/* The cache entry the note is being recorded to, or -1, and
+		 * where in the block it started */
+		int recording;
+		unsigned int record_from;
+	};
+
+	/* A note coming out of the cache */
+	struct playback {
+		note_cache::cursor c;
+		unsigned int offset;
+	};
+
+	typedef std::vector<voice> voice_vector;
+	typedef std::vector<playback> playback_vector;
+
+	/* Notes beyond this are rendered even if they are cached */
+	static const unsigned int max_playbacks = 256;
+
+private:
+	unsigned int allocate();
+	bool make_key(const event& e, note_cache::key* k);
+	void stop_cache();
+	void queue(voice& v, unsigned int offset,
+		enum event_type type, unsigned int port, float value);
+	void note_on(const event& e);
+	void note_off(const event& e);
+
+private:
+	voice_vector _voices;
+
+	unsigned int _gate_port;
+	unsigned int _frequency_port;
+	unsigned int _velocity_port;
+	unsigned int _output_port;
+
+	steal_policy _policy;
+
+	/* Samples rendered so far */
+	unsigned long _time;
+
+	/* Where each voice renders before it is added to the output */
+	float* _scratch;
+	float* _discard;
+
+	unsigned int _nr_stolen;
+
+	note_cache* _cache;
+	playback_vector _playbacks;
+
+	/* Notes that couldn't go through the cache */
+	unsigned long _nr_uncached;
+};
+
+poly_plugin::poly_plugin(const plugin_vector& voices,
+	unsigned int gate_port, unsigned int frequency_port,
+	unsigned int velocity_port, unsigned int output_port,
+	steal_policy policy):
+	_gate_port(gate_port),
+	_frequency_port(frequency_port),
+	_velocity_port(velocity_port),
+	_output_port(output_port),
+	_policy(policy),
+	_time(0),
+	_nr_stolen(0),
+	_cache(0),
+	_nr_uncached(0)
+{
+	assert(!voices.empty());
+
+	_bypass = true;
+
+	_nr_ports = 1;
+	_ports = new float*[1];
+
+	/* Bound by the graph */
+	_ports[0] = 0;
+
+	_scratch = new float[buffer_size]();
+	_discard = new float[buffer_size]();
+
+	for (unsigned int i = 0; i < voices.size(); ++i) {
+		voice v;
+		v.p = voices[i];
+		v.state = VOICE_FREE;
+		v.channel = 0;
+		v.note = 0;
+		v.started = 0;
+		v.peak = 0;
+		v.recording = -1;
+		v.record_from = 0;
+		_voices.push_back(v);
+
+		/* The voices are run by us, never by the graph */
+		plugin* p = v.p;
+		p->setup_ports();
+
+		for (unsigned int port = 0; port < p->_nr_ports; ++port) {
+			if (p->is_audio_input(port))
+				p->connect(port, silence_buffer);
+			else if (port == output_port)
+				p->connect(port, _scratch);
+			else if (p->is_audio_output(port))
+				p->connect(port, _discard);
+		}
+
+		p->_ports[gate_port][0] = 0;
+	}
+
+	_playbacks.reserve(max_playbacks);
+}
+
+poly_plugin::~poly_plugin()
+{
+	for (unsigned int i = 0; i < _voices.size(); ++i)
+		delete _voices[i].p;
+
+	delete[] _scratch;
+	delete[] _discard;
+	delete[] _ports;
+}
+
+void
+poly_plugin::activate()
+{
+	for (unsigned int i = 0; i < _voices.size(); ++i)
+		_voices[i].p->activate();
+}
+
+void
+poly_plugin::deactivate()
+{
+	for (unsigned int i = 0; i < _voices.size(); ++i)
+		_voices[i].p->deactivate();
+
+	if (_nr_stolen)
+		printf("poly: %u voices stolen\n", _nr_stolen);
+
+	if (_cache) {
+		stop_cache();
+
+		_cache->print_stats();
+		printf("note cache: %lu notes not cacheable\n", _nr_uncached);
+	}
+}
+
+/* Must be called before the plugin is added to a graph; the cache is
+ * not owned by the plugin, but must not be shared with another */
+void
+poly_plugin::set_cache(note_cache* cache)
+{
+	_cache = cache;
+}
+
+/* Drop the recordings in progress and the notes being played back */
+void
+poly_plugin::stop_cache()
+{
+	for (unsigned int i = 0; i < _voices.size(); ++i) {
+		voice& v = _voices[i];
+
+		if (v.recording != -1)
+			_cache->abort(v.recording);
+		v.recording = -1;
+	}
+
+	for (unsigned int i = 0; i < _playbacks.size(); ++i)
+		_cache->close(&_playbacks[i].c);
+	_playbacks.clear();
+}
+
+bool
+poly_plugin::is_audio_output(unsigned int port)
+{
+	return port == 0;
+}
+
+/* Pick a voice for a new note: a free one if there is one, otherwise
+ * preferably one that is already releasing, chosen by _policy. */
+unsigned int
+poly_plugin::allocate()
+{
+	for (unsigned int i = 0; i < _voices.size(); ++i) {
+		if (_voices[i].state == VOICE_FREE)
+			return i;
+	}
+
+	++_nr_stolen;
+
+	unsigned int best = 0;
+	for (unsigned int i = 1; i < _voices.size(); ++i) {
+		const voice& v = _voices[i];
+		const voice& b = _voices[best];
+
+		if (v.state != b.state) {
+			if (v.state == VOICE_RELEASING)
+				best = i;
+			continue;
+		}
+
+		switch (_policy) {
+		case STEAL_OLDEST:
+			if (v.started < b.started)
+				best = i;
+			break;
+		case STEAL_QUIETEST:
+			if (v.peak < b.peak)
+				best = i;
+			break;
+		}
+	}
+
+	return best;
+}
+
+void
+poly_plugin::queue(voice& v, unsigned int offset,
+	enum event_type type, unsigned int port, float value)
+{
+	event e;
+	e.offset = offset;
+	e.voice = &v - &_voices[0];
+	e.type = type;
+	e.value = value;
+	e.channel = v.channel;
+	e.note = v.note;
+	e.velocity = 0;
+	e.duration = 0;
+	e.port = &v.p->_ports[port][0];
+
+	v.p->_events.push_back(e);
+}
+
+/* A note is identified by everything that goes into the voice: the
+ * note itself, how long it is held, and the rest of the control ports */
+bool
+poly_plugin::make_key(const event& e, note_cache::key* k)
+{
+	plugin* p = _voices[0].p;
+
+	if (!e.duration || !p->_deterministic) {
+		++_nr_uncached;
+		return false;
+	}
+
+	k->note = e.note;
+	k->velocity = e.velocity;
+	k->frequency = e.value;
+	k->duration = e.duration;
+
+	/* FNV-1a */
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned int port = 0; port < p->_nr_ports; ++port) {
+		if (p->is_audio_input(port) || p->is_audio_output(port))
+			continue;
+		if (port == _gate_port || port == _frequency_port
+			|| port == _velocity_port)
+		{
+			continue;
+		}
+
+		uint32_t bits;
+		memcpy(&bits, p->_ports[port], sizeof(bits));
+
+		h ^= bits;
+		h *= 1099511628211ULL;
+	}
+
+	k->params = h;
+	return true;
+}
+
+void
+poly_plugin::note_on(const event& e)
+{
+	note_cache::key k;
+	bool cacheable = _cache && make_key(e, &k);
+
+	if (cacheable && _playbacks.size() < max_playbacks) {
+		playback pb;
+		pb.offset = e.offset;
+
+		if (_cache->lookup(k, &pb.c)) {
+			_playbacks.push_back(pb);
+			return;
+		}
+	}
+
+	voice& v = _voices[allocate()];
+
+	if (v.recording != -1) {
+		_cache->abort(v.recording);
+		v.recording = -1;
+	}
+
+	/* Only a voice that has died away starts from a clean slate */
+	if (cacheable && v.state == VOICE_FREE) {
+		v.recording = _cache->record(k);
+		v.record_from = e.offset;
+	}
+
+	v.state = VOICE_PLAYING;
+	v.channel = e.channel;
+	v.note = e.note;
+	v.started = _time + e.offset;
+
+	queue(v, e.offset, EVENT_FREQUENCY, _frequency_port, e.value);
+	queue(v, e.offset, EVENT_VELOCITY, _velocity_port, e.velocity / 127.);
+	queue(v, e.offset, EVENT_GATE, _gate_port, 1);
+}
+
+void
+poly_plugin::note_off(const event& e)
+{
+	for (unsigned int i = 0; i < _voices.size(); ++i) {
+		voice& v = _voices[i];
+
+		if (v.state != VOICE_PLAYING)
+			continue;
+		if (v.channel != e.channel || v.note != e.note)
+			continue;
+
+		v.state = VOICE_RELEASING;
+		queue(v, e.offset, EVENT_GATE, _gate_port, 0);
+		return;
+	}
+
+	/* The note was stolen before it ended */
+}
+
+void
+poly_plugin::run(unsigned int sample_count)
+{
+	for (unsigned int i = 0; i < _voices.size(); ++i)
+		_voices[i].p->_events.clear();
+
+	for (unsigned int i = 0, n = _events.size(); i < n; ++i) {
+		const event& e = _events[i];
+
+		if (e.type == EVENT_NOTE_ON)
+			note_on(e);
+		else if (e.type == EVENT_NOTE_OFF)
+			note_off(e);
+	}
+
+	float* out = _ports[0];
+	memset(out, 0, sample_count * sizeof(float));
+
+	for (unsigned int i = 0; i < _voices.size(); ++i) {
+		voice& v = _voices[i];
+
+		if (v.state == VOICE_FREE)
+			continue;
+
+		v.p->run(sample_count);
+
+		float peak = 0;
+		for (unsigned int j = 0; j < sample_count; ++j) {
+			out[j] += _scratch[j];
+
+			float a = fabsf(_scratch[j]);
+			if (a > peak)
+				peak = a;
+		}
+
+		v.peak = peak;
+
+		if (v.recording != -1) {
+			unsigned int from = v.record_from;
+			v.record_from = 0;
+
+			if (!_cache->append(v.recording, _scratch + from,
+				sample_count - from))
+			{
+				v.recording = -1;
+			}
+		}
+
+		if (v.state == VOICE_RELEASING && peak < silence_threshold) {
+			v.state = VOICE_FREE;
+
+			if (v.recording != -1) {
+				_cache->finish(v.recording);
+				v.recording = -1;
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < _playbacks.size(); ) {
+		playback& pb = _playbacks[i];
+
+		_cache->mix(&pb.c, out + pb.offset, sample_count - pb.offset);
+		pb.offset = 0;
+
+		if (pb.c.left) {
+			++i;
+			continue;
+		}
+
+		_cache->close(&pb.c);
+		pb = _playbacks.back();
+		_playbacks.pop_back();
+	}
+
+	_time += sample_count;
+}
+
+#endif
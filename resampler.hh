@@ -0,0 +1,307 @@
+#ifndef RESAMPLER_HH
+#define RESAMPLER_HH
+
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+}
+
+/* Polyphase sample rate converter for a rational ratio L/M (the rates
+ * divided by their greatest common divisor).
+ *
+ * Conceptually the input is upsampled by L by inserting zeros, low-pass
+ * filtered with a Kaiser-windowed sinc and decimated by M. Only the
+ * taps that land on real input samples are computed: each output
+ * sample is a dot product of the last T inputs with one of L phases of
+ * the filter, stored reversed so that both run forwards in memory. */
+class resampler {
+public:
+	enum quality {
+		QUALITY_FAST,
+		QUALITY_MEDIUM,
+		QUALITY_BEST,
+	};
+
+public:
+	resampler(unsigned int channels, unsigned long in_rate,
+		unsigned long out_rate, quality q, unsigned int max_input);
+	~resampler();
+
+public:
+	unsigned int max_output(unsigned int n);
+	double latency();
+
+	void reset();
+	unsigned int run(const float* const* in, unsigned int n,
+		float* const* out);
+
+	static bool parse_quality(const char* s, quality* q);
+	static const char* quality_name(quality q);
+
+private:
+	void design(quality q);
+
+public:
+	unsigned int _nr_channels;
+	unsigned long _in_rate;
+	unsigned long _out_rate;
+
+	/* Upsampling and downsampling factors */
+	unsigned int _l;
+	unsigned int _m;
+
+	/* Taps per phase */
+	unsigned int _nr_taps;
+
+private:
+	unsigned int _max_input;
+
+	/* _l phases of _nr_taps coefficients each */
+	float* _coeffs;
+
+	/* Per channel: the last _nr_taps - 1 inputs, then the new ones */
+	std::vector<float*> _history;
+
+	/* Position of the next output, in input samples * _l, relative
+	 * to the start of the history */
+	unsigned long _pos;
+};
+
+/* Taps per phase, Kaiser beta, and passband edge as a fraction of the
+ * lower Nyquist frequency */
+struct resampler_preset {
+	const char* name;
+	unsigned int nr_taps;
+	double beta;
+	double rolloff;
+};
+
+static const resampler_preset resampler_presets[] = {
+	{ "fast",	16,	5.0,	0.85 },
+	{ "medium",	32,	7.0,	0.91 },
+	{ "best",	64,	9.0,	0.95 },
+};
+
+typedef float resampler_v8sf __attribute__((vector_size(32)));
+typedef float resampler_v8sf_mem
+	__attribute__((vector_size(32), may_alias, aligned(4)));
+
+/* Computes one channel's outputs for positions pos, pos + m, ... up to
+ * (but not including) end; returns how many */
+__attribute__((target_clones("avx2", "default"))) static unsigned int
+resample_channel(const float* history, const float* coeffs,
+	unsigned int nr_taps, unsigned int l, unsigned int m,
+	unsigned long pos, unsigned long end, float* out)
+{
+	unsigned int n = 0;
+
+	/* Step through the input and the phases without dividing */
+	unsigned long index = pos / l;
+	unsigned int phase = pos % l;
+	unsigned int step = m / l;
+	unsigned int step_phase = m % l;
+
+	for (; pos < end; pos += m) {
+		const float* x = history + index - (nr_taps - 1);
+		const float* c = coeffs + phase * nr_taps;
+
+		index += step;
+		phase += step_phase;
+		if (phase >= l) {
+			phase -= l;
+			++index;
+		}
+
+		resampler_v8sf a = {};
+		resampler_v8sf b = {};
+
+		for (unsigned int i = 0; i < nr_taps; i += 16) {
+			a += *(resampler_v8sf_mem*) (x + i)
+				* *(resampler_v8sf_mem*) (c + i);
+			b += *(resampler_v8sf_mem*) (x + i + 8)
+				* *(resampler_v8sf_mem*) (c + i + 8);
+		}
+
+		a += b;
+		out[n++] = ((a[0] + a[1]) + (a[2] + a[3]))
+			+ ((a[4] + a[5]) + (a[6] + a[7]));
+	}
+
+	return n;
+}
+
+static unsigned long
+resampler_gcd(unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* Modified Bessel function of the first kind, order 0 */
+static double
+resampler_i0(double x)
+{
+	double sum = 1;
+	double term = 1;
+
+	for (unsigned int k = 1; k < 50; ++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < 1e-12 * sum)
+			break;
+	}
+
+	return sum;
+}
+
+resampler::resampler(unsigned int channels, unsigned long in_rate,
+	unsigned long out_rate, quality q, unsigned int max_input):
+	_nr_channels(channels),
+	_in_rate(in_rate),
+	_out_rate(out_rate),
+	_max_input(max_input)
+{
+	unsigned long d = resampler_gcd(in_rate, out_rate);
+	_l = out_rate / d;
+	_m = in_rate / d;
+
+	/* Every phase is a separate filter, so this gets big quickly */
+	if (_l > 4096) {
+		fprintf(stderr, "can't resample from %lu to %lu Hz\n",
+			in_rate, out_rate);
+		exit(EXIT_FAILURE);
+	}
+
+	design(q);
+
+	for (unsigned int i = 0; i < channels; ++i)
+		_history.push_back(new float[_nr_taps - 1 + max_input]);
+
+	reset();
+}
+
+resampler::~resampler()
+{
+	for (unsigned int i = 0; i < _history.size(); ++i)
+		delete[] _history[i];
+
+	delete[] _coeffs;
+}
+
+void
+resampler::design(quality q)
+{
+	const resampler_preset* p = &resampler_presets[q];
+
+	/* When downsampling, the cutoff is lower in terms of the input,
+	 * so the filter needs to be longer for the same steepness */
+	unsigned int nr_taps = p->nr_taps;
+	if (_m > _l)
+		nr_taps = (nr_taps * _m + _l - 1) / _l;
+
+	_nr_taps = (nr_taps + 15) & ~15U;
+	_coeffs = new float[_l * _nr_taps];
+
+	/* The prototype filter runs at the upsampled rate */
+	unsigned int n = _l * _nr_taps;
+	double cutoff = p->rolloff * 0.5 / (_l > _m ? _l : _m);
+	double center = (n - 1) / 2.;
+	double i0_beta = resampler_i0(p->beta);
+
+	for (unsigned int r = 0; r < _l; ++r) {
+		for (unsigned int k = 0; k < _nr_taps; ++k) {
+			unsigned int i = r + (_nr_taps - 1 - k) * _l;
+			double t = i - center;
+			double w = 2 * t / (n - 1);
+
+			double sinc = t == 0 ? 2 * cutoff
+				: sin(2 * M_PI * cutoff * t) / (M_PI * t);
+			double window = resampler_i0(p->beta
+				* sqrt(fmax(0, 1 - w * w))) / i0_beta;
+
+			/* The zeros inserted when upsampling cost a factor L */
+			_coeffs[r * _nr_taps + k] = _l * sinc * window;
+		}
+	}
+}
+
+/* Most output frames that run() can produce from n input frames */
+unsigned int
+resampler::max_output(unsigned int n)
+{
+	return ((unsigned long) n * _l + _m - 1) / _m + 1;
+}
+
+/* Group delay, in output frames */
+double
+resampler::latency()
+{
+	return (_l * _nr_taps - 1) / (2. * _m);
+}
+
+void
+resampler::reset()
+{
+	for (unsigned int i = 0; i < _history.size(); ++i)
+		memset(_history[i], 0, (_nr_taps - 1) * sizeof(float));
+
+	_pos = (unsigned long) (_nr_taps - 1) * _l;
+}
+
+/* Converts n frames of each channel; returns the number of frames
+ * written to each of out[], at most max_output(n) */
+unsigned int
+resampler::run(const float* const* in, unsigned int n, float* const* out)
+{
+	assert(n <= _max_input);
+
+	unsigned int keep = _nr_taps - 1;
+	unsigned long end = (unsigned long) (keep + n) * _l;
+	unsigned int nr_out = 0;
+
+	for (unsigned int i = 0; i < _nr_channels; ++i) {
+		float* h = _history[i];
+
+		memcpy(h + keep, in[i], n * sizeof(float));
+		nr_out = resample_channel(h, _coeffs, _nr_taps, _l, _m,
+			_pos, end, out[i]);
+		memmove(h, h + n, keep * sizeof(float));
+	}
+
+	/* Advance past the outputs and shift out the consumed inputs */
+	_pos += (unsigned long) nr_out * _m - (unsigned long) n * _l;
+	return nr_out;
+}
+
+bool
+resampler::parse_quality(const char* s, quality* q)
+{
+	for (unsigned int i = 0; i < sizeof(resampler_presets)
+		/ sizeof(*resampler_presets); ++i)
+	{
+		if (!strcmp(s, resampler_presets[i].name)) {
+			*q = (quality) i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char*
+resampler::quality_name(quality q)
+{
+	return resampler_presets[q].name;
+}
+
+#endif
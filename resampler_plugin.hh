@@ -0,0 +1,200 @@
+#ifndef RESAMPLER_PLUGIN_HH
+#define RESAMPLER_PLUGIN_HH
+
+#include <vector>
+
+extern "C" {
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+}
+
+#include "plugin.hh"
+#include "resampler.hh"
+
+/* Runs another plugin at a different sample rate. It has the same ports
+ * as the plugin it wraps: audio inputs are converted to the plugin's
+ * rate and its audio outputs back to the engine's, and control ports
+ * are shared.
+ *
+ * Put in front of an output device that doesn't run at the engine's
+ * rate, or around a plugin (that was set up for the higher rate) to
+ * oversample it. Plugins with audio outputs need a rate that is a
+ * multiple of the engine's, so that every block comes back the same
+ * length. The wrapped plugin runs in blocks of at most buffer_size and
+ * is owned by the wrapper. */
+class resampler_plugin:
+	public plugin
+{
+public:
+	resampler_plugin(plugin* p, unsigned long rate,
+		resampler::quality q);
+	~resampler_plugin();
+
+public:
+	void activate();
+	void deactivate();
+
+	bool is_audio_input(unsigned int port);
+	bool is_audio_output(unsigned int port);
+
+	unsigned int latency();
+
+	void run(unsigned int sample_count);
+
+public:
+	plugin* _plugin;
+	unsigned long _rate;
+
+private:
+	resampler* _up;
+	resampler* _down;
+
+	/* The wrapped plugin's audio ports, at its own rate */
+	std::vector<float*> _in;
+	std::vector<float*> _out;
+
+	/* Engine-rate port buffers, as seen by _up and _down */
+	std::vector<float*> _up_in;
+	std::vector<float*> _down_out;
+};
+
+resampler_plugin::resampler_plugin(plugin* p, unsigned long rate,
+	resampler::quality q):
+	_plugin(p),
+	_rate(rate),
+	_down(0)
+{
+	p->setup_ports();
+
+	_nr_ports = p->_nr_ports;
+	_ports = new float*[_nr_ports];
+	for (unsigned int i = 0; i < _nr_ports; ++i)
+		_ports[i] = p->_ports[i];
+
+	unsigned int nr_inputs = p->_audio_inputs.size();
+	unsigned int nr_outputs = p->_audio_outputs.size();
+
+	_up = new resampler(nr_inputs, sample_rate, rate, q, buffer_size);
+	unsigned int size = _up->max_output(buffer_size);
+
+	for (unsigned int i = 0; i < nr_inputs; ++i) {
+		_in.push_back(new float[size]);
+		_ports[p->_audio_inputs[i]] = silence_buffer;
+	}
+
+	_up_in.resize(nr_inputs);
+
+	if (nr_outputs) {
+		if (rate % sample_rate) {
+			fprintf(stderr, "can't oversample by %lu/%lu\n",
+				rate, sample_rate);
+			exit(EXIT_FAILURE);
+		}
+
+		_down = new resampler(nr_outputs, rate, sample_rate, q, size);
+
+		for (unsigned int i = 0; i < nr_outputs; ++i) {
+			_out.push_back(new float[size]);
+			_ports[p->_audio_outputs[i]] = 0;
+		}
+
+		_down_out.resize(nr_outputs);
+	}
+}
+
+resampler_plugin::~resampler_plugin()
+{
+	for (unsigned int i = 0; i < _in.size(); ++i)
+		delete[] _in[i];
+	for (unsigned int i = 0; i < _out.size(); ++i)
+		delete[] _out[i];
+
+	delete _up;
+	delete _down;
+
+	delete[] _ports;
+	delete _plugin;
+}
+
+void
+resampler_plugin::activate()
+{
+	_up->reset();
+	if (_down)
+		_down->reset();
+
+	_plugin->activate();
+}
+
+void
+resampler_plugin::deactivate()
+{
+	_plugin->deactivate();
+}
+
+bool
+resampler_plugin::is_audio_input(unsigned int port)
+{
+	return _plugin->is_audio_input(port);
+}
+
+bool
+resampler_plugin::is_audio_output(unsigned int port)
+{
+	return _plugin->is_audio_output(port);
+}
+
+/* The filters' delay plus the plugin's own, in engine frames */
+unsigned int
+resampler_plugin::latency()
+{
+	double frames = _up->latency() + _plugin->latency();
+	if (_down)
+		frames += _down->latency() * _rate / sample_rate;
+
+	return frames * sample_rate / _rate + 0.5;
+}
+
+void
+resampler_plugin::run(unsigned int sample_count)
+{
+	const std::vector<unsigned int>& inputs = _plugin->_audio_inputs;
+	const std::vector<unsigned int>& outputs = _plugin->_audio_outputs;
+
+	for (unsigned int i = 0; i < inputs.size(); ++i) {
+		_up_in[i] = _ports[inputs[i]];
+		_plugin->_silent[inputs[i]] = _silent[inputs[i]];
+	}
+
+	unsigned int n;
+	if (inputs.size()) {
+		n = _up->run(&_up_in[0], sample_count, &_in[0]);
+	} else {
+		n = (unsigned long) sample_count * _rate / sample_rate;
+	}
+
+	for (unsigned int done = 0; done < n; ) {
+		unsigned int count = n - done;
+		if (count > buffer_size)
+			count = buffer_size;
+
+		for (unsigned int i = 0; i < inputs.size(); ++i)
+			_plugin->connect(inputs[i], _in[i] + done);
+		for (unsigned int i = 0; i < outputs.size(); ++i)
+			_plugin->connect(outputs[i], _out[i] + done);
+
+		_plugin->run(count);
+		done += count;
+	}
+
+	if (_down) {
+		for (unsigned int i = 0; i < outputs.size(); ++i)
+			_down_out[i] = _ports[outputs[i]];
+
+		unsigned int m = _down->run(&_out[0], n, &_down_out[0]);
+		assert(m == sample_count);
+	}
+}
+
+#endif
@@ -0,0 +1,681 @@
+#ifndef SAMPLER_PLUGIN_HH
+#define SAMPLER_PLUGIN_HH
+
+#include <vector>
+
+extern "C" {
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+}
+
+#include "event.hh"
+#include "plugin.hh"
+
+/* A polyphonic sample player that listens to a sequencer's all_notes
+ * stream, like organ_plugin. Each sample covers a range of notes and is
+ * pitched from its root note.
+ *
+ * Samples are WAV files (16-bit PCM or 32-bit float, mono or stereo,
+ * mixed down to mono) that are mmap'd rather than loaded. Only the
+ * first _attack seconds of each are converted and kept in memory, so
+ * that a note can start right away; the rest is played straight out of
+ * the mapping. A prefetch thread, woken every block, touches the pages
+ * each voice is going to need next, up to _read_ahead seconds ahead,
+ * so that the audio thread doesn't take the page faults. A voice that
+ * gets ahead of it anyway is counted as late (and reads the pages
+ * itself).
+ *
+ * Port 0 is the output, 1 the level and 2 the release time in seconds. */
+class sampler_plugin:
+	public plugin
+{
+public:
+	sampler_plugin(unsigned int voices, float attack = 0.5,
+		float read_ahead = 1);
+	~sampler_plugin();
+
+public:
+	void add_sample(const char* filename, uint8_t root,
+		uint8_t low, uint8_t high);
+
+	void activate();
+	void deactivate();
+
+	bool is_audio_output(unsigned int port);
+
+	bool busy();
+
+	void run(unsigned int sample_count);
+
+public:
+	/* Pages found not to be in the page cache when prefetched */
+	unsigned long _nr_page_misses;
+	unsigned long _nr_pages_prefetched;
+
+	/* Blocks in which a voice needed pages that weren't prefetched */
+	unsigned long _nr_late;
+
+private:
+	struct sample {
+		uint8_t root;
+		uint8_t low;
+		uint8_t high;
+
+		/* Frames per second of the file, and in total */
+		unsigned long rate;
+		unsigned long nr_frames;
+
+		/* The mapping, and the frames in it */
+		void* map;
+		size_t map_size;
+		const uint8_t* data;
+		unsigned int channels;
+		unsigned int frame_bytes;
+		bool is_float;
+
+		/* The first nr_attack frames, converted */
+		float* attack;
+		unsigned long nr_attack;
+	};
+
+	enum voice_state {
+		VOICE_FREE,
+		VOICE_PLAYING,
+		VOICE_RELEASING,
+	};
+
+	struct voice {
+		voice_state state;
+
+		uint8_t channel;
+		uint8_t note;
+		unsigned long started;
+
+		const sample* s;
+		double pos;
+		double step;
+		float gain;
+
+		/* Ramps from 1 to 0 when released */
+		float release;
+	};
+
+	/* What the prefetch thread knows about a voice. The audio thread
+	 * bumps generation whenever the voice starts a new note; ready is
+	 * the frame up to which the pages of the sample are resident, with
+	 * the generation it was for in the top bits. */
+	struct stream {
+		unsigned long generation;
+		unsigned int sample;
+		unsigned long pos;
+		bool active;
+
+		uint64_t ready;
+	};
+
+	typedef std::vector<sample> sample_vector;
+	typedef std::vector<voice> voice_vector;
+
+	static const unsigned int ready_shift = 40;
+
+private:
+	float frame(const sample& s, unsigned long i);
+	bool is_ready(unsigned int i, unsigned long end);
+
+	unsigned int allocate();
+	void note_on(const event& e);
+	void note_off(const event& e);
+	void render(unsigned int offset, unsigned int n);
+
+	void prefetch(unsigned int i);
+	static void* prefetch_thread(void* arg);
+
+private:
+	float _attack;
+	float _read_ahead;
+
+	sample_vector _samples;
+
+	/* The sample for each note, or -1 */
+	int _note_samples[128];
+
+	unsigned int _nr_voices;
+	voice_vector _voices;
+	stream* _streams;
+
+	unsigned long _time;
+	unsigned int _nr_stolen;
+
+	long _page_size;
+
+	pthread_t _thread;
+	sem_t _wakeup;
+	bool _exit;
+};
+
+sampler_plugin::sampler_plugin(unsigned int voices, float attack,
+	float read_ahead):
+	_nr_page_misses(0),
+	_nr_pages_prefetched(0),
+	_nr_late(0),
+	_attack(attack),
+	_read_ahead(read_ahead),
+	_nr_voices(voices),
+	_time(0),
+	_nr_stolen(0)
+{
+	assert(voices > 0);
+
+	_bypass = true;
+
+	for (unsigned int i = 0; i < 128; ++i)
+		_note_samples[i] = -1;
+
+	voice v;
+	memset(&v, 0, sizeof(v));
+	v.state = VOICE_FREE;
+	_voices.assign(voices, v);
+
+	_streams = new stream[voices];
+	memset(_streams, 0, voices * sizeof(*_streams));
+
+	_page_size = sysconf(_SC_PAGESIZE);
+
+	_nr_ports = 3;
+	_ports = new float*[3];
+
+	/* Bound by the graph */
+	_ports[0] = 0;
+
+	_ports[1] = new float[1];	/* Level */
+	_ports[1][0] = 1;
+	_ports[2] = new float[1];	/* Release */
+	_ports[2][0] = 0.1;
+}
+
+sampler_plugin::~sampler_plugin()
+{
+	for (unsigned int i = 0; i < _samples.size(); ++i) {
+		sample& s = _samples[i];
+
+		delete[] s.attack;
+		munmap(s.map, s.map_size);
+	}
+
+	delete[] _streams;
+
+	delete[] _ports[1];
+	delete[] _ports[2];
+	delete[] _ports;
+}
+
+static uint32_t
+read_le32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint16_t
+read_le16(const uint8_t* p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/* Maps the file and finds the frames in it; must be called before the
+ * plugin is activated */
+void
+sampler_plugin::add_sample(const char* filename, uint8_t root,
+	uint8_t low, uint8_t high)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	const uint8_t* p = (const uint8_t*) map;
+	size_t size = st.st_size;
+
+	if (size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4)) {
+		fprintf(stderr, "%s: not a WAV file\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	sample s;
+	memset(&s, 0, sizeof(s));
+	s.root = root;
+	s.low = low;
+	s.high = high;
+	s.map = map;
+	s.map_size = size;
+
+	unsigned int format = 0;
+	unsigned int bits = 0;
+
+	for (size_t off = 12; off + 8 <= size; ) {
+		const uint8_t* chunk = p + off;
+		size_t chunk_size = read_le32(chunk + 4);
+
+		if (!memcmp(chunk, "fmt ", 4) && chunk_size >= 16) {
+			format = read_le16(chunk + 8);
+			s.channels = read_le16(chunk + 10);
+			s.rate = read_le32(chunk + 12);
+			bits = read_le16(chunk + 22);
+
+			/* WAVE_FORMAT_EXTENSIBLE; the real format is in the
+			 * sub-format GUID */
+			if (format == 0xfffe && chunk_size >= 40)
+				format = read_le16(chunk + 32);
+		} else if (!memcmp(chunk, "data", 4)) {
+			s.data = chunk + 8;
+			if (chunk_size > size - off - 8)
+				chunk_size = size - off - 8;
+			s.nr_frames = chunk_size;
+			break;
+		}
+
+		off += 8 + chunk_size + (chunk_size & 1);
+	}
+
+	if (!((format == 1 && bits == 16) || (format == 3 && bits == 32))
+		|| s.channels < 1 || s.channels > 2 || !s.data)
+	{
+		fprintf(stderr, "%s: only 16-bit PCM and 32-bit float, mono "
+			"or stereo, are supported\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	s.is_float = format == 3;
+	s.frame_bytes = s.channels * bits / 8;
+	s.nr_frames /= s.frame_bytes;
+
+	s.nr_attack = _attack * s.rate;
+	if (s.nr_attack > s.nr_frames)
+		s.nr_attack = s.nr_frames;
+
+	/* Keep the start resident; after the copy, the kernel can drop
+	 * those pages again */
+	float* attack = new float[s.nr_attack];
+	for (unsigned long i = 0; i < s.nr_attack; ++i)
+		attack[i] = frame(s, i);
+	s.attack = attack;
+
+	for (unsigned int note = low; note <= high && note < 128; ++note)
+		_note_samples[note] = _samples.size();
+
+	_samples.push_back(s);
+}
+
+/* Frame i of the sample, from memory or from the mapping */
+float
+sampler_plugin::frame(const sample& s, unsigned long i)
+{
+	if (s.attack && i < s.nr_attack)
+		return s.attack[i];
+	if (i >= s.nr_frames)
+		return 0;
+
+	const uint8_t* p = s.data + i * s.frame_bytes;
+	float sum = 0;
+
+	for (unsigned int c = 0; c < s.channels; ++c) {
+		if (s.is_float) {
+			float f;
+			memcpy(&f, p + 4 * c, sizeof(f));
+			sum += f;
+		} else {
+			int16_t x;
+			memcpy(&x, p + 2 * c, sizeof(x));
+			sum += x * (1.f / 32768);
+		}
+	}
+
+	return s.channels == 1 ? sum : 0.5f * sum;
+}
+
+void
+sampler_plugin::activate()
+{
+	_exit = false;
+
+	if (sem_init(&_wakeup, 0, 0) == -1)
+		exit(1);
+
+	if (pthread_create(&_thread, NULL, &prefetch_thread, (void*) this))
+		exit(1);
+}
+
+void
+sampler_plugin::deactivate()
+{
+	__atomic_store_n(&_exit, true, __ATOMIC_SEQ_CST);
+	sem_post(&_wakeup);
+
+	pthread_join(_thread, NULL);
+	sem_destroy(&_wakeup);
+
+	if (_nr_stolen)
+		printf("sampler: %u voices stolen\n", _nr_stolen);
+
+	printf("sampler: %lu pages prefetched, %lu page cache misses, "
+		"%lu late blocks\n",
+		_nr_pages_prefetched, _nr_page_misses, _nr_late);
+}
+
+bool
+sampler_plugin::is_audio_output(unsigned int port)
+{
+	return port == 0;
+}
+
+/* A sample may well be silent for a block or more in the middle, so
+ * only bypass the sampler once every voice has finished */
+bool
+sampler_plugin::busy()
+{
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		if (_voices[i].state != VOICE_FREE)
+			return true;
+	}
+
+	return false;
+}
+
+/* Touch the pages voice i needs next, if it still needs them */
+void
+sampler_plugin::prefetch(unsigned int i)
+{
+	stream* st = &_streams[i];
+
+	unsigned long generation = __atomic_load_n(&st->generation,
+		__ATOMIC_ACQUIRE);
+	if (!__atomic_load_n(&st->active, __ATOMIC_RELAXED))
+		return;
+
+	const sample& s = _samples[__atomic_load_n(&st->sample,
+		__ATOMIC_RELAXED)];
+	unsigned long pos = __atomic_load_n(&st->pos, __ATOMIC_RELAXED);
+
+	uint64_t ready = __atomic_load_n(&st->ready, __ATOMIC_ACQUIRE);
+	uint64_t tag = (uint64_t) generation << ready_shift;
+	uint64_t mask = ((uint64_t) 1 << ready_shift) - 1;
+
+	unsigned long from = s.nr_attack;
+	if ((ready & ~mask) == tag && (ready & mask) > from)
+		from = ready & mask;
+
+	unsigned long to = pos + (unsigned long) (_read_ahead * s.rate);
+	if (to > s.nr_frames)
+		to = s.nr_frames;
+	if (from >= to)
+		return;
+
+	/* Whole pages, so that the ends of the range are covered too */
+	uintptr_t start = (uintptr_t) (s.data + from * s.frame_bytes)
+		& ~(uintptr_t) (_page_size - 1);
+	uintptr_t end = (uintptr_t) (s.data + to * s.frame_bytes);
+	unsigned long nr_pages = (end - start + _page_size - 1) / _page_size;
+
+	unsigned char vec[256];
+	for (unsigned long j = 0; j < nr_pages; j += sizeof(vec)) {
+		unsigned long n = nr_pages - j;
+		if (n > sizeof(vec))
+			n = sizeof(vec);
+
+		void* addr = (void*) (start + j * _page_size);
+		if (mincore(addr, n * _page_size, vec) == 0) {
+			for (unsigned long k = 0; k < n; ++k) {
+				if (!(vec[k] & 1))
+					++_nr_page_misses;
+			}
+		}
+
+		/* Ask for the lot at once, then fault each page in */
+		madvise(addr, n * _page_size, MADV_WILLNEED);
+		for (unsigned long k = 0; k < n; ++k) {
+			volatile const uint8_t* page = (const uint8_t*) addr
+				+ k * _page_size;
+			(void) *page;
+		}
+	}
+
+	_nr_pages_prefetched += nr_pages;
+
+	/* The voice may have moved on to another note in the meantime */
+	if (__atomic_load_n(&st->generation, __ATOMIC_ACQUIRE) == generation)
+		__atomic_store_n(&st->ready, tag | to, __ATOMIC_RELEASE);
+}
+
+void*
+sampler_plugin::prefetch_thread(void* arg)
+{
+	sampler_plugin* p = (sampler_plugin*) arg;
+
+	while (true) {
+		while (sem_wait(&p->_wakeup) == -1)
+			assert(errno == EINTR);
+
+		if (__atomic_load_n(&p->_exit, __ATOMIC_SEQ_CST))
+			break;
+
+		for (unsigned int i = 0; i < p->_nr_voices; ++i)
+			p->prefetch(i);
+	}
+
+	return NULL;
+}
+
+/* Whether the prefetch thread has made frames up to end resident for
+ * voice i */
+bool
+sampler_plugin::is_ready(unsigned int i, unsigned long end)
+{
+	const voice& v = _voices[i];
+	if (end <= v.s->nr_attack)
+		return true;
+	if (end > v.s->nr_frames)
+		end = v.s->nr_frames;
+
+	uint64_t ready = __atomic_load_n(&_streams[i].ready, __ATOMIC_ACQUIRE);
+	uint64_t tag = (uint64_t) _streams[i].generation << ready_shift;
+	uint64_t mask = ((uint64_t) 1 << ready_shift) - 1;
+
+	return (ready & ~mask) == tag && (ready & mask) >= end;
+}
+
+unsigned int
+sampler_plugin::allocate()
+{
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		if (_voices[i].state == VOICE_FREE)
+			return i;
+	}
+
+	++_nr_stolen;
+
+	unsigned int best = 0;
+	for (unsigned int i = 1; i < _nr_voices; ++i) {
+		const voice& v = _voices[i];
+		const voice& b = _voices[best];
+
+		if (v.state != b.state) {
+			if (v.state == VOICE_RELEASING)
+				best = i;
+			continue;
+		}
+
+		if (v.started < b.started)
+			best = i;
+	}
+
+	return best;
+}
+
+void
+sampler_plugin::note_on(const event& e)
+{
+	int k = _note_samples[e.note & 0x7f];
+	if (k == -1)
+		return;
+
+	unsigned int i = allocate();
+	voice& v = _voices[i];
+	const sample& s = _samples[k];
+
+	v.state = VOICE_PLAYING;
+	v.channel = e.channel;
+	v.note = e.note;
+	v.started = _time + e.offset;
+
+	double root = 440. * pow(2, (s.root - 69.) / 12.);
+
+	v.s = &s;
+	v.pos = 0;
+	v.step = e.value / root * s.rate / sample_rate;
+	v.gain = e.velocity / 127.;
+	v.release = 1;
+
+	stream* st = &_streams[i];
+	__atomic_store_n(&st->active, false, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->sample, k, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->pos, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->active, true, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->generation, 1, __ATOMIC_RELEASE);
+}
+
+void
+sampler_plugin::note_off(const event& e)
+{
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		voice& v = _voices[i];
+
+		if (v.state != VOICE_PLAYING)
+			continue;
+		if (v.channel != e.channel || v.note != e.note)
+			continue;
+
+		v.state = VOICE_RELEASING;
+		return;
+	}
+
+	/* The note was stolen before it ended */
+}
+
+void
+sampler_plugin::render(unsigned int offset, unsigned int n)
+{
+	if (n == 0)
+		return;
+
+	float* out = _ports[0] + offset;
+	float level = _ports[1][0];
+
+	float release = _ports[2][0];
+	float release_step = release > 0.001 ? 1. / (release * sample_rate) : 1;
+
+	for (unsigned int i = 0; i < _nr_voices; ++i) {
+		voice& v = _voices[i];
+		if (v.state == VOICE_FREE)
+			continue;
+
+		const sample& s = *v.s;
+
+		/* Linear interpolation reads one frame past the last */
+		unsigned long end = (unsigned long) (v.pos + n * v.step) + 2;
+		if (!is_ready(i, end))
+			++_nr_late;
+
+		double pos = v.pos;
+		float gain = level * v.gain;
+		float r = v.release;
+		bool releasing = v.state == VOICE_RELEASING;
+
+		unsigned int j;
+		for (j = 0; j < n; ++j) {
+			unsigned long k = pos;
+			if (k >= s.nr_frames || r <= 0)
+				break;
+
+			float f = pos - k;
+			float a = frame(s, k);
+			float b = frame(s, k + 1);
+
+			out[j] += gain * r * (a + (b - a) * f);
+
+			pos += v.step;
+			if (releasing)
+				r -= release_step;
+		}
+
+		v.pos = pos;
+		v.release = r;
+
+		if (j < n) {
+			v.state = VOICE_FREE;
+			__atomic_store_n(&_streams[i].active, false,
+				__ATOMIC_RELAXED);
+			continue;
+		}
+
+		__atomic_store_n(&_streams[i].pos, (unsigned long) pos,
+			__ATOMIC_RELAXED);
+	}
+}
+
+void
+sampler_plugin::run(unsigned int sample_count)
+{
+	memset(_ports[0], 0, sample_count * sizeof(float));
+
+	unsigned int offset = 0;
+	for (unsigned int i = 0, n = _events.size(); i < n; ++i) {
+		const event& e = _events[i];
+
+		if (e.type != EVENT_NOTE_ON && e.type != EVENT_NOTE_OFF)
+			continue;
+
+		render(offset, e.offset - offset);
+		offset = e.offset;
+
+		if (e.type == EVENT_NOTE_ON)
+			note_on(e);
+		else
+			note_off(e);
+	}
+
+	render(offset, sample_count - offset);
+
+	/* Let the prefetch thread catch up with where the voices are */
+	sem_post(&_wakeup);
+
+	_time += sample_count;
+}
+
+#endif
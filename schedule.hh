@@ -0,0 +1,187 @@
+#ifndef SCHEDULE_HH
+#define SCHEDULE_HH
+
+#include <algorithm>
+#include <vector>
+
+#include "automation.hh"
+#include "event.hh"
+#include "node_profiler.hh"
+#include "plugin.hh"
+#include "sequencer.hh"
+
+/* A graph compiled down to flat arrays: the plugins in dependency order,
+ * the buffers bound to their audio ports, and for every node the indices
+ * of the nodes that consume its output.
+ *
+ * A schedule is never modified once graph::compile() has published it;
+ * the only things written while it runs are the executor's scratch
+ * arrays at the end, which are sized up front. */
+class schedule {
+public:
+	/* One audio port of a scheduled plugin and its buffer */
+	struct binding {
+		unsigned int port;
+		float* buffer;
+		bool* silent;
+	};
+
+	struct node {
+		plugin* p;
+
+		/* _bindings[first_binding .. first_binding + nr_bindings) */
+		unsigned int first_binding;
+		unsigned int nr_bindings;
+
+		/* Number of distinct nodes this one depends on */
+		unsigned int nr_deps;
+
+		/* _successors[first_successor .. first_successor + nr_successors) */
+		unsigned int first_successor;
+		unsigned int nr_successors;
+
+		/* _sources[first_source .. first_source + nr_sources) */
+		unsigned int first_source;
+		unsigned int nr_sources;
+
+		/* For a plugin that adds into a bus; see plugin::_adding_gain */
+		const float* adding_gain;
+		bool clear_bus;
+	};
+
+	typedef std::vector<binding> binding_vector;
+	typedef std::vector<node> node_vector;
+	typedef std::vector<unsigned int> index_vector;
+	typedef std::vector<sequencer*> sequencer_vector;
+	typedef std::vector<automation_lane*> lane_vector;
+	typedef std::vector<const event_vector*> source_vector;
+
+public:
+	schedule();
+	~schedule();
+
+public:
+	void bind();
+	void transport(unsigned int sample_count);
+
+public:
+	node_vector _nodes;
+	binding_vector _bindings;
+	index_vector _successors;
+
+	/* Sequencers to advance every block, and the per-voice event
+	 * queues each node reads from */
+	sequencer_vector _sequencers;
+	source_vector _sources;
+
+	/* Automation to evaluate before the nodes run */
+	lane_vector _lanes;
+
+	/* Distinguishes this schedule from whatever run() bound last */
+	unsigned long _generation;
+
+	/* Plugins add into shared buses, in schedule order, so the nodes
+	 * must not be run in parallel */
+	bool _serial;
+
+	/* Where plugins that add into a bus render while they go quiet;
+	 * belongs to the graph */
+	float* _scratch;
+
+#ifdef NODE_PROFILING
+	/* Where the nodes' timings go, if anywhere; belongs to the graph */
+	node_profiler* _profiler;
+#endif
+
+	/* Scratch space for parallel_executor::run() */
+	index_vector _pending;
+	index_vector _queues;
+};
+
+schedule::schedule():
+	_generation(0),
+	_serial(false),
+	_scratch(0)
+#ifdef NODE_PROFILING
+	, _profiler(0)
+#endif
+{
+}
+
+schedule::~schedule()
+{
+}
+
+/* Point every port at the buffer this schedule assigned to it. Called
+ * by the audio thread before the first block it runs this schedule. */
+void
+schedule::bind()
+{
+	for (node_vector::iterator i = _nodes.begin(), end = _nodes.end();
+		i != end; ++i)
+	{
+		const node& n = *i;
+
+		/* Lanes that are still there will set theirs again */
+		std::fill(n.p->_ramps.begin(), n.p->_ramps.end(),
+			(const float*) 0);
+
+		n.p->_adding_gain = n.adding_gain;
+		n.p->_clear_bus = n.clear_bus;
+		n.p->_scratch = _scratch;
+
+		for (unsigned int j = 0; j < n.nr_bindings; ++j) {
+			const binding& b = _bindings[n.first_binding + j];
+			n.p->connect(b.port, b.buffer);
+			n.p->_silent[b.port] = b.silent;
+		}
+	}
+}
+
+/* Advance every sequencer and automation lane by one block and give
+ * each node the events of the voices it listens to. */
+void
+schedule::transport(unsigned int sample_count)
+{
+	for (unsigned int i = 0, n = _sequencers.size(); i < n; ++i)
+		_sequencers[i]->run(sample_count);
+
+	for (unsigned int i = 0, n = _lanes.size(); i < n; ++i)
+		_lanes[i]->run(sample_count);
+
+	for (node_vector::iterator i = _nodes.begin(), end = _nodes.end();
+		i != end; ++i)
+	{
+		const node& n = *i;
+		event_vector& q = n.p->_events;
+
+		if (n.nr_sources == 0 && q.empty())
+			continue;
+
+		q.clear();
+		for (unsigned int j = 0; j < n.nr_sources; ++j) {
+			const event_vector& src = *_sources[n.first_source + j];
+			q.insert(q.end(), src.begin(), src.end());
+		}
+
+		if (n.nr_sources < 2)
+			continue;
+
+		/* Each source is sorted already and there are few events per
+		 * block; a stable insertion sort keeps same-offset events in
+		 * the order their sequencer produced them. */
+		for (unsigned int j = 1; j < q.size(); ++j) {
+			event e = q[j];
+
+			unsigned int k = j;
+			while (k > 0 && q[k - 1].offset > e.offset) {
+				q[k] = q[k - 1];
+				--k;
+			}
+
+			q[k] = e;
+		}
+	}
+}
+
+#endif
@@ -1,14 +1,29 @@
 #ifndef SEQUENCER_HH
 #define SEQUENCER_HH
 
+#include "event.hh"
+
+/* Sequencers are driven by the graph: once per block, run() advances
+ * every voice by the block and queues the events that fall inside it,
+ * sorted by offset, where events() can find them.
+ *
+ * Sequencers that know about notes also have a pseudo-voice all_notes
+ * with every note on/off of the piece, for plugins that assign notes to
+ * voices themselves. */
 class sequencer {
+public:
+	static const unsigned int all_notes = ~0U;
+
 public:
 	sequencer();
 	virtual ~sequencer();
 
 public:
-	virtual unsigned int duration_remaining(unsigned int voice) = 0;
-	virtual void advance(unsigned int voice, unsigned int duration) = 0;
+	virtual void run(unsigned int sample_count) = 0;
+	virtual const event_vector& events(unsigned int voice) = 0;
+
+	/* Whether every event has been played */
+	virtual bool done() = 0;
 };
 
 sequencer::sequencer()
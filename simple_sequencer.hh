@@ -1,6 +1,9 @@
 #ifndef SIMPLE_SEQUENCER_HH
 #define SIMPLE_SEQUENCER_HH
 
+#include "event.hh"
+#include "sequencer.hh"
+
 struct note {
 	unsigned int tone;
 
@@ -24,8 +27,12 @@ public:
 	~simple_sequencer();
 
 public:
-	unsigned int duration_remaining(unsigned int voice);
-	void advance(unsigned int voice, unsigned int duration);
+	void run(unsigned int sample_count);
+	const event_vector& events(unsigned int voice);
+	bool done();
+
+private:
+	void next_note();
 
 public:
 	struct note* _notes;
@@ -34,6 +41,8 @@ public:
 	unsigned int _duration;
 
 	LADSPA_Data* _output_frequency;
+
+	event_vector _events;
 };
 
 simple_sequencer::simple_sequencer(unsigned int tempo,
@@ -45,6 +54,8 @@ simple_sequencer::simple_sequencer(unsigned int tempo,
 	_duration(0),
 	_output_frequency(output_frequency)
 {
+	_events.reserve(event_queue_reserve);
+
 	/* In 16th-notes */
 	unsigned long timestamp = 0;
 
@@ -79,38 +90,62 @@ simple_sequencer::~simple_sequencer()
 {
 }
 
-unsigned int
-simple_sequencer::duration_remaining(unsigned int voice)
+void
+simple_sequencer::next_note()
 {
-	assert(voice != 0);
+	if (++_note_i == _nr_notes - 1) {
+		static unsigned int loops = 3;
 
-	return _duration;
+		if (--loops == 0)
+			exit(0);
+
+		printf("looping...\n");
+		_note_i = 0;
+	}
+
+	_duration = _notes[_note_i + 1].timestamp
+		- _notes[_note_i].timestamp;
 }
 
 void
-simple_sequencer::advance(unsigned int voice, unsigned int duration)
+simple_sequencer::run(unsigned int sample_count)
 {
-	assert(voice != 0);
-	assert(duration <= _duration);
-	assert(duration > 0);
-
-	_duration -= duration;
-	if (_duration == 0) {
-		if (++_note_i == _nr_notes - 1) {
-			static unsigned int loops = 3;
+	_events.clear();
+
+	unsigned int offset = 0;
+	while (offset + _duration < sample_count) {
+		offset += _duration;
+		next_note();
+
+		event ev;
+		ev.offset = offset;
+		ev.voice = 0;
+		ev.type = EVENT_FREQUENCY;
+		ev.value = _notes[_note_i].frequency;
+		ev.channel = 0;
+		ev.note = _notes[_note_i].tone;
+		ev.velocity = 0;
+		ev.duration = 0;
+		ev.port = _output_frequency;
+		_events.push_back(ev);
+	}
 
-			if (--loops == 0)
-				exit(0);
+	_duration -= sample_count - offset;
+}
 
-			printf("looping...\n");
-			_note_i = 0;
-		}
+const event_vector&
+simple_sequencer::events(unsigned int voice)
+{
+	assert(voice == 0);
 
-		_duration = _notes[_note_i + 1].timestamp
-			- _notes[_note_i].timestamp;
+	return _events;
+}
 
-		*_output_frequency = _notes[_note_i].frequency;
-	}
+/* Loops until it exits the program */
+bool
+simple_sequencer::done()
+{
+	return false;
 }
 
 #endif
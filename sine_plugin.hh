@@ -0,0 +1,91 @@
+#ifndef SINE_PLUGIN_HH
+#define SINE_PLUGIN_HH
+
+extern "C" {
+#include <math.h>
+}
+
+#include "plugin.hh"
+
+/* A free-running sine oscillator. Needs nothing but the sample rate, so
+ * it is handy for building graphs without any LADSPA libraries. */
+class sine_plugin:
+	public plugin
+{
+public:
+	sine_plugin(float frequency);
+	~sine_plugin();
+
+public:
+	bool is_audio_output(unsigned int port);
+
+	void run(unsigned int sample_count);
+
+private:
+	double _phase;
+};
+
+sine_plugin::sine_plugin(float frequency):
+	_phase(0)
+{
+	_nr_ports = 3;
+	_ports = new float*[3];
+
+	/* Bound by the graph */
+	_ports[0] = 0;
+
+	_ports[1] = new float[1];	/* Frequency */
+	_ports[1][0] = frequency;
+	_ports[2] = new float[1];	/* Amplitude */
+	_ports[2][0] = 0.1;
+}
+
+sine_plugin::~sine_plugin()
+{
+	delete[] _ports[1];
+	delete[] _ports[2];
+	delete[] _ports;
+}
+
+bool
+sine_plugin::is_audio_output(unsigned int port)
+{
+	return port == 0;
+}
+
+void
+sine_plugin::run(unsigned int sample_count)
+{
+	float* out = _ports[0];
+	const float* frequency = _ramps[1];
+	const float* amplitudes = _ramps[2];
+
+	/* Automated: follow the ramps */
+	if (frequency || amplitudes) {
+		double scale = 2 * M_PI / sample_rate;
+
+		for (unsigned int i = 0; i < sample_count; ++i) {
+			float amplitude = amplitudes ? amplitudes[i] : _ports[2][0];
+			out[i] = amplitude * sinf(_phase);
+
+			_phase += scale * (frequency ? frequency[i] : _ports[1][0]);
+			if (_phase >= 2 * M_PI)
+				_phase -= 2 * M_PI;
+		}
+
+		return;
+	}
+
+	float amplitude = _ports[2][0];
+	double step = 2 * M_PI * _ports[1][0] / sample_rate;
+
+	for (unsigned int i = 0; i < sample_count; ++i) {
+		out[i] = amplitude * sinf(_phase);
+
+		_phase += step;
+		if (_phase >= 2 * M_PI)
+			_phase -= 2 * M_PI;
+	}
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef SINE_VOICE_PLUGIN_HH
+#define SINE_VOICE_PLUGIN_HH
+
+extern "C" {
+#include <math.h>
+}
+
+#include "event.hh"
+#include "plugin.hh"
+
+/* A monophonic sine voice with an attack/release envelope, for use in a
+ * poly_plugin pool. The ports are laid out like the first ones of the
+ * CMT organ: 0 is the output, 1 the gate, 2 the velocity and 3 the
+ * frequency, followed by 4 attack and 5 release, in seconds.
+ *
+ * Every note starts from silence at phase zero, even on a voice that is
+ * still sounding, so the same note always comes out the same and the
+ * voice can be _deterministic. The price is a click when a sounding
+ * voice is stolen. */
+class sine_voice_plugin:
+	public plugin
+{
+public:
+	sine_voice_plugin();
+	~sine_voice_plugin();
+
+public:
+	bool is_audio_output(unsigned int port);
+
+	void run(unsigned int sample_count);
+
+private:
+	void render(float* out, unsigned int n);
+
+private:
+	double _phase;
+	float _env;
+};
+
+sine_voice_plugin::sine_voice_plugin():
+	_phase(0),
+	_env(0)
+{
+	_bypass = true;
+	_deterministic = true;
+
+	_nr_ports = 6;
+	_ports = new float*[6];
+
+	/* Bound by the graph */
+	_ports[0] = 0;
+
+	for (unsigned int i = 1; i < 6; ++i)
+		_ports[i] = new float[1]();
+
+	_ports[2][0] = 1;	/* Velocity */
+	_ports[3][0] = 440;	/* Frequency */
+	_ports[4][0] = 0.01;	/* Attack */
+	_ports[5][0] = 0.1;	/* Release */
+}
+
+sine_voice_plugin::~sine_voice_plugin()
+{
+	for (unsigned int i = 1; i < 6; ++i)
+		delete[] _ports[i];
+
+	delete[] _ports;
+}
+
+bool
+sine_voice_plugin::is_audio_output(unsigned int port)
+{
+	return port == 0;
+}
+
+/* One-pole approach to the gate, about 1/e of the way per attack or
+ * release time */
+void
+sine_voice_plugin::render(float* out, unsigned int n)
+{
+	bool gate = _ports[1][0] != 0;
+	float seconds = gate ? _ports[4][0] : _ports[5][0];
+	if (seconds < 0.001)
+		seconds = 0.001;
+
+	float target = gate ? 1 : 0;
+	float coeff = 1 - expf(-1. / (seconds * sample_rate));
+	float amplitude = 0.1 * _ports[2][0];
+	double step = 2 * M_PI * _ports[3][0] / sample_rate;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		_env += (target - _env) * coeff;
+		out[i] = amplitude * _env * sinf(_phase);
+
+		_phase += step;
+		if (_phase >= 2 * M_PI)
+			_phase -= 2 * M_PI;
+	}
+}
+
+void
+sine_voice_plugin::run(unsigned int sample_count)
+{
+	float* out = _ports[0];
+	unsigned int offset = 0;
+
+	for (unsigned int i = 0, n = _events.size(); i < n; ++i) {
+		const event& e = _events[i];
+
+		render(out + offset, e.offset - offset);
+		offset = e.offset;
+
+		if (e.port)
+			*e.port = e.value;
+
+		if (e.type == EVENT_GATE && e.value != 0) {
+			_phase = 0;
+			_env = 0;
+		}
+	}
+
+	render(out + offset, sample_count - offset);
+}
+
+#endif
@@ -6,6 +6,7 @@ extern "C" {
 #include <sndfile.h>
 }
 
+#include "convert_kernels.hh"
 #include "plugin.hh"
 
 class wav_output_plugin:
@@ -22,6 +23,8 @@ public:
 	void connect(unsigned int port, float* buffer);
 	void disconnect(unsigned int port);
 
+	bool is_audio_input(unsigned int port);
+
 	void run(unsigned int sample_count);
 
 private:
@@ -31,6 +34,7 @@ private:
 
 wav_output_plugin::wav_output_plugin(const char* filename)
 {
+	_nr_ports = 2;
 	_ports = new float*[2];
 
 	SF_INFO info;
@@ -77,17 +81,21 @@ wav_output_plugin::disconnect(unsigned int port)
 	plugin::disconnect(port);
 }
 
+bool
+wav_output_plugin::is_audio_input(unsigned int port)
+{
+	return port < 2;
+}
+
 void
 wav_output_plugin::run(unsigned int n)
 {
-	for (unsigned int i = 0; i < n; ++i) {
-		_output_buffer[2 * i + 0] = _ports[0][i];
-		_output_buffer[2 * i + 1] = _ports[1][i];
-	}
+	interleave(_output_buffer, _ports, 2, n);
 
 	unsigned int i = 0;
 	while (n > 0) {
-		sf_count_t c = sf_writef_float(_file, _output_buffer + i, n);
+		sf_count_t c = sf_writef_float(_file,
+			_output_buffer + 2 * i, n);
 		if (c < 0) {
 			exit(1);
 		}